@@ -0,0 +1,125 @@
+// brokerBench.cpp : measures ConnectionBroker matching throughput as io threads and shards are added.
+//
+// every ID is registered once as a server and once as a viewer, from all io threads at once,
+// in the same way the acceptors hand connections to the broker. matching runs on the shard
+// strands exactly as in the repeater, without any sockets involved.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "asio.hpp"
+
+#include "../vncRepeater/broker.h"
+
+using namespace std;
+
+namespace {
+	using Waiter = weak_ptr<int>;
+
+	struct Run
+	{
+		size_t threads;
+		size_t shards;
+		double seconds;
+	};
+
+	void registerId(BrokerShards<Waiter>& shards, const string& id, const shared_ptr<int>& owner, bool isServer, atomic<size_t>& matches)
+	{
+		size_t hash = hashId(id);
+		auto& shard = shards.shardFor(hash);
+
+		shard.strand.post([&shard, &id, &owner, &matches, hash, isServer]() {
+			auto& fromWaiting = isServer ? shard.waitingViewers : shard.waitingServers;
+			auto& toWaiting = isServer ? shard.waitingServers : shard.waitingViewers;
+
+			shared_ptr<int> matched;
+			Waiter waiting;
+			if (fromWaiting.take(hash, id, [&matched](const Waiter& w) {
+				matched = w.lock();
+				return !!matched;
+			}, waiting)) {
+				matches.fetch_add(1, memory_order_relaxed);
+				return;
+			}
+
+			toWaiting.insert(hash, id, owner);
+		});
+	}
+
+	Run runOnce(const vector<string>& ids, const vector<shared_ptr<int>>& owners, size_t threadCount, size_t shardCount)
+	{
+		asio::io_service ioService;
+		BrokerShards<Waiter> shards({ &ioService }, shardCount);
+		atomic<size_t> matches(0);
+
+		// each io thread registers its own slice of IDs, servers first for even IDs and viewers first for odd ones
+		for (size_t t = 0; t < threadCount; ++t) {
+			ioService.post([&, t]() {
+				for (size_t i = t; i < ids.size(); i += threadCount) {
+					registerId(shards, ids[i], owners[i], (i & 1) == 0, matches);
+				}
+				for (size_t i = t; i < ids.size(); i += threadCount) {
+					registerId(shards, ids[i], owners[i], (i & 1) != 0, matches);
+				}
+			});
+		}
+
+		auto start = chrono::steady_clock::now();
+
+		vector<thread> threads;
+		for (size_t t = 0; t < threadCount; ++t) {
+			threads.push_back(thread([&ioService]() {
+				ioService.run();
+			}));
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		if (matches.load() != ids.size()) {
+			printf("error: %zu of %zu IDs matched\n", matches.load(), ids.size());
+		}
+
+		return{ threadCount, shardCount, elapsed };
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t idCount = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+	size_t maxThreads = argc > 2 ? strtoul(argv[2], nullptr, 10) : max(1U, thread::hardware_concurrency());
+
+	vector<string> ids;
+	vector<shared_ptr<int>> owners;
+	for (size_t i = 0; i < idCount; ++i) {
+		ids.push_back("id" + to_string(i * 2654435761ULL % 1000000007ULL));
+		owners.push_back(make_shared<int>((int)i));
+	}
+
+	printf("%zu IDs, each registered as a server and a viewer\n\n", idCount);
+	printf("%8s %8s %14s %10s\n", "threads", "shards", "matches/s", "speedup");
+
+	double baseline = 0;
+	for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+		// a single shard serializes all matching, as the broker used to; 16 is the default
+		for (size_t shards : { (size_t)1, (size_t)16 }) {
+			auto run = runOnce(ids, owners, threads, shards);
+			double rate = idCount / run.seconds;
+			if (!baseline) {
+				baseline = rate;
+			}
+
+			printf("%8zu %8zu %14.0f %9.2fx\n", run.threads, run.shards, rate, rate / baseline);
+		}
+	}
+
+	return 0;
+}
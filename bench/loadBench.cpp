@@ -0,0 +1,721 @@
+// loadBench.cpp : drives a running repeater with simulated servers and viewers over real sockets.
+//
+// every pair connects its server first, sending the 250 byte ID block and its RFB banner, then its
+// viewer, which reads the repeater's RFB 000.000 banner and sends the same ID block. once the
+// server's banner arrives at the viewer the pair is matched. servers then send framebuffer-style
+// bursts and viewers send small input events, each message stamped with the time it was sent,
+// so the latency through the repeater is measured for each direction.
+//
+// pairs are spread over worker threads, each with its own io_service. start the repeater first;
+// its memory is sampled from /proc on Linux.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+#include "asio.hpp"
+
+using namespace std;
+
+namespace {
+	struct Options
+	{
+		string host = "127.0.0.1";
+		uint16_t serverPort = 5500;
+		uint16_t viewerPort = 5901;
+
+		size_t pairs = 100;
+		size_t threads = 1;
+
+		// handshakes in flight at once on each thread
+		size_t window = 64;
+
+		double seconds = 10;
+
+		size_t burstSize = 65536;
+		size_t burstInterval = 16;
+		size_t inputSize = 8;
+		size_t inputInterval = 10;
+
+		unsigned long pid = 0;
+	};
+
+	Options options;
+
+	// every message starts with the steady clock time it was sent, in nanoseconds
+	constexpr size_t stampSize = sizeof(int64_t);
+
+	int64_t now()
+	{
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// the payload after the stamp; its contents don't matter
+	vector<char> filler;
+
+	atomic<size_t> serversReady(0);
+	atomic<size_t> viewersMatched(0);
+	atomic<size_t> failures(0);
+
+	atomic<uint64_t> bytesDown(0);
+	atomic<uint64_t> bytesUp(0);
+	atomic<uint64_t> burstsSkipped(0);
+	atomic<uint64_t> inputsSkipped(0);
+
+	// splits a stream of fixed size messages and reports each one's latency once it is complete
+	struct MessageReader
+	{
+		size_t size = 0;
+		size_t offset = 0;
+		array<char, stampSize> stamp;
+
+		template <typename Sample>
+		void feed(const char* data, size_t bytes, Sample sample)
+		{
+			while (bytes) {
+				if (offset < stampSize) {
+					size_t stampBytes = min(bytes, stampSize - offset);
+					memcpy(&stamp[offset], data, stampBytes);
+				}
+
+				size_t take = min(bytes, size - offset);
+				offset += take;
+				data += take;
+				bytes -= take;
+
+				if (offset == size) {
+					int64_t sent;
+					memcpy(&sent, stamp.data(), sizeof(sent));
+					sample(now() - sent);
+					offset = 0;
+				}
+			}
+		}
+	};
+
+	class Pair;
+
+	struct Worker
+	{
+		asio::io_service ioService;
+		unique_ptr<asio::io_service::work> work;
+		thread runner;
+
+		vector<shared_ptr<Pair>> pairs;
+
+		size_t nextLaunch = 0;
+		size_t inFlight = 0;
+
+		bool measuring = false;
+
+		// microseconds; only touched by this worker's thread until it is joined
+		vector<uint32_t> matchLatency;
+		vector<uint32_t> downLatency;
+		vector<uint32_t> upLatency;
+
+		void launchServers();
+		void launchViewers();
+		void launched(bool viewers);
+	};
+
+	asio::ip::tcp::endpoint serverEndpoint;
+	asio::ip::tcp::endpoint viewerEndpoint;
+
+	uint32_t toMicroseconds(int64_t nanoseconds)
+	{
+		return (uint32_t)min<int64_t>(max<int64_t>(nanoseconds / 1000, 0), UINT32_MAX);
+	}
+
+	class Pair
+		: public enable_shared_from_this<Pair>
+	{
+	public:
+		Pair(Worker& worker, size_t index)
+			: worker_(worker)
+			, server_(worker.ioService)
+			, viewer_(worker.ioService)
+			, burstTimer_(worker.ioService)
+			, inputTimer_(worker.ioService)
+		{
+			idBlock_.fill(0);
+			snprintf(idBlock_.data(), idBlock_.size(), "ID:bench%zu", index);
+
+			down_.size = options.burstSize;
+			up_.size = options.inputSize;
+		}
+
+		void connectServer()
+		{
+			server_.async_connect(serverEndpoint, [this, self = shared_from_this()](const std::error_code& ec) {
+				if (ec) {
+					return fail(false);
+				}
+
+				server_.set_option(asio::ip::tcp::no_delay(true));
+
+				array<asio::const_buffer, 2> hello = { {
+					asio::buffer(idBlock_),
+					asio::buffer(serverBanner, sizeof(serverBanner) - 1)
+				} };
+
+				asio::async_write(server_, hello, [this, self](const std::error_code& ec, size_t) {
+					if (ec) {
+						return fail(false);
+					}
+
+					serversReady.fetch_add(1);
+					worker_.launched(false);
+				});
+			});
+		}
+
+		void connectViewer()
+		{
+			// its server never made it, so there's nothing to match; already counted as a failure
+			if (!server_.is_open()) {
+				worker_.launched(true);
+				return;
+			}
+
+			viewer_.async_connect(viewerEndpoint, [this, self = shared_from_this()](const std::error_code& ec) {
+				if (ec) {
+					return fail(true);
+				}
+
+				viewer_.set_option(asio::ip::tcp::no_delay(true));
+
+				asio::async_read(viewer_, asio::buffer(banner_), [this, self](const std::error_code& ec, size_t) {
+					if (ec || 0 != memcmp(banner_.data(), repeaterBanner, banner_.size())) {
+						return fail(true);
+					}
+
+					asio::async_write(viewer_, asio::buffer(idBlock_), [this, self](const std::error_code& ec, size_t) {
+						if (ec) {
+							return fail(true);
+						}
+
+						int64_t sent = now();
+
+						// the repeater passes the server's banner on once the two are matched
+						asio::async_read(viewer_, asio::buffer(banner_), [this, self, sent](const std::error_code& ec, size_t) {
+							if (ec || 0 != memcmp(banner_.data(), serverBanner, banner_.size())) {
+								return fail(true);
+							}
+
+							worker_.matchLatency.push_back(toMicroseconds(now() - sent));
+							viewersMatched.fetch_add(1);
+							worker_.launched(true);
+						});
+					});
+				});
+			});
+		}
+
+		void startTraffic()
+		{
+			if (!server_.is_open() || !viewer_.is_open()) {
+				return;
+			}
+
+			running_ = true;
+
+			readViewer();
+			readServer();
+
+			// stagger the pairs so their bursts don't all line up
+			scheduleBurst(chrono::milliseconds(rand() % (options.burstInterval + 1)));
+			scheduleInput(chrono::milliseconds(rand() % (options.inputInterval + 1)));
+		}
+
+		void stopTraffic()
+		{
+			running_ = false;
+
+			std::error_code dontCare;
+			burstTimer_.cancel(dontCare);
+			inputTimer_.cancel(dontCare);
+		}
+
+		void close()
+		{
+			stopTraffic();
+
+			std::error_code dontCare;
+			server_.close(dontCare);
+			viewer_.close(dontCare);
+		}
+
+	private:
+		static constexpr char serverBanner[] = "RFB 003.008\n";
+		static constexpr char repeaterBanner[] = "RFB 000.000\n";
+
+		void fail(bool viewer)
+		{
+			failures.fetch_add(1);
+
+			std::error_code dontCare;
+			server_.close(dontCare);
+			viewer_.close(dontCare);
+
+			worker_.launched(viewer);
+		}
+
+		void failTraffic()
+		{
+			failures.fetch_add(1);
+			close();
+		}
+
+		void scheduleBurst(chrono::milliseconds delay)
+		{
+			burstTimer_.expires_from_now(delay);
+			burstTimer_.async_wait([this, self = shared_from_this()](const std::error_code& ec) {
+				if (ec || !running_) {
+					return;
+				}
+
+				// a burst still being written means the repeater isn't keeping up; drop this one
+				if (writingBurst_) {
+					burstsSkipped.fetch_add(1, memory_order_relaxed);
+				}
+				else {
+					writingBurst_ = true;
+					write(server_, burstStamp_, options.burstSize, writingBurst_);
+				}
+
+				scheduleBurst(chrono::milliseconds(options.burstInterval));
+			});
+		}
+
+		void scheduleInput(chrono::milliseconds delay)
+		{
+			inputTimer_.expires_from_now(delay);
+			inputTimer_.async_wait([this, self = shared_from_this()](const std::error_code& ec) {
+				if (ec || !running_) {
+					return;
+				}
+
+				if (writingInput_) {
+					inputsSkipped.fetch_add(1, memory_order_relaxed);
+				}
+				else {
+					writingInput_ = true;
+					write(viewer_, inputStamp_, options.inputSize, writingInput_);
+				}
+
+				scheduleInput(chrono::milliseconds(options.inputInterval));
+			});
+		}
+
+		void write(asio::ip::tcp::socket& socket, array<char, stampSize>& stamp, size_t size, bool& writing)
+		{
+			int64_t sent = now();
+			memcpy(stamp.data(), &sent, sizeof(sent));
+
+			array<asio::const_buffer, 2> message = { {
+				asio::buffer(stamp),
+				asio::buffer(filler.data(), size - stampSize)
+			} };
+
+			asio::async_write(socket, message, [this, self = shared_from_this(), &writing](const std::error_code& ec, size_t) {
+				writing = false;
+				if (ec && running_) {
+					failTraffic();
+				}
+			});
+		}
+
+		void readViewer()
+		{
+			viewer_.async_read_some(asio::buffer(viewerBuffer_), [this, self = shared_from_this()](const std::error_code& ec, size_t bytes) {
+				if (ec) {
+					return;
+				}
+
+				bytesDown.fetch_add(bytes, memory_order_relaxed);
+				down_.feed(viewerBuffer_.data(), bytes, [this](int64_t latency) {
+					if (worker_.measuring) {
+						worker_.downLatency.push_back(toMicroseconds(latency));
+					}
+				});
+
+				readViewer();
+			});
+		}
+
+		void readServer()
+		{
+			server_.async_read_some(asio::buffer(serverBuffer_), [this, self = shared_from_this()](const std::error_code& ec, size_t bytes) {
+				if (ec) {
+					return;
+				}
+
+				bytesUp.fetch_add(bytes, memory_order_relaxed);
+				up_.feed(serverBuffer_.data(), bytes, [this](int64_t latency) {
+					if (worker_.measuring) {
+						worker_.upLatency.push_back(toMicroseconds(latency));
+					}
+				});
+
+				readServer();
+			});
+		}
+
+		Worker& worker_;
+
+		asio::ip::tcp::socket server_;
+		asio::ip::tcp::socket viewer_;
+
+		array<char, 250> idBlock_;
+		array<char, 12> banner_;
+
+		asio::steady_timer burstTimer_;
+		asio::steady_timer inputTimer_;
+
+		bool running_ = false;
+		bool writingBurst_ = false;
+		bool writingInput_ = false;
+
+		array<char, stampSize> burstStamp_;
+		array<char, stampSize> inputStamp_;
+
+		MessageReader down_;
+		MessageReader up_;
+
+		array<char, 0x4000> viewerBuffer_;
+		array<char, 0x1000> serverBuffer_;
+	};
+
+	constexpr char Pair::serverBanner[];
+	constexpr char Pair::repeaterBanner[];
+
+	void Worker::launchServers()
+	{
+		while (inFlight < options.window && nextLaunch < pairs.size()) {
+			++inFlight;
+			pairs[nextLaunch++]->connectServer();
+		}
+	}
+
+	void Worker::launchViewers()
+	{
+		while (inFlight < options.window && nextLaunch < pairs.size()) {
+			++inFlight;
+			pairs[nextLaunch++]->connectViewer();
+		}
+	}
+
+	void Worker::launched(bool viewers)
+	{
+		--inFlight;
+		if (viewers) {
+			launchViewers();
+		}
+		else {
+			launchServers();
+		}
+	}
+
+	// resident memory of a process in KiB, or 0 if it can't be read
+	size_t residentKiB(unsigned long pid)
+	{
+#ifdef __linux__
+		if (!pid) {
+			return 0;
+		}
+
+		char path[64];
+		snprintf(path, sizeof(path), "/proc/%lu/status", pid);
+
+		FILE* file = fopen(path, "r");
+		if (!file) {
+			return 0;
+		}
+
+		size_t kib = 0;
+		char line[256];
+		while (fgets(line, sizeof(line), file)) {
+			if (1 == sscanf(line, "VmRSS: %zu kB", &kib)) {
+				break;
+			}
+		}
+		fclose(file);
+		return kib;
+#else
+		return 0;
+#endif
+	}
+
+	// the pid of a running vncRepeater, or 0
+	unsigned long findRepeater()
+	{
+#ifdef __linux__
+		DIR* dir = opendir("/proc");
+		if (!dir) {
+			return 0;
+		}
+
+		unsigned long found = 0;
+		while (auto entry = readdir(dir)) {
+			unsigned long pid = strtoul(entry->d_name, nullptr, 10);
+			if (!pid) {
+				continue;
+			}
+
+			char path[64];
+			snprintf(path, sizeof(path), "/proc/%lu/comm", pid);
+
+			char name[64] = { 0 };
+			FILE* file = fopen(path, "r");
+			if (file) {
+				if (fgets(name, sizeof(name), file) && 0 == strcmp(name, "vncRepeater\n")) {
+					found = pid;
+				}
+				fclose(file);
+			}
+			if (found) {
+				break;
+			}
+		}
+		closedir(dir);
+		return found;
+#else
+		return 0;
+#endif
+	}
+
+	// run on every worker's thread and wait for all of them to finish
+	template <typename Function>
+	void onWorkers(vector<unique_ptr<Worker>>& workers, Function function)
+	{
+		atomic<size_t> remaining(workers.size());
+		for (auto& worker : workers) {
+			worker->ioService.post([&remaining, &function, &worker]() {
+				function(*worker);
+				remaining.fetch_sub(1);
+			});
+		}
+		while (remaining.load()) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	}
+
+	// wait until `counter` plus failures reaches `target`, or give up `timeout` seconds after `start`
+	double waitFor(atomic<size_t>& counter, size_t target, double timeout, chrono::steady_clock::time_point start)
+	{
+		for (;;) {
+			double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			if (counter.load() + failures.load() >= target || elapsed > timeout) {
+				return elapsed;
+			}
+			this_thread::sleep_for(chrono::microseconds(200));
+		}
+	}
+
+	void printPercentiles(const char* name, vector<uint32_t>& samples)
+	{
+		if (samples.empty()) {
+			printf("%-16s no samples\n", name);
+			return;
+		}
+
+		sort(samples.begin(), samples.end());
+		auto at = [&samples](double p) {
+			return samples[(size_t)(p * (samples.size() - 1))];
+		};
+
+		printf("%-16s p50 %8u  p90 %8u  p99 %8u  p99.9 %8u  max %8u us  (%zu samples)\n"
+			, name, at(0.5), at(0.9), at(0.99), at(0.999), samples.back(), samples.size());
+	}
+
+	template <typename T>
+	bool parseNumber(const char* value, T& number)
+	{
+		char* end = nullptr;
+		double parsed = strtod(value, &end);
+		if (end == value || *end || parsed < 0) {
+			return false;
+		}
+		number = (T)parsed;
+		return true;
+	}
+
+	bool parseOptions(int argc, char* argv[])
+	{
+		for (int i = 1; i < argc; ++i) {
+			const char* arg = argv[i];
+			const char* value = strchr(arg, '=');
+			if (0 != strncmp(arg, "--", 2) || !value) {
+				return false;
+			}
+
+			string name(arg + 2, value++);
+			bool ok =
+				name == "host" ? (options.host = value, true) :
+				name == "serverPort" ? parseNumber(value, options.serverPort) :
+				name == "viewerPort" ? parseNumber(value, options.viewerPort) :
+				name == "pairs" ? parseNumber(value, options.pairs) :
+				name == "threads" ? parseNumber(value, options.threads) :
+				name == "window" ? parseNumber(value, options.window) :
+				name == "seconds" ? parseNumber(value, options.seconds) :
+				name == "burst" ? parseNumber(value, options.burstSize) :
+				name == "burstInterval" ? parseNumber(value, options.burstInterval) :
+				name == "input" ? parseNumber(value, options.inputSize) :
+				name == "inputInterval" ? parseNumber(value, options.inputInterval) :
+				name == "pid" ? parseNumber(value, options.pid) :
+				false;
+
+			if (!ok) {
+				return false;
+			}
+		}
+
+		options.threads = max<size_t>(options.threads, 1);
+		options.window = max<size_t>(options.window, 1);
+		options.burstSize = max(options.burstSize, stampSize);
+		options.inputSize = max(options.inputSize, stampSize);
+		options.burstInterval = max<size_t>(options.burstInterval, 1);
+		options.inputInterval = max<size_t>(options.inputInterval, 1);
+		return true;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (!parseOptions(argc, argv)) {
+		puts("usage: loadBench [--host=127.0.0.1] [--serverPort=5500] [--viewerPort=5901] [--pairs=100] [--threads=1]\n"
+			"                 [--window=64] [--seconds=10] [--burst=65536] [--burstInterval=16] [--input=8] [--inputInterval=10]\n"
+			"                 [--pid=repeater pid, found by name if omitted]");
+		return 1;
+	}
+
+	auto address = asio::ip::address::from_string(options.host);
+	serverEndpoint = asio::ip::tcp::endpoint(address, options.serverPort);
+	viewerEndpoint = asio::ip::tcp::endpoint(address, options.viewerPort);
+
+	filler.assign(max(options.burstSize, options.inputSize), 'x');
+
+	unsigned long pid = options.pid ? options.pid : findRepeater();
+
+	printf("%zu pairs on %zu threads; %zu byte bursts every %zu ms, %zu byte input every %zu ms, for %.1f s\n\n"
+		, options.pairs, options.threads
+		, options.burstSize, options.burstInterval
+		, options.inputSize, options.inputInterval
+		, options.seconds);
+
+	vector<unique_ptr<Worker>> workers;
+	for (size_t t = 0; t < options.threads; ++t) {
+		workers.emplace_back(new Worker());
+		auto& worker = *workers.back();
+		worker.work.reset(new asio::io_service::work(worker.ioService));
+	}
+	for (size_t i = 0; i < options.pairs; ++i) {
+		auto& worker = *workers[i % workers.size()];
+		worker.pairs.push_back(make_shared<Pair>(worker, i));
+	}
+	for (auto& worker : workers) {
+		auto ioService = &worker->ioService;
+		worker->runner = thread([ioService]() {
+			ioService->run();
+		});
+	}
+
+	size_t rssBefore = residentKiB(pid);
+
+	// servers connect and wait first, so a viewer's match latency is the broker and relay setup alone
+	auto serverStart = chrono::steady_clock::now();
+	onWorkers(workers, [](Worker& worker) {
+		worker.nextLaunch = 0;
+		worker.launchServers();
+	});
+	double serverSeconds = waitFor(serversReady, options.pairs, 30, serverStart);
+
+	auto viewerStart = chrono::steady_clock::now();
+	onWorkers(workers, [](Worker& worker) {
+		worker.nextLaunch = 0;
+		worker.launchViewers();
+	});
+	double viewerSeconds = waitFor(viewersMatched, options.pairs, 30, viewerStart);
+
+	size_t rssIdle = residentKiB(pid);
+
+	onWorkers(workers, [](Worker& worker) {
+		worker.measuring = true;
+		for (auto& pair : worker.pairs) {
+			pair->startTraffic();
+		}
+	});
+
+	uint64_t downStart = bytesDown.load();
+	uint64_t upStart = bytesUp.load();
+	auto trafficStart = chrono::steady_clock::now();
+
+	this_thread::sleep_for(chrono::duration<double>(options.seconds));
+
+	uint64_t down = bytesDown.load() - downStart;
+	uint64_t up = bytesUp.load() - upStart;
+	double trafficSeconds = chrono::duration<double>(chrono::steady_clock::now() - trafficStart).count();
+
+	size_t rssLoaded = residentKiB(pid);
+
+	onWorkers(workers, [](Worker& worker) {
+		worker.measuring = false;
+		for (auto& pair : worker.pairs) {
+			pair->close();
+		}
+	});
+
+	vector<uint32_t> matchLatency;
+	vector<uint32_t> downLatency;
+	vector<uint32_t> upLatency;
+	for (auto& worker : workers) {
+		worker->work.reset();
+		worker->ioService.stop();
+		worker->runner.join();
+
+		matchLatency.insert(matchLatency.end(), worker->matchLatency.begin(), worker->matchLatency.end());
+		downLatency.insert(downLatency.end(), worker->downLatency.begin(), worker->downLatency.end());
+		upLatency.insert(upLatency.end(), worker->upLatency.begin(), worker->upLatency.end());
+	}
+
+	size_t matched = viewersMatched.load();
+
+	printf("servers          %zu ready in %.3f s, %.0f handshakes/s\n", serversReady.load(), serverSeconds, serversReady.load() / serverSeconds);
+	printf("viewers          %zu matched in %.3f s, %.0f handshakes/s\n", matched, viewerSeconds, matched / viewerSeconds);
+	if (failures.load()) {
+		printf("failures         %zu connections\n", failures.load());
+	}
+	printPercentiles("match", matchLatency);
+
+	printf("server->viewer   %10.2f MB/s  (%llu bursts skipped while the previous was still being written)\n"
+		, down / trafficSeconds / 1e6, (unsigned long long)burstsSkipped.load());
+	printf("viewer->server   %10.2f MB/s  (%llu input events skipped)\n"
+		, up / trafficSeconds / 1e6, (unsigned long long)inputsSkipped.load());
+	printPercentiles("server->viewer", downLatency);
+	printPercentiles("viewer->server", upLatency);
+
+	if (rssBefore && matched) {
+		// two sockets per pair on the repeater's side
+		printf("repeater rss     %zu KiB before, %.1f KiB per connection matched, %.1f KiB per connection under load\n"
+			, rssBefore
+			, (double)(rssIdle - min(rssIdle, rssBefore)) / (matched * 2)
+			, (double)(rssLoaded - min(rssLoaded, rssBefore)) / (matched * 2));
+	}
+	else {
+		printf("repeater rss     unavailable; pass --pid on Linux\n");
+	}
+
+	return failures.load() ? 2 : 0;
+}
@@ -0,0 +1,197 @@
+// schedulerBench.cpp : compares the ways the repeater can run its io threads, with uneven load.
+//
+// handler chains stand in for connections: each has a home io_service, as a socket belongs to the
+// io_service it was accepted on, and every step of a chain is posted back to its home. the chains of
+// the first thread do several times the work of the rest, as when the kernel happens to hand one
+// thread the busiest sessions. with all threads sharing one io_service any thread runs any step; with
+// an io_service per thread the first thread falls behind while the rest wait; with the stealing
+// scheduler the rest run its steps once they have nothing of their own.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "asio.hpp"
+
+#include "../vncRepeater/scheduler.h"
+
+using namespace std;
+
+namespace {
+	int64_t now()
+	{
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	enum class Mode
+	{
+		shared,
+		perThread,
+		stealing,
+	};
+
+	const char* modeName(Mode mode)
+	{
+		switch (mode) {
+		case Mode::shared: return "shared";
+		case Mode::perThread: return "perThread";
+		case Mode::stealing: return "stealing";
+		}
+		return "";
+	}
+
+	struct Bench
+	{
+		vector<unique_ptr<asio::io_service>> services;
+
+		size_t threadCount = 0;
+		int64_t workNs = 0;
+		int64_t heavyWorkNs = 0;
+		int64_t deadline = 0;
+
+		// nanoseconds from posting each step until it ran; each chain keeps its own
+		vector<vector<int64_t>> waits;
+
+		atomic<size_t> running{ 0 };
+
+		void finish()
+		{
+			if (running.fetch_sub(1) == 1) {
+				for (auto& ioService : services) {
+					ioService->stop();
+				}
+			}
+		}
+	};
+
+	void post(Bench& bench, size_t chain);
+
+	struct Step
+	{
+		Bench* bench;
+		size_t chain;
+		int64_t posted;
+
+		void operator()()
+		{
+			int64_t started = now();
+			bench->waits[chain].push_back(started - posted);
+
+			int64_t work = chain % bench->threadCount == 0 ? bench->heavyWorkNs : bench->workNs;
+			while (now() - started < work) {
+			}
+
+			if (started < bench->deadline) {
+				post(*bench, chain);
+			}
+			else {
+				bench->finish();
+			}
+		}
+	};
+
+	void post(Bench& bench, size_t chain)
+	{
+		auto& home = *bench.services[(chain % bench.threadCount) % bench.services.size()];
+		home.post(Step{ &bench, chain, now() });
+	}
+
+	struct Result
+	{
+		double stepsPerSecond;
+		int64_t p50;
+		int64_t p99;
+		int64_t p999;
+	};
+
+	Result run(Mode mode, size_t threadCount, size_t chainCount, double seconds, int64_t workNs, int64_t heavyWorkNs)
+	{
+		Bench bench;
+		for (size_t i = 0; i < (mode == Mode::shared ? 1 : threadCount); ++i) {
+			bench.services.emplace_back(new asio::io_service());
+		}
+
+		vector<asio::io_service*> services;
+		for (auto& ioService : bench.services) {
+			services.push_back(ioService.get());
+		}
+
+		// every io_service runs until the last chain stops them, even one whose own chains are done
+		unique_ptr<StealingScheduler> scheduler(mode == Mode::stealing ? new StealingScheduler(services) : nullptr);
+		vector<unique_ptr<asio::io_service::work>> works;
+		for (auto ioService : services) {
+			works.emplace_back(new asio::io_service::work(*ioService));
+		}
+
+		bench.threadCount = threadCount;
+		bench.workNs = workNs;
+		bench.heavyWorkNs = heavyWorkNs;
+		bench.waits.resize(chainCount);
+		bench.running = chainCount;
+
+		int64_t start = now();
+		bench.deadline = start + (int64_t)(seconds * 1e9);
+
+		for (size_t chain = 0; chain < chainCount; ++chain) {
+			post(bench, chain);
+		}
+
+		vector<thread> threads;
+		for (size_t t = 0; t < threadCount; ++t) {
+			threads.push_back(thread([&bench, &scheduler, mode, t]() {
+				if (scheduler) {
+					scheduler->run(t);
+				}
+				else {
+					bench.services[mode == Mode::shared ? 0 : t]->run();
+				}
+			}));
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		double elapsed = (now() - start) / 1e9;
+
+		vector<int64_t> waits;
+		for (auto& chainWaits : bench.waits) {
+			waits.insert(waits.end(), chainWaits.begin(), chainWaits.end());
+		}
+		sort(waits.begin(), waits.end());
+
+		auto percentile = [&waits](double fraction) {
+			return waits.empty() ? 0 : waits[min(waits.size() - 1, (size_t)(waits.size() * fraction))];
+		};
+
+		return{ waits.size() / elapsed, percentile(0.5), percentile(0.99), percentile(0.999) };
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	double seconds = argc > 1 ? atof(argv[1]) : 2;
+	int64_t workNs = argc > 2 ? strtoul(argv[2], nullptr, 10) * 1000 : 2000;
+	int64_t heavy = argc > 3 ? strtoul(argv[3], nullptr, 10) : 8;
+
+	printf("%u cores, %.1f us of work per step and %.1f us on the first thread's chains, %.1f s per run\n\n",
+		thread::hardware_concurrency(), workNs / 1e3, workNs * heavy / 1e3, seconds);
+	printf("%7s %-10s %12s %9s %9s %9s\n", "threads", "scheduler", "steps/s", "p50 us", "p99 us", "p99.9 us");
+
+	for (size_t threadCount : { 4, 8, 16 }) {
+		size_t chainCount = threadCount * 8;
+
+		for (Mode mode : { Mode::shared, Mode::perThread, Mode::stealing }) {
+			auto result = run(mode, threadCount, chainCount, seconds, workNs, workNs * heavy);
+			printf("%7zu %-10s %12.0f %9.1f %9.1f %9.1f\n", threadCount, modeName(mode), result.stepsPerSecond,
+				result.p50 / 1e3, result.p99 / 1e3, result.p999 / 1e3);
+		}
+	}
+
+	return 0;
+}
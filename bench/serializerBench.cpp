@@ -0,0 +1,180 @@
+// serializerBench.cpp : compares asio::strand with the repeater's Serializer as the number of sessions grows.
+//
+// a fixed number of handler chains runs on a pool of io threads. each step of a chain is posted
+// to the io_service wrapped in the strand of a session, as a socket completion would be, does a
+// little work, and moves the chain on to its next session. chains never visit the same session
+// at once, so any wait for a strand is two unrelated sessions colliding on one of the shared
+// implementations asio hashes strands onto. the number of chains is the same in every run, so
+// the io_service queue is as long however many sessions there are, and only that wait changes.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "asio.hpp"
+
+#include "../vncRepeater/serializer.h"
+
+using namespace std;
+
+namespace {
+	int64_t now()
+	{
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	template <typename Strand>
+	struct Session
+	{
+		explicit Session(asio::io_service& ioService)
+			: strand(ioService)
+		{}
+
+		Strand strand;
+
+		// set while one of its steps runs; finding it set means the strand let two run at once
+		bool inside = false;
+	};
+
+	template <typename Strand>
+	struct Bench
+	{
+		asio::io_service ioService;
+		vector<unique_ptr<Session<Strand>>> sessions;
+
+		size_t chainCount = 0;
+		int64_t workNs = 0;
+		int64_t deadline = 0;
+
+		// nanoseconds from posting each step until it ran; each chain keeps its own
+		vector<vector<int64_t>> waits;
+
+		atomic<size_t> overlaps{ 0 };
+	};
+
+	template <typename Strand>
+	struct Step
+	{
+		Bench<Strand>* bench;
+		size_t chain;
+		size_t session;
+		int64_t posted;
+
+		void operator()()
+		{
+			int64_t started = now();
+			bench->waits[chain].push_back(started - posted);
+
+			auto& current = *bench->sessions[session];
+			if (current.inside) {
+				bench->overlaps.fetch_add(1, memory_order_relaxed);
+			}
+			current.inside = true;
+
+			while (now() - started < bench->workNs) {
+			}
+
+			current.inside = false;
+
+			if (started < bench->deadline) {
+				post(*bench, chain, (session + bench->chainCount) % bench->sessions.size());
+			}
+		}
+	};
+
+	template <typename Strand>
+	void post(Bench<Strand>& bench, size_t chain, size_t session)
+	{
+		bench.ioService.post(bench.sessions[session]->strand.wrap(Step<Strand>{ &bench, chain, session, now() }));
+	}
+
+	struct Result
+	{
+		double stepsPerSecond;
+		int64_t p50;
+		int64_t p99;
+		int64_t p999;
+		size_t overlaps;
+	};
+
+	template <typename Strand>
+	Result run(size_t threadCount, size_t sessionCount, size_t chainCount, double seconds, int64_t workNs)
+	{
+		Bench<Strand> bench;
+		for (size_t i = 0; i < sessionCount; ++i) {
+			bench.sessions.emplace_back(new Session<Strand>(bench.ioService));
+		}
+
+		bench.chainCount = chainCount;
+		bench.workNs = workNs;
+		bench.waits.resize(chainCount);
+
+		int64_t start = now();
+		bench.deadline = start + (int64_t)(seconds * 1e9);
+
+		for (size_t chain = 0; chain < chainCount; ++chain) {
+			post(bench, chain, chain);
+		}
+
+		vector<thread> threads;
+		for (size_t t = 0; t < threadCount; ++t) {
+			threads.push_back(thread([&bench]() {
+				bench.ioService.run();
+			}));
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		double elapsed = (now() - start) / 1e9;
+
+		vector<int64_t> waits;
+		for (auto& chainWaits : bench.waits) {
+			waits.insert(waits.end(), chainWaits.begin(), chainWaits.end());
+		}
+		sort(waits.begin(), waits.end());
+
+		auto percentile = [&waits](double fraction) {
+			return waits.empty() ? 0 : waits[min(waits.size() - 1, (size_t)(waits.size() * fraction))];
+		};
+
+		return{ waits.size() / elapsed, percentile(0.5), percentile(0.99), percentile(0.999), bench.overlaps.load() };
+	}
+
+	void print(const char* kind, size_t sessionCount, const Result& result)
+	{
+		printf("%9zu %-11s %12.0f %9.1f %9.1f %9.1f\n", sessionCount, kind, result.stepsPerSecond,
+			result.p50 / 1e3, result.p99 / 1e3, result.p999 / 1e3);
+
+		if (result.overlaps) {
+			printf("error: %zu steps ran while another step of their session was running\n", result.overlaps);
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t threadCount = argc > 1 ? strtoul(argv[1], nullptr, 10) : max(4U, thread::hardware_concurrency());
+	double seconds = argc > 2 ? atof(argv[2]) : 2;
+	int64_t workNs = argc > 3 ? strtoul(argv[3], nullptr, 10) * 1000 : 2000;
+	size_t maxSessions = argc > 4 ? strtoul(argv[4], nullptr, 10) : 16384;
+
+	size_t chainCount = threadCount * 8;
+
+	printf("%zu io threads on %u cores, %zu chains, %.1f us of work per step, %.1f s per run\n\n",
+		threadCount, thread::hardware_concurrency(), chainCount, workNs / 1e3, seconds);
+	printf("%9s %-11s %12s %9s %9s %9s\n", "sessions", "strand", "steps/s", "p50 us", "p99 us", "p99.9 us");
+
+	for (size_t sessionCount = chainCount; sessionCount <= maxSessions; sessionCount *= 4) {
+		print("asio", sessionCount, run<asio::strand>(threadCount, sessionCount, chainCount, seconds, workNs));
+		print("Serializer", sessionCount, run<Serializer>(threadCount, sessionCount, chainCount, seconds, workNs));
+	}
+
+	return 0;
+}
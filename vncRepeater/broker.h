@@ -0,0 +1,245 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include "serializer.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// FNV-1a; IDs are short, and the same hash picks the shard and the table slot
+inline size_t hashId(const std::string& id)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char c : id) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return (size_t)(hash ^ (hash >> 32));
+}
+
+// open addressing hash table of waiting entries keyed by ID, with linear probing.
+// several entries may wait on one ID; the full hash is compared before the ID, so a
+// lookup rarely touches a string it does not match.
+// not thread safe; each table is owned by one strand.
+template <typename Value>
+class WaitingTable
+{
+public:
+	explicit WaitingTable(size_t initialCapacity = 64)
+	{
+		size_t capacity = 16;
+		while (capacity < initialCapacity) {
+			capacity *= 2;
+		}
+		slots_.resize(capacity);
+	}
+
+	WaitingTable(const WaitingTable&) = delete;
+	WaitingTable& operator=(const WaitingTable&) = delete;
+
+	size_t size() const
+	{
+		return size_;
+	}
+
+	void insert(size_t hash, std::string id, Value value)
+	{
+		// keep the load factor under 3/4 so probe sequences stay short
+		if ((size_ + 1) * 4 > slots_.size() * 3) {
+			grow();
+		}
+
+		size_t index = hash & mask();
+		while (slots_[index].used) {
+			index = (index + 1) & mask();
+		}
+
+		Slot& slot = slots_[index];
+		slot.used = true;
+		slot.hash = hash;
+		slot.id = std::move(id);
+		slot.value = std::move(value);
+		++size_;
+	}
+
+	// remove the first entry for id which `accept` takes, and move it to `out`.
+	// entries `accept` refuses are stale and removed as well.
+	template <typename Accept>
+	bool take(size_t hash, const std::string& id, Accept accept, Value& out)
+	{
+		size_t index = hash & mask();
+		while (slots_[index].used) {
+			Slot& slot = slots_[index];
+
+			if (slot.hash != hash || slot.id != id) {
+				index = (index + 1) & mask();
+				continue;
+			}
+
+			bool accepted = accept(slot.value);
+			if (accepted) {
+				out = std::move(slot.value);
+			}
+
+			// erasing shifts the next entry of the probe sequence into this slot, so don't advance
+			erase(index);
+
+			if (accepted) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// remove every entry for id which `match` selects, keeping the rest
+	template <typename Match>
+	size_t erase(size_t hash, const std::string& id, Match match)
+	{
+		size_t erased = 0;
+
+		size_t index = hash & mask();
+		while (slots_[index].used) {
+			Slot& slot = slots_[index];
+
+			if (slot.hash != hash || slot.id != id || !match(slot.value)) {
+				index = (index + 1) & mask();
+				continue;
+			}
+
+			erase(index);
+			++erased;
+		}
+
+		return erased;
+	}
+
+	// remove every entry, passing each to `visit`
+	template <typename Visit>
+	void clear(Visit visit)
+	{
+		for (Slot& slot : slots_) {
+			if (slot.used) {
+				visit(slot.value);
+				slot = Slot();
+			}
+		}
+		size_ = 0;
+	}
+
+private:
+	struct Slot
+	{
+		bool used = false;
+		size_t hash = 0;
+		std::string id;
+		Value value;
+	};
+
+	size_t mask() const
+	{
+		return slots_.size() - 1;
+	}
+
+	// backward shift deletion, so no tombstones are needed
+	void erase(size_t index)
+	{
+		size_t next = index;
+		for (;;) {
+			next = (next + 1) & mask();
+			if (!slots_[next].used) {
+				break;
+			}
+
+			// move the entry back if its home slot is not between the hole and where it lives now
+			size_t home = slots_[next].hash & mask();
+			bool movable = (index <= next)
+				? (home <= index || home > next)
+				: (home <= index && home > next);
+
+			if (movable) {
+				slots_[index] = std::move(slots_[next]);
+				index = next;
+			}
+		}
+
+		Slot& slot = slots_[index];
+		slot.used = false;
+		slot.id.clear();
+		slot.value = Value();
+		--size_;
+	}
+
+	void grow()
+	{
+		std::vector<Slot> old(slots_.size() * 2);
+		old.swap(slots_);
+		size_ = 0;
+
+		for (Slot& slot : old) {
+			if (slot.used) {
+				insert(slot.hash, std::move(slot.id), std::move(slot.value));
+			}
+		}
+	}
+
+	std::vector<Slot> slots_;
+	size_t size_ = 0;
+};
+
+// one slice of the broker. an ID always hashes to the same shard, so matching on
+// different shards runs in parallel and never shares any state.
+// broadcasts holds servers which any number of viewers may join.
+template <typename Value, typename GroupValue = Value>
+struct BrokerShard
+{
+	explicit BrokerShard(asio::io_service& ioService)
+		: strand(ioService)
+	{}
+
+	Serializer strand;
+
+	WaitingTable<Value> waitingServers;
+	WaitingTable<Value> waitingViewers;
+
+	WaitingTable<GroupValue> broadcasts;
+};
+
+// shards are spread over the given io_services in turn
+template <typename Value, typename GroupValue = Value>
+class BrokerShards
+{
+public:
+	BrokerShards(const std::vector<asio::io_service*>& ioServices, size_t shardCount)
+	{
+		if (shardCount < 1) {
+			shardCount = 1;
+		}
+
+		for (size_t i = 0; i < shardCount; ++i) {
+			shards_.emplace_back(new BrokerShard<Value, GroupValue>(*ioServices[i % ioServices.size()]));
+		}
+	}
+
+	size_t size() const
+	{
+		return shards_.size();
+	}
+
+	BrokerShard<Value, GroupValue>& operator[](size_t index)
+	{
+		return *shards_[index];
+	}
+
+	// the high bits pick the shard, leaving the low bits to spread entries within its tables
+	BrokerShard<Value, GroupValue>& shardFor(size_t hash)
+	{
+		return *shards_[(hash >> 16) % shards_.size()];
+	}
+
+private:
+	std::vector<std::unique_ptr<BrokerShard<Value, GroupValue>>> shards_;
+};
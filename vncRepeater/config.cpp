@@ -0,0 +1,188 @@
+#include "stdafx.h"
+#include "config.h"
+
+#include <climits>
+#include <cstring>
+
+using namespace std;
+
+bool config::traceToConsole = true;
+
+config::LogLevel config::logLevel = config::LogLevel::info;
+
+uint16_t config::serverPort = 5500;
+uint16_t config::viewerPort = 5901;
+
+size_t config::pendingAccepts = 16;
+size_t config::listenBacklog = 0;
+
+size_t config::waitingTtl = 0;
+
+size_t config::relayHighWater = config::bufferSize;
+size_t config::relayQuantum = 0x40000;
+
+size_t config::autotuneInterval = 0x100000;
+size_t config::autotuneBudget = 0x10000000;
+
+size_t config::notSentLowWater = 0x10000;
+
+uint16_t config::metricsPort = 0;
+
+std::string config::broadcastPrefix;
+size_t config::broadcastLag = 0x400000;
+size_t config::broadcastHistory = 0x100000;
+
+std::string config::trunkUpstream;
+size_t config::trunkConnections = 2;
+uint16_t config::trunkPort = 0;
+
+std::string config::handoverPath;
+
+size_t config::brokerShards = 16;
+
+bool config::perCoreIo = false;
+
+bool config::spliceRelay = false;
+
+bool config::speculativeIo = false;
+
+bool config::uringRelay = false;
+
+size_t config::uringBuffers = 256;
+
+bool config::workStealing = false;
+
+size_t config::zerocopyThreshold = 0;
+
+namespace {
+	bool parseFlag(const char* value, bool& flag)
+	{
+		if (!value || 0 == strcmp(value, "1") || 0 == strcmp(value, "true")) {
+			flag = true;
+			return true;
+		}
+		if (0 == strcmp(value, "0") || 0 == strcmp(value, "false")) {
+			flag = false;
+			return true;
+		}
+		return false;
+	}
+
+	template <typename T>
+	bool parseNumber(const char* value, T& number)
+	{
+		if (!value || !*value) {
+			return false;
+		}
+
+		char* end = nullptr;
+		unsigned long long parsed = strtoull(value, &end, 10);
+		if (*end || parsed != (unsigned long long)(T)parsed) {
+			return false;
+		}
+
+		number = (T)parsed;
+		return true;
+	}
+
+	bool parseLogLevel(const char* value, config::LogLevel& level)
+	{
+		if (!value) {
+			return false;
+		}
+
+		const char* names[] = { "none", "error", "info" };
+		for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+			if (0 == strcmp(value, names[i])) {
+				level = (config::LogLevel)i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	struct Option
+	{
+		const char* name;
+		bool(*apply)(const char* value);
+		const char* description;
+	};
+
+	const Option options[] = {
+		{ "autotune", [](const char* value) { return parseNumber(value, config::autotuneInterval); }, "bytes relayed to a viewer between buffer tuning samples; 0 disables" },
+		{ "autotuneBudget", [](const char* value) { return parseNumber(value, config::autotuneBudget); }, "bytes all relay buffers grown by tuning may use" },
+		{ "backlog", [](const char* value) { return parseNumber(value, config::listenBacklog) && config::listenBacklog <= INT_MAX; }, "connections queued on each listening socket; 0 for SOMAXCONN" },
+		{ "broadcast", [](const char* value) { return value && (config::broadcastPrefix = value, true); }, "ID prefix which relays one server to many viewers" },
+		{ "broadcastHistory", [](const char* value) { return parseNumber(value, config::broadcastHistory); }, "bytes a broadcast server may send before viewers can no longer join" },
+		{ "broadcastLag", [](const char* value) { return parseNumber(value, config::broadcastLag) && config::broadcastLag > 0; }, "bytes a broadcast viewer may fall behind before it is dropped" },
+		{ "brokerShards", [](const char* value) { return parseNumber(value, config::brokerShards) && config::brokerShards > 0; }, "number of independent matching shards" },
+		{ "handover", [](const char* value) { return value && (config::handoverPath = value, true); }, "Unix socket path for handing this process over to a new one" },
+		{ "highWater", [](const char* value) { return parseNumber(value, config::relayHighWater) && config::relayHighWater > 0; }, "bytes buffered per direction before reading pauses" },
+		{ "logLevel", [](const char* value) { return parseLogLevel(value, config::logLevel); }, "none, error or info connection events (default info)" },
+		{ "metricsPort", [](const char* value) { return parseNumber(value, config::metricsPort); }, "port on 127.0.0.1 to serve metrics on" },
+		{ "notSentLowWater", [](const char* value) { return parseNumber(value, config::notSentLowWater); }, "unsent bytes queued towards a viewer; 0 for the system default" },
+		{ "pendingAccepts", [](const char* value) { return parseNumber(value, config::pendingAccepts) && config::pendingAccepts > 0; }, "accepts in flight on each listening socket" },
+		{ "perCoreIo", [](const char* value) { return parseFlag(value, config::perCoreIo); }, "run an io_service and acceptors per io thread" },
+		{ "quantum", [](const char* value) { return parseNumber(value, config::relayQuantum) && config::relayQuantum > 0; }, "bytes a relay direction moves before yielding to other sessions" },
+		{ "serverPort", [](const char* value) { return parseNumber(value, config::serverPort); }, "port servers connect to (default 5500)" },
+		{ "speculate", [](const char* value) { return parseFlag(value, config::speculativeIo); }, "try relay reads and writes before waiting for the socket" },
+		{ "splice", [](const char* value) { return parseFlag(value, config::spliceRelay); }, "relay with splice(2) through a kernel pipe" },
+		{ "trunk", [](const char* value) { return value && strchr(value, ':') && (config::trunkUpstream = value, true); }, "host:port of a core repeater to carry all sessions to" },
+		{ "trunkConnections", [](const char* value) { return parseNumber(value, config::trunkConnections) && config::trunkConnections > 0; }, "number of trunk connections to the core" },
+		{ "trunkPort", [](const char* value) { return parseNumber(value, config::trunkPort); }, "port to accept trunks from edge repeaters on" },
+		{ "uring", [](const char* value) { return parseFlag(value, config::uringRelay); }, "relay and accept through io_uring" },
+		{ "uringBuffers", [](const char* value) { return parseNumber(value, config::uringBuffers); }, "relay buffers registered with io_uring" },
+		{ "viewerPort", [](const char* value) { return parseNumber(value, config::viewerPort); }, "port viewers connect to (default 5901)" },
+		{ "waitingTtl", [](const char* value) { return parseNumber(value, config::waitingTtl); }, "seconds an unmatched connection may wait; 0 waits forever" },
+		{ "workStealing", [](const char* value) { return parseFlag(value, config::workStealing); }, "per-thread io_services, with idle threads running the others' handlers" },
+		{ "zerocopy", [](const char* value) { return parseNumber(value, config::zerocopyThreshold); }, "bytes from which sends to a viewer use MSG_ZEROCOPY; 0 disables" },
+	};
+
+	void printUsage()
+	{
+		puts("usage: vncRepeater [--option[=value]]...");
+		for (const auto& option : options) {
+			printf("  --%-20s %s\n", option.name, option.description);
+		}
+	}
+}
+
+bool config::parseCommandLine(int argc, char* argv[])
+{
+	for (int i = 1; i < argc; ++i) {
+		const char* arg = argv[i];
+
+		if (0 != strncmp(arg, "--", 2)) {
+			printUsage();
+			return false;
+		}
+		arg += 2;
+
+		if (0 == strcmp(arg, "help")) {
+			printUsage();
+			return false;
+		}
+
+		const char* value = strchr(arg, '=');
+		size_t nameLength = value ? (size_t)(value - arg) : strlen(arg);
+		if (value) {
+			++value;
+		}
+
+		bool applied = false;
+		for (const auto& option : options) {
+			if (nameLength == strlen(option.name) && 0 == strncmp(arg, option.name, nameLength)) {
+				applied = option.apply(value);
+				break;
+			}
+		}
+
+		if (!applied) {
+			printf("invalid option: %s\n", argv[i]);
+			printUsage();
+			return false;
+		}
+	}
+
+	return true;
+}
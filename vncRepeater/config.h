@@ -1,16 +1,151 @@
 #pragma once
 
+#include <string>
+
 namespace config
 {
 	extern bool traceToConsole;
 
+	// connection events more verbose than this are skipped before any work is done
+	enum class LogLevel
+	{
+		none,
+		error,
+		info,
+	};
+	extern LogLevel logLevel; // = LogLevel::info
+
+	// per-thread log queue size, and how often the log writer thread drains the queues in milliseconds
+	constexpr size_t logRingSize = 0x40000;
+	constexpr int logFlushInterval = 20;
+
 	constexpr int rfbInitTimeout = 5;
+
+	// resolution of the timing wheels which track handshake and waiting deadlines, in milliseconds
+	constexpr int wheelTick = 500;
+
+	// seconds a server or viewer may wait for its match before being disconnected; 0 waits forever
+	extern size_t waitingTtl; // = 0
 	constexpr size_t keepAliveTime = 1000 * 60 * 5;
 	constexpr size_t keepAliveInterval = 1000 * 10;
 
-	constexpr size_t bufferSize = 0x4000;
+	// ring buffer size for each direction of a relay
+	constexpr size_t bufferSize = 0x10000;
+
+	// ring buffer size for viewer input, which is small and latency sensitive; a server which stops
+	// reading can only fall this far behind before the viewer is held back
+	constexpr size_t inputBufferSize = 0x1000;
+
+	// unsent bytes the kernel may queue towards a viewer before writes wait; 0 leaves the system default
+	extern size_t notSentLowWater; // = 0x10000
+
+	// seconds between relay latency reports in the log
+	constexpr int statsInterval = 60;
+
+	// port on 127.0.0.1 where counters and latencies are served over HTTP in the Prometheus text format; 0 doesn't
+	extern uint16_t metricsPort; // = 0
+
+	// idle relay buffers kept for reuse rather than freed
+	constexpr size_t relayStoragePoolSize = 256;
+
+	// stop reading once this many bytes are waiting to be written in one direction
+	extern size_t relayHighWater; // = bufferSize
+
+	// the server -> viewer direction of a relay samples the viewer's connection each time it has written this
+	// many bytes, and grows its ring and both kernel socket buffers towards the bandwidth delay product, so
+	// a distant viewer isn't held back by buffers sized for the LAN. 0 disables; Linux only
+	extern size_t autotuneInterval; // = 0x100000
+
+	// the most a relay ring, or a kernel socket buffer, is grown to
+	constexpr size_t maxTunedBuffer = 0x400000;
+
+	// memory all grown relay rings may hold between them
+	extern size_t autotuneBudget; // = 0x10000000
+
+	// bytes one direction of a relay may move back to back before its next read goes to the back of the
+	// io_service queue, so a session streaming a full screen update can't hold up other sessions' input
+	extern size_t relayQuantum; // = 0x40000
+
+	// how often each io_service measures how long a ready handler waits to run, in milliseconds
+	constexpr int schedulingProbeInterval = 100;
 
 	extern uint16_t serverPort; // = 5500
 	extern uint16_t viewerPort; // = 5901
-}
 
+	// accepts kept in flight on each listening socket. every one which is pending is completed when the
+	// socket becomes readable, so a burst of connections drains this many at a time per wakeup
+	extern size_t pendingAccepts; // = 16
+
+	// connections the kernel queues on each listening socket before refusing more; 0 uses SOMAXCONN.
+	// Linux also caps this at net.core.somaxconn
+	extern size_t listenBacklog; // = 0
+
+	// IDs starting with this prefix are broadcast: one server relayed to every viewer using the ID.
+	// empty disables broadcasting
+	extern std::string broadcastPrefix; // = ""
+
+	// size of the shared buffers a broadcast server's stream is read into
+	constexpr size_t broadcastChunkSize = 0x4000;
+
+	// bytes a broadcast viewer may fall behind the server before it is disconnected
+	extern size_t broadcastLag; // = 0x400000
+
+	// viewers can join a broadcast until the server has sent this many bytes, since each one is
+	// sent the stream from its start
+	extern size_t broadcastHistory; // = 0x100000
+
+	// host:port of a core repeater; when set this repeater is an edge, and carries every server and
+	// viewer to the core over config::trunkConnections long lived connections instead of matching them
+	extern std::string trunkUpstream; // = ""
+	extern size_t trunkConnections; // = 2
+
+	// port the core listens on for trunks from edge repeaters; 0 doesn't listen
+	extern uint16_t trunkPort; // = 0
+
+	// bytes each side of a trunk stream may send ahead of what the other has delivered.
+	// received data waits in a relay buffer, so this can't be larger than bufferSize
+	constexpr size_t trunkWindow = bufferSize;
+
+	// stop reading from a trunk's streams once this many bytes are waiting to be sent on it
+	constexpr size_t trunkHighWater = 0x40000;
+
+	// seconds between attempts to reconnect a trunk to the core
+	constexpr int trunkRetry = 5;
+
+	// Unix socket path where a new process can take over the listening sockets and waiting connections
+	// of this one, which then exits as soon as its running sessions have ended; Linux only
+	extern std::string handoverPath; // = ""
+
+	// number of independent matching shards in the ConnectionBroker
+	extern size_t brokerShards; // = 16
+
+	// give each io thread its own io_service and SO_REUSEPORT acceptors instead of sharing one; Linux only
+	extern bool perCoreIo; // = false
+
+	// relay through a kernel pipe with splice(2) instead of user space buffers; Linux only
+	extern bool spliceRelay; // = false
+
+	// relay reads and writes are first tried without waiting, and only go through the io_service when the
+	// socket isn't ready; saves a completion handler round trip for each one which finishes at once
+	extern bool speculativeIo; // = false
+
+	// relay and accept through an io_uring per io thread instead of the epoll reactor; Linux only, and
+	// the reactor is used when the kernel can't
+	extern bool uringRelay; // = false
+
+	// buffers of bufferSize registered with io_uring for server -> viewer relays; relays beyond these
+	// use unregistered memory
+	extern size_t uringBuffers; // = 256
+
+	// per-thread io_services as with perCoreIo, and an io thread with nothing of its own to run takes
+	// handlers queued on the others; Linux only
+	extern bool workStealing; // = false
+
+	// server -> viewer sends of at least this many bytes go out with MSG_ZEROCOPY, so the kernel transmits
+	// them from the relay ring rather than copying them; 0 disables. Linux only, and only pays off for
+	// large updates over a NIC which can send from user memory
+	extern size_t zerocopyThreshold; // = 0
+
+	// apply --name[=value] options; returns false and prints usage if any were not understood
+	bool parseCommandLine(int argc, char* argv[]);
+}
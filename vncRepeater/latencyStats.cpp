@@ -0,0 +1,143 @@
+#include "stdafx.h"
+#include "latencyStats.h"
+#include "util.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+LatencyStats::LatencyStats()
+{
+	for (auto& slot : slots_) {
+		slot.count = 0;
+		slot.totalUs = 0;
+		slot.maxUs = 0;
+		for (auto& bucket : slot.buckets) {
+			bucket = 0;
+		}
+	}
+}
+
+namespace {
+	// index of the highest bit set; us must not be 0
+	unsigned highestBit(uint64_t us)
+	{
+#if defined(_MSC_VER) && defined(_WIN64)
+		unsigned long index;
+		_BitScanReverse64(&index, us);
+		return index;
+#elif defined(__GNUC__)
+		return 63 - __builtin_clzll(us);
+#else
+		unsigned index = 0;
+		while (us >>= 1) {
+			++index;
+		}
+		return index;
+#endif
+	}
+}
+
+// samples below subBucketCount us each have their own bucket. above that, the top subBucketBits + 1
+// bits of a sample pick its bucket: the highest bit picks the power of two, the rest the linear step
+size_t LatencyStats::bucketFor(uint64_t us)
+{
+	if (us < subBucketCount) {
+		return (size_t)us;
+	}
+
+	unsigned shift = highestBit(us) - subBucketBits;
+	size_t bucket = (shift + 1) * subBucketCount + (size_t)((us >> shift) - subBucketCount);
+	return min(bucket, bucketCount - 1);
+}
+
+// the first value past the bucket
+uint64_t LatencyStats::bucketLimit(size_t bucket)
+{
+	size_t power = bucket / subBucketCount;
+	uint64_t step = bucket % subBucketCount;
+
+	if (!power) {
+		return step + 1;
+	}
+	return (subBucketCount + step + 1) << (power - 1);
+}
+
+void LatencyStats::record(chrono::steady_clock::duration latency)
+{
+	uint64_t us = (uint64_t)max<int64_t>(0, chrono::duration_cast<chrono::microseconds>(latency).count());
+	size_t bucket = bucketFor(us);
+
+	// each io thread only writes its own slot, so plain loads and stores are enough
+	Slot& slot = slots_[ioThreadIndex() % slotCount];
+	slot.count.store(slot.count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	slot.totalUs.store(slot.totalUs.load(memory_order_relaxed) + us, memory_order_relaxed);
+	if (us > slot.maxUs.load(memory_order_relaxed)) {
+		slot.maxUs.store(us, memory_order_relaxed);
+	}
+	slot.buckets[bucket].store(slot.buckets[bucket].load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+LatencyStats::Summary LatencyStats::summarize() const
+{
+	Summary summary = {};
+	array<uint64_t, bucketCount> buckets = {};
+
+	for (auto& slot : slots_) {
+		summary.count += slot.count.load(memory_order_relaxed);
+		summary.totalUs += slot.totalUs.load(memory_order_relaxed);
+		summary.maxUs = max(summary.maxUs, slot.maxUs.load(memory_order_relaxed));
+		for (size_t i = 0; i < bucketCount; ++i) {
+			buckets[i] += slot.buckets[i].load(memory_order_relaxed);
+		}
+	}
+
+	uint64_t total = 0;
+	for (auto count : buckets) {
+		total += count;
+	}
+
+	// the first bucket where the samples seen so far reach each percentile, in thousandths
+	struct Percentile
+	{
+		uint64_t thousandths;
+		uint64_t* us;
+	};
+
+	const Percentile percentiles[] = {
+		{ 500, &summary.p50Us },
+		{ 900, &summary.p90Us },
+		{ 990, &summary.p99Us },
+		{ 999, &summary.p999Us },
+	};
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < bucketCount && total; ++i) {
+		seen += buckets[i];
+		for (auto& percentile : percentiles) {
+			if (!*percentile.us && seen * 1000 >= total * percentile.thousandths) {
+				// no sample is larger than the largest one recorded
+				*percentile.us = min(bucketLimit(i), summary.maxUs);
+			}
+		}
+	}
+
+	return summary;
+}
+
+string LatencyStats::format(const Summary& summary)
+{
+	char text[160] = { 0 };
+
+	snprintf(text, sizeof(text), "n=%llu avg=%lluus p50<=%lluus p99<=%lluus max=%lluus"
+		, (unsigned long long)summary.count
+		, (unsigned long long)(summary.count ? summary.totalUs / summary.count : 0)
+		, (unsigned long long)summary.p50Us
+		, (unsigned long long)summary.p99Us
+		, (unsigned long long)summary.maxUs
+	);
+
+	return text;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// latency samples counted in microsecond buckets, with one slot per io thread so recording is a
+// few uncontended relaxed stores. as in an HDR histogram, each power of two is split into
+// subBucketCount linear buckets, so a percentile is within 1/subBucketCount of the true value
+// from a microsecond up to hours. a summary read while threads are recording is only
+// approximately consistent, which is fine for reporting.
+class LatencyStats
+{
+public:
+	static constexpr size_t subBucketBits = 3;
+	static constexpr size_t subBucketCount = 1 << subBucketBits;
+
+	// enough powers of two for 2^36 us, about 19 hours; longer samples land in the last bucket
+	static constexpr size_t bucketCount = (36 - subBucketBits + 1) * subBucketCount;
+	static constexpr size_t slotCount = 16;
+
+	struct Summary
+	{
+		uint64_t count;
+		uint64_t totalUs;
+		uint64_t maxUs;
+
+		// upper bounds of the buckets holding each percentile
+		uint64_t p50Us;
+		uint64_t p90Us;
+		uint64_t p99Us;
+		uint64_t p999Us;
+	};
+
+	LatencyStats();
+
+	LatencyStats(const LatencyStats&) = delete;
+	LatencyStats& operator=(const LatencyStats&) = delete;
+
+	void record(std::chrono::steady_clock::duration latency);
+
+	Summary summarize() const;
+
+	// "n=.. avg=..us p50<=..us p99<=..us max=..us"
+	static std::string format(const Summary& summary);
+
+private:
+	static size_t bucketFor(uint64_t us);
+	static uint64_t bucketLimit(size_t bucket);
+
+	struct Slot
+	{
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> totalUs;
+		std::atomic<uint64_t> maxUs;
+		std::array<std::atomic<uint64_t>, bucketCount> buckets;
+
+		// keep threads' slots off each other's cache lines
+		char padding_[64];
+	};
+
+	std::array<Slot, slotCount> slots_;
+};
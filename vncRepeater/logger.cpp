@@ -0,0 +1,384 @@
+#include "stdafx.h"
+#include "logger.h"
+#include "config.h"
+
+#include <assert.h>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+	struct RecordHeader
+	{
+		uint32_t size;
+		uint32_t type;
+		uint64_t stamp;
+	};
+
+	uint64_t readClock()
+	{
+		return (uint64_t)chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	size_t copyField(char* field, size_t fieldSize, const string& value)
+	{
+		size_t size = min(value.size(), fieldSize);
+
+		const void* nul = memchr(value.data(), 0, size);
+		if (nul) {
+			size = (const char*)nul - value.data();
+		}
+
+		memcpy(field, value.data(), size);
+		return size;
+	}
+
+	void formatEvent(const LogEvent& event, string& out)
+	{
+		out += event.category;
+
+		out += '\t';
+		if (event.addressSize == 4) {
+			asio::ip::address_v4::bytes_type bytes;
+			memcpy(bytes.data(), event.address, bytes.size());
+			out += asio::ip::address_v4(bytes).to_string();
+		}
+		else {
+			asio::ip::address_v6::bytes_type bytes;
+			memcpy(bytes.data(), event.address, bytes.size());
+			out += '[';
+			out += asio::ip::address_v6(bytes).to_string();
+			out += ']';
+		}
+		out += ':';
+		out += to_string(event.port);
+
+		out += '\t';
+		out += event.viewer ? "Viewer" : "Server";
+
+		out += "\tID:";
+		out.append(event.text, event.idSize);
+		out += " (";
+		out.append(event.text + event.idSize, event.extraSize);
+		out += ")";
+
+		out += '\t';
+		out += event.msg;
+
+		if (event.errorCategory) {
+			out += '\t';
+			out += event.errorCategory->name();
+			out += ':';
+			out += to_string(event.errorValue);
+			out += " (";
+			out += event.errorCategory->message(event.errorValue);
+			out += ")";
+		}
+	}
+}
+
+void LogEvent::setError(const std::error_code& ec)
+{
+	errorCategory = ec ? &ec.category() : nullptr;
+	errorValue = ec.value();
+}
+
+void LogEvent::setEndpoint(const asio::ip::tcp::endpoint& endpoint)
+{
+	const asio::ip::address& address = endpoint.address();
+	if (address.is_v4()) {
+		auto bytes = address.to_v4().to_bytes();
+		memcpy(this->address, bytes.data(), bytes.size());
+		addressSize = (uint8_t)bytes.size();
+	}
+	else {
+		auto bytes = address.to_v6().to_bytes();
+		memcpy(this->address, bytes.data(), bytes.size());
+		addressSize = (uint8_t)bytes.size();
+	}
+	port = endpoint.port();
+}
+
+void LogEvent::setIdAndExtra(const string& id, const string& extra)
+{
+	idSize = (uint8_t)copyField(text, fieldSize, id);
+	extraSize = (uint8_t)copyField(text + idSize, fieldSize, extra);
+}
+
+size_t LogEvent::size() const
+{
+	return offsetof(LogEvent, text) + idSize + extraSize;
+}
+
+LogRing::LogRing(size_t capacity)
+	: buffer_(capacity)
+	, mask_(capacity - 1)
+	, head_(0)
+	, tail_(0)
+	, dropped_(0)
+{
+	assert((capacity & mask_) == 0);
+}
+
+void LogRing::copyIn(size_t position, const void* data, size_t size)
+{
+	size_t offset = position & mask_;
+	size_t first = min(size, buffer_.size() - offset);
+
+	memcpy(&buffer_[offset], data, first);
+	memcpy(&buffer_[0], (const char*)data + first, size - first);
+}
+
+void LogRing::copyOut(size_t position, void* data, size_t size) const
+{
+	size_t offset = position & mask_;
+	size_t first = min(size, buffer_.size() - offset);
+
+	memcpy(data, &buffer_[offset], first);
+	memcpy((char*)data + first, &buffer_[0], size - first);
+}
+
+bool LogRing::push(RecordType type, uint64_t stamp, const void* data, size_t size)
+{
+	size_t head = head_.load(memory_order_relaxed);
+	size_t tail = tail_.load(memory_order_acquire);
+
+	size_t needed = sizeof(RecordHeader) + size;
+	if (needed > buffer_.size() - (head - tail)) {
+		dropped_.fetch_add(1, memory_order_relaxed);
+		return false;
+	}
+
+	RecordHeader header = { (uint32_t)size, type, stamp };
+	copyIn(head, &header, sizeof(header));
+	copyIn(head + sizeof(header), data, size);
+
+	head_.store(head + needed, memory_order_release);
+	return true;
+}
+
+void LogRing::beginDrain()
+{
+	drainEnd_ = head_.load(memory_order_acquire);
+}
+
+bool LogRing::front(uint64_t& stamp) const
+{
+	size_t tail = tail_.load(memory_order_relaxed);
+	if (tail == drainEnd_) {
+		return false;
+	}
+
+	RecordHeader header;
+	copyOut(tail, &header, sizeof(header));
+	stamp = header.stamp;
+	return true;
+}
+
+void LogRing::pop(string& out, const string& prefix, const char* separator)
+{
+	size_t tail = tail_.load(memory_order_relaxed);
+
+	RecordHeader header;
+	copyOut(tail, &header, sizeof(header));
+
+	out += prefix;
+
+	if (header.type == eventRecord) {
+		LogEvent event;
+		copyOut(tail + sizeof(header), &event, header.size);
+		formatEvent(event, out);
+	}
+	else {
+		size_t offset = out.size();
+		out.resize(offset + header.size);
+		copyOut(tail + sizeof(header), &out[offset], header.size);
+	}
+
+	out += separator;
+
+	tail_.store(tail + sizeof(header) + header.size, memory_order_release);
+}
+
+Logger& Logger::instance()
+{
+	static Logger logger;
+	return logger;
+}
+
+Logger::Logger()
+	: clock_(readClock())
+	, writer_([this]() { run(); })
+{}
+
+Logger::~Logger()
+{
+	stop();
+}
+
+LogRing& Logger::localRing()
+{
+	thread_local LogRing* ring = nullptr;
+
+	if (!ring) {
+		unique_lock<mutex> lock(mutex_);
+		rings_.emplace_back(new LogRing(config::logRingSize));
+		ring = rings_.back().get();
+	}
+
+	return *ring;
+}
+
+void Logger::write(const char* msg, size_t size)
+{
+	localRing().push(LogRing::textRecord, clock_.load(memory_order_relaxed), msg, size);
+}
+
+void Logger::write(const LogEvent& event)
+{
+	localRing().push(LogRing::eventRecord, clock_.load(memory_order_relaxed), &event, event.size());
+}
+
+void Logger::stop()
+{
+	{
+		unique_lock<mutex> lock(mutex_);
+		if (stopping_) {
+			return;
+		}
+		stopping_ = true;
+	}
+
+	wakeup_.notify_one();
+	if (writer_.joinable()) {
+		writer_.join();
+	}
+}
+
+void Logger::run()
+{
+	unique_lock<mutex> lock(mutex_);
+
+	for (;;) {
+		// producers never signal, so logging costs them no syscalls; poll instead
+		wakeup_.wait_for(lock, chrono::milliseconds(config::logFlushInterval), [this]() { return stopping_; });
+
+		bool stopping = stopping_;
+
+		lock.unlock();
+		flush();
+		lock.lock();
+
+		if (stopping) {
+			return;
+		}
+	}
+}
+
+void Logger::flush()
+{
+	uint64_t now = readClock();
+	clock_.store(now, memory_order_relaxed);
+
+	batch_.clear();
+
+	uint64_t drops = 0;
+	{
+		unique_lock<mutex> lock(mutex_);
+		for (auto& ring : rings_) {
+			ring->beginDrain();
+			drops += ring->dropped();
+		}
+
+		// each ring is in the order its thread logged, so merging them by stamp puts the batch in the
+		// order things happened, to within the flush interval
+		for (;;) {
+			LogRing* oldest = nullptr;
+			uint64_t oldestStamp = 0;
+			for (auto& ring : rings_) {
+				uint64_t stamp;
+				if (ring->front(stamp) && (!oldest || stamp < oldestStamp)) {
+					oldest = ring.get();
+					oldestStamp = stamp;
+				}
+			}
+			if (!oldest) {
+				break;
+			}
+
+			oldest->pop(batch_, prefixFor((int64_t)(oldestStamp / 1000)), "\r\n");
+		}
+	}
+
+	if (drops != reportedDrops_) {
+		batch_ += prefixFor((int64_t)(now / 1000));
+		batch_ += "log overflow: dropped " + to_string(drops - reportedDrops_) + " records\r\n";
+		reportedDrops_ = drops;
+	}
+
+	if (batch_.empty()) {
+		return;
+	}
+
+	if (openLogFile(platform::systemTimeAt((int64_t)(now / 1000)))) {
+		logFile_.write(batch_.data(), batch_.size());
+	}
+
+	// echo to console?
+	if (config::traceToConsole) {
+		fwrite(batch_.data(), 1, batch_.size(), stdout);
+		fflush(stdout);
+	}
+}
+
+bool Logger::openLogFile(const platform::SystemTime& st)
+{
+	if (logFile_.isOpen() && st.year == fileTime_.year && st.month == fileTime_.month && st.day == fileTime_.day) {
+		return true;
+	}
+
+	logFile_.close();
+	fileTime_ = st;
+
+	char filePath[256] = { 0 };
+
+	snprintf(filePath, sizeof(filePath),
+		"vncRepeater_%04hu%02hu%02hu"
+		"T%02hu%02hu%02huZ"
+		"_%06lu.log"
+		, st.year, st.month, st.day
+		, st.hour, st.minute, st.second
+		, platform::currentProcessId()
+	);
+
+	if (!logFile_.open(filePath)) {
+		platform::resetCurrentDirectory();
+		return logFile_.open(filePath);
+	}
+
+	return true;
+}
+
+const string& Logger::prefixFor(int64_t second)
+{
+	if (second != prefixSecond_) {
+		auto st = platform::systemTimeAt(second);
+
+		char prefix[128] = { 0 };
+
+		snprintf(prefix, sizeof(prefix),
+			"%04hu%02hu%02hu"
+			"T%02hu%02hu%02huZ"
+			":\t"
+			, st.year, st.month, st.day
+			, st.hour, st.minute, st.second
+		);
+
+		prefix_ = prefix;
+		prefixSecond_ = second;
+	}
+
+	return prefix_;
+}
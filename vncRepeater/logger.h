@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "asio.hpp"
+
+#include "platform.h"
+
+// a connection event kept as raw fields; the writer thread formats it, so io threads never
+// format addresses or look up error messages. category and msg must be string literals.
+struct LogEvent
+{
+	const char* category;
+	const char* msg;
+
+	// null if there was no error
+	const std::error_category* errorCategory;
+	int errorValue;
+
+	uint8_t address[16];
+	uint8_t addressSize; // 4 or 16
+	bool viewer;
+	uint16_t port;
+
+	// both come from the 250 byte block a server or viewer sends first, so neither can be longer.
+	// each is copied up to its first NUL, the ID and then the extra, into `text`
+	static constexpr size_t fieldSize = 250;
+
+	uint8_t idSize;
+	uint8_t extraSize;
+	char text[2 * fieldSize];
+
+	void setError(const std::error_code& ec);
+	void setEndpoint(const asio::ip::tcp::endpoint& endpoint);
+	void setIdAndExtra(const std::string& id, const std::string& extra);
+
+	// the leading part of the event in use; only that much goes through the ring
+	size_t size() const;
+};
+
+// single producer / single consumer byte ring holding length prefixed log records, which are
+// either preformatted text or a LogEvent, each stamped with when it was logged.
+// each thread which logs owns one; only the writer thread reads from it.
+class LogRing
+{
+public:
+	explicit LogRing(size_t capacity);
+
+	LogRing(const LogRing&) = delete;
+	LogRing& operator=(const LogRing&) = delete;
+
+	enum RecordType : uint32_t
+	{
+		textRecord,
+		eventRecord,
+	};
+
+	// never blocks; a record which doesn't fit is dropped and counted
+	bool push(RecordType type, uint64_t stamp, const void* data, size_t size);
+
+	// take in every complete record pushed so far; later ones wait for the next drain
+	void beginDrain();
+
+	// the stamp of the oldest record taken in, if any are left
+	bool front(uint64_t& stamp) const;
+
+	// append the oldest record taken in to `out`, followed by `separator`, and release it
+	void pop(std::string& out, const std::string& prefix, const char* separator);
+
+	uint64_t dropped() const
+	{
+		return dropped_.load(std::memory_order_relaxed);
+	}
+
+private:
+	void copyIn(size_t position, const void* data, size_t size);
+	void copyOut(size_t position, void* data, size_t size) const;
+
+	std::vector<char> buffer_;
+	const size_t mask_;
+
+	// head_ is only written by the producer, tail_ only by the consumer; keep them on separate cache lines
+	std::atomic<size_t> head_;
+	char padding_[64];
+	std::atomic<size_t> tail_;
+	std::atomic<uint64_t> dropped_;
+
+	// only touched by the consumer: the head as of beginDrain
+	size_t drainEnd_ = 0;
+};
+
+// collects records from the per-thread rings and writes them out in batches on its own thread,
+// so io threads never block on the disk or on each other to log.
+class Logger
+{
+public:
+	static Logger& instance();
+
+	void write(const char* msg, size_t size);
+	void write(const LogEvent& event);
+
+	// write out anything pending and stop the writer thread
+	void stop();
+
+private:
+	Logger();
+	~Logger();
+
+	LogRing& localRing();
+
+	void run();
+	void flush();
+
+	bool openLogFile(const platform::SystemTime& st);
+	const std::string& prefixFor(int64_t second);
+
+	std::mutex mutex_;
+	std::condition_variable wakeup_;
+	bool stopping_ = false;
+
+	// rings are never removed, so the writer can walk them with only the registration lock
+	std::vector<std::unique_ptr<LogRing>> rings_;
+
+	// milliseconds since 1970, which records are stamped with. the writer refreshes it before each
+	// flush, so logging threads never read the clock; records logged within the same flush interval
+	// share a stamp
+	std::atomic<uint64_t> clock_;
+
+	// only touched by the writer thread
+	platform::LogFile logFile_;
+	platform::SystemTime fileTime_ = {};
+	int64_t prefixSecond_ = -1;
+	std::string prefix_;
+	std::string batch_;
+	uint64_t reportedDrops_ = 0;
+
+	// last, so everything the writer touches is constructed before it starts
+	std::thread writer_;
+};
@@ -0,0 +1,184 @@
+#include "stdafx.h"
+#include "metrics.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace {
+	// how long a client has to send its request
+	constexpr int requestTimeout = 5;
+
+	// requests are a line and a few headers; anything longer is not a scraper
+	constexpr size_t maxRequestSize = 0x2000;
+
+	string seconds(uint64_t us)
+	{
+		char text[32] = { 0 };
+		snprintf(text, sizeof(text), "%.6f", us / 1e6);
+		return text;
+	}
+}
+
+void MetricsText::family(const char* name, const char* type, const char* help)
+{
+	text_ += "# HELP ";
+	text_ += name;
+	text_ += " ";
+	text_ += help;
+	text_ += "\n# TYPE ";
+	text_ += name;
+	text_ += " ";
+	text_ += type;
+	text_ += "\n";
+}
+
+void MetricsText::sample(const char* name, const string& labels, int64_t value)
+{
+	text_ += name;
+	if (!labels.empty()) {
+		text_ += "{" + labels + "}";
+	}
+	text_ += " " + to_string(value) + "\n";
+}
+
+void MetricsText::summary(const char* name, const string& labels, const LatencyStats::Summary& summary)
+{
+	const pair<const char*, uint64_t> quantiles[] = {
+		{ "0.5", summary.p50Us },
+		{ "0.9", summary.p90Us },
+		{ "0.99", summary.p99Us },
+		{ "0.999", summary.p999Us },
+	};
+
+	string prefix = labels.empty() ? "" : labels + ",";
+
+	for (auto& quantile : quantiles) {
+		text_ += name;
+		text_ += "{" + prefix + "quantile=\"" + quantile.first + "\"} " + seconds(quantile.second) + "\n";
+	}
+
+	string suffix = labels.empty() ? "" : "{" + labels + "}";
+
+	text_ += name;
+	text_ += "_sum" + suffix + " " + seconds(summary.totalUs) + "\n";
+	text_ += name;
+	text_ += "_count" + suffix + " " + to_string(summary.count) + "\n";
+}
+
+MetricsEndpoint::MetricsEndpoint(asio::io_service& ioService, function<string()> render)
+	: render_(move(render))
+	, strand_(ioService)
+	, acceptor_(ioService)
+	, socket_(ioService)
+	, timeout_(ioService)
+	, request_(maxRequestSize)
+{}
+
+bool MetricsEndpoint::start(uint16_t port)
+{
+	std::error_code ec;
+	asio::ip::tcp::endpoint endpoint(asio::ip::address_v4::loopback(), port);
+
+	acceptor_.open(endpoint.protocol(), ec);
+	if (!ec) {
+		acceptor_.set_option(asio::socket_base::reuse_address(true), ec);
+	}
+	if (!ec) {
+		acceptor_.bind(endpoint, ec);
+	}
+	if (!ec) {
+		acceptor_.listen(asio::socket_base::max_connections, ec);
+	}
+	if (ec) {
+		std::error_code dontCare;
+		acceptor_.close(dontCare);
+		return false;
+	}
+
+	accept();
+	return true;
+}
+
+void MetricsEndpoint::stop()
+{
+	std::error_code dontCare;
+	acceptor_.close(dontCare);
+}
+
+void MetricsEndpoint::accept()
+{
+	if (!acceptor_.is_open()) {
+		return;
+	}
+
+	acceptor_.async_accept(socket_, strand_.wrap([this](const std::error_code& ec) {
+		if (ec == asio::error::operation_aborted) {
+			return;
+		}
+		if (ec) {
+			accept();
+			return;
+		}
+
+		timeout_.expires_from_now(std::chrono::seconds(requestTimeout));
+		timeout_.async_wait(strand_.wrap([this](const std::error_code& ec) {
+			// a timer cancelled too late to abort still finds a later deadline once the next request started
+			if (!ec && timeout_.expires_at() <= std::chrono::steady_clock::now()) {
+				std::error_code dontCare;
+				socket_.close(dontCare);
+			}
+		}));
+
+		readRequest();
+	}));
+}
+
+void MetricsEndpoint::readRequest()
+{
+	asio::async_read_until(socket_, request_, "\r\n\r\n", strand_.wrap([this](const std::error_code& ec, size_t) {
+		if (ec) {
+			finish();
+			return;
+		}
+
+		// only the request line matters: "GET /metrics HTTP/1.1"
+		string line;
+		istream stream(&request_);
+		getline(stream, line);
+
+		if (0 == line.compare(0, 13, "GET /metrics ") || 0 == line.compare(0, 6, "GET / ")) {
+			respond("200 OK", render_());
+		}
+		else {
+			respond("404 Not Found", "not found\n");
+		}
+	}));
+}
+
+void MetricsEndpoint::respond(const char* status, const string& body)
+{
+	response_ = string("HTTP/1.1 ") + status + "\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: " + to_string(body.size()) + "\r\n"
+		"Connection: close\r\n"
+		"\r\n" + body;
+
+	asio::async_write(socket_, asio::buffer(response_), strand_.wrap([this](const std::error_code&, size_t) {
+		finish();
+	}));
+}
+
+// close the connection and wait for the next one
+void MetricsEndpoint::finish()
+{
+	std::error_code dontCare;
+	timeout_.cancel(dontCare);
+	socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+	socket_.close(dontCare);
+
+	request_.consume(request_.size());
+	response_.clear();
+
+	accept();
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include "latencyStats.h"
+#include "serializer.h"
+#include "util.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+// a count kept in one slot per io thread like LatencyStats, so counting is a relaxed load and store to
+// a cache line no other thread writes, and the slots are only added up when the total is wanted.
+// adding a negative amount makes it a gauge, since the slots still sum to the right value.
+class ShardedCounter
+{
+public:
+	static constexpr size_t slotCount = 64;
+
+	ShardedCounter()
+	{
+		for (auto& slot : slots_) {
+			slot.value = 0;
+		}
+	}
+
+	ShardedCounter(const ShardedCounter&) = delete;
+	ShardedCounter& operator=(const ShardedCounter&) = delete;
+
+	void add(int64_t amount = 1)
+	{
+		auto& value = slots_[ioThreadIndex() % slotCount].value;
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	int64_t total() const
+	{
+		int64_t total = 0;
+		for (auto& slot : slots_) {
+			total += slot.value.load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+
+private:
+	struct Slot
+	{
+		std::atomic<int64_t> value;
+
+		// keep threads' slots off each other's cache lines
+		char padding_[64 - sizeof(std::atomic<int64_t>)];
+	};
+
+	std::array<Slot, slotCount> slots_;
+};
+
+// builds a page in the Prometheus text format. each family is declared once, then followed by its samples
+class MetricsText
+{
+public:
+	// type is "counter", "gauge" or "summary"
+	void family(const char* name, const char* type, const char* help);
+
+	// labels are `key="value"` pairs separated by commas, or empty
+	void sample(const char* name, const std::string& labels, int64_t value);
+
+	// latencies as a summary in seconds, with the percentiles LatencyStats keeps
+	void summary(const char* name, const std::string& labels, const LatencyStats::Summary& summary);
+
+	const std::string& text() const
+	{
+		return text_;
+	}
+
+private:
+	std::string text_;
+};
+
+// answers HTTP requests for /metrics on a loopback port with whatever `render` returns, on the given
+// io_service. meant for a local scraper or curl, so requests are handled one at a time, on a strand.
+class MetricsEndpoint
+{
+public:
+	MetricsEndpoint(asio::io_service& ioService, std::function<std::string()> render);
+
+	// listen on 127.0.0.1:port and start accepting; returns false if the port can't be used
+	bool start(uint16_t port);
+
+	// stop listening, so another process can take the port; run on strand()
+	void stop();
+
+	Serializer& strand()
+	{
+		return strand_;
+	}
+
+private:
+	void accept();
+	void readRequest();
+	void respond(const char* status, const std::string& body);
+	void finish();
+
+	std::function<std::string()> render_;
+
+	Serializer strand_;
+	asio::ip::tcp::acceptor acceptor_;
+	asio::ip::tcp::socket socket_;
+
+	// a client which doesn't finish its request in time is dropped, so it can't hold up the next one
+	asio::steady_timer timeout_;
+
+	asio::streambuf request_;
+	std::string response_;
+};
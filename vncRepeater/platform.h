@@ -0,0 +1,102 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include <cstdint>
+#include <vector>
+
+#ifndef _WIN32
+#define VNCREPEATER_HAS_HANDOVER 1
+#endif
+
+// operating system specific functionality lives behind this interface.
+// platform_win32.cpp implements it for Windows, platform_posix.cpp for Linux and other POSIX hosts.
+namespace platform
+{
+	struct SystemTime
+	{
+		uint16_t year;
+		uint16_t month;
+		uint16_t day;
+		uint16_t hour;
+		uint16_t minute;
+		uint16_t second;
+	};
+
+	// UTC time of `time`, in seconds since 1970
+	SystemTime systemTimeAt(int64_t time);
+
+	unsigned long currentProcessId();
+
+	// switch to the directory where logs are written, creating it if necessary
+	bool resetCurrentDirectory();
+
+	// enable keepalive probes with the given idle time and interval, in milliseconds
+	void setKeepAlive(asio::ip::tcp::socket& socket, size_t keepAliveTime, size_t keepAliveInterval);
+
+	// let several acceptors listen on the same port, with the kernel spreading new connections
+	// across them. call before bind; returns false where the kernel doesn't balance them
+	bool setReusePort(asio::ip::tcp::acceptor& acceptor);
+
+	// limit how much unsent data the kernel queues for a socket, so writers block rather than
+	// buffering far ahead of what the peer is receiving. returns false where unsupported
+	bool setNotSentLowWater(asio::ip::tcp::socket& socket, size_t bytes);
+
+	// the kernel's smoothed round trip time for a connection. returns false where unsupported, or for
+	// sockets which are not TCP connections
+	bool queryRoundTrip(asio::ip::tcp::socket& socket, uint32_t& rttUs);
+
+	// grow the kernel's send and receive buffers to at least the given sizes, as far as the system allows;
+	// 0 leaves a buffer alone. a buffer the kernel is already tuning larger is never pinned smaller
+	void raiseSocketBuffers(asio::ip::tcp::socket& socket, size_t sendBytes, size_t receiveBytes);
+
+	// re-register an open socket with the io_service of `to`, which must be closed, and close `from`.
+	// returns false, leaving `from` untouched, if the socket can't be moved
+	bool moveSocket(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to);
+
+	// connect two closed sockets to each other within this process, as cheaply as the system allows.
+	// neither end is a real TCP connection, so only reads, writes and shutdown may be relied on
+	bool socketPair(asio::ip::tcp::socket& first, asio::ip::tcp::socket& second);
+
+#ifdef VNCREPEATER_HAS_HANDOVER
+	// pass an open socket, with a message describing it, to another process over a Unix domain socket.
+	// the socket stays open here as well until it is closed
+	bool sendSocket(int channel, int socket, const std::vector<uint8_t>& message);
+
+	// the next socket and its message sent with sendSocket; -1 once the channel is closed
+	int receiveSocket(int channel, std::vector<uint8_t>& message);
+#endif
+
+	// hint the scheduler to keep the calling thread on the given core
+	void setCurrentThreadCore(unsigned core);
+
+	// append-only file handle used for logging
+	class LogFile
+	{
+	public:
+		LogFile()
+		{}
+
+		~LogFile()
+		{
+			close();
+		}
+
+		LogFile(const LogFile&) = delete;
+		LogFile& operator=(const LogFile&) = delete;
+
+		bool open(const char* path);
+		void close();
+
+		bool isOpen() const;
+
+		void write(const char* data, size_t size);
+
+	private:
+#ifdef _WIN32
+		void* handle_ = nullptr;
+#else
+		int fd_ = -1;
+#endif
+	};
+}
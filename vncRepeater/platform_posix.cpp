@@ -0,0 +1,329 @@
+#include "stdafx.h"
+#include "platform.h"
+
+#ifndef _WIN32
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+	// a limit from /proc/sys, or 0 if it can't be read
+	size_t readSystemLimit(const char* path)
+	{
+		size_t limit = 0;
+
+		FILE* file = fopen(path, "r");
+		if (file) {
+			if (1 != fscanf(file, "%zu", &limit)) {
+				limit = 0;
+			}
+			fclose(file);
+		}
+
+		return limit;
+	}
+
+	// once set, the kernel stops growing the buffer by itself, so only set it if the result is larger than
+	// what the kernel has reached already. the kernel caps the request at `limit`, then doubles it to
+	// allow for its own bookkeeping
+	void raiseSocketBuffer(int fd, int option, size_t bytes, size_t limit)
+	{
+		int current = 0;
+		socklen_t size = sizeof(current);
+		if (!bytes || 0 != ::getsockopt(fd, SOL_SOCKET, option, &current, &size)) {
+			return;
+		}
+
+		int requested = (int)std::min<size_t>(std::min(bytes, limit), INT_MAX / 2);
+		if (requested * 2 > current) {
+			::setsockopt(fd, SOL_SOCKET, option, &requested, sizeof(requested));
+		}
+	}
+}
+
+namespace platform
+{
+	SystemTime systemTimeAt(int64_t time)
+	{
+		time_t seconds = (time_t)time;
+		struct tm utc = {};
+		::gmtime_r(&seconds, &utc);
+
+		return{
+			(uint16_t)(utc.tm_year + 1900), (uint16_t)(utc.tm_mon + 1), (uint16_t)utc.tm_mday,
+			(uint16_t)utc.tm_hour, (uint16_t)utc.tm_min, (uint16_t)utc.tm_sec
+		};
+	}
+
+	unsigned long currentProcessId()
+	{
+		return (unsigned long)::getpid();
+	}
+
+	bool resetCurrentDirectory()
+	{
+		constexpr char logDirectory[] = "/var/log/vncRepeater";
+
+		::mkdir(logDirectory, 0755);
+		return 0 == ::chdir(logDirectory);
+	}
+
+	void setKeepAlive(asio::ip::tcp::socket& socket, size_t keepAliveTime, size_t keepAliveInterval)
+	{
+		int fd = socket.native_handle();
+
+		// the kernel takes seconds; match the 10 probes Windows always uses
+		int idle = (int)((keepAliveTime + 999) / 1000);
+		int interval = (int)((keepAliveInterval + 999) / 1000);
+		int count = 10;
+
+		// but still continue even if we couldn't set these
+#ifdef TCP_KEEPIDLE
+		::setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+#elif defined(TCP_KEEPALIVE)
+		::setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &idle, sizeof(idle));
+#endif
+#ifdef TCP_KEEPINTVL
+		::setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+#endif
+#ifdef TCP_KEEPCNT
+		::setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+	}
+
+	bool setReusePort(asio::ip::tcp::acceptor& acceptor)
+	{
+		// other systems accept SO_REUSEPORT, but hand every connection to one of the sockets
+#if defined(__linux__) && defined(SO_REUSEPORT)
+		int enable = 1;
+		return 0 == ::setsockopt(acceptor.native_handle(), SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+#else
+		return false;
+#endif
+	}
+
+	bool setNotSentLowWater(asio::ip::tcp::socket& socket, size_t bytes)
+	{
+#ifdef TCP_NOTSENT_LOWAT
+		int lowWater = (int)bytes;
+		return 0 == ::setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowWater, sizeof(lowWater));
+#else
+		return false;
+#endif
+	}
+
+	bool queryRoundTrip(asio::ip::tcp::socket& socket, uint32_t& rttUs)
+	{
+#if defined(__linux__) && defined(TCP_INFO)
+		struct tcp_info info = {};
+		socklen_t size = sizeof(info);
+		if (0 != ::getsockopt(socket.native_handle(), IPPROTO_TCP, TCP_INFO, &info, &size)) {
+			return false;
+		}
+
+		rttUs = info.tcpi_rtt;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void raiseSocketBuffers(asio::ip::tcp::socket& socket, size_t sendBytes, size_t receiveBytes)
+	{
+		// without a known limit there is no telling whether the kernel would shrink the buffer
+		static const size_t sendLimit = readSystemLimit("/proc/sys/net/core/wmem_max");
+		static const size_t receiveLimit = readSystemLimit("/proc/sys/net/core/rmem_max");
+
+		raiseSocketBuffer(socket.native_handle(), SO_SNDBUF, sendBytes, sendLimit);
+		raiseSocketBuffer(socket.native_handle(), SO_RCVBUF, receiveBytes, receiveLimit);
+	}
+
+	bool moveSocket(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to)
+	{
+		std::error_code ec;
+
+		auto protocol = from.local_endpoint(ec).protocol();
+		if (ec) {
+			return false;
+		}
+
+		// the duplicate keeps the connection open once `from` is closed
+		int fd = ::fcntl(from.native_handle(), F_DUPFD_CLOEXEC, 0);
+		if (fd < 0) {
+			return false;
+		}
+
+		to.assign(protocol, fd, ec);
+		if (ec) {
+			::close(fd);
+			return false;
+		}
+
+		// asio removes an accepted socket from its reactor explicitly when closing it, since it
+		// can't rule out a duplicate; so the old reactor stops watching the connection here
+		from.close(ec);
+		return true;
+	}
+
+	bool socketPair(asio::ip::tcp::socket& first, asio::ip::tcp::socket& second)
+	{
+		int fds[2];
+		if (0 != ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+			return false;
+		}
+
+		// asio never checks the family of an assigned descriptor
+		std::error_code ec;
+		first.assign(asio::ip::tcp::v4(), fds[0], ec);
+		if (ec) {
+			::close(fds[0]);
+			::close(fds[1]);
+			return false;
+		}
+
+		second.assign(asio::ip::tcp::v4(), fds[1], ec);
+		if (ec) {
+			first.close(ec);
+			::close(fds[1]);
+			return false;
+		}
+
+		return true;
+	}
+
+	// each message is its length, then the message, with the socket attached to the length. reading
+	// exactly that much at a time keeps sockets lined up with their messages on a stream socket
+	bool sendSocket(int channel, int socket, const std::vector<uint8_t>& message)
+	{
+		uint8_t length[2] = { (uint8_t)message.size(), (uint8_t)(message.size() >> 8) };
+		if (message.size() > 0xffff) {
+			return false;
+		}
+
+		iovec parts[2] = {
+			{ length, sizeof(length) },
+			{ (void*)message.data(), message.size() },
+		};
+
+		union
+		{
+			cmsghdr header;
+			char space[CMSG_SPACE(sizeof(int))];
+		} control = {};
+
+		msghdr msg = {};
+		msg.msg_iov = parts;
+		msg.msg_iovlen = 2;
+		msg.msg_control = control.space;
+		msg.msg_controllen = sizeof(control.space);
+
+		cmsghdr* header = CMSG_FIRSTHDR(&msg);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(header), &socket, sizeof(int));
+
+		return ::sendmsg(channel, &msg, MSG_NOSIGNAL) == (ssize_t)(sizeof(length) + message.size());
+	}
+
+	int receiveSocket(int channel, std::vector<uint8_t>& message)
+	{
+		uint8_t length[2];
+		iovec part = { length, sizeof(length) };
+
+		union
+		{
+			cmsghdr header;
+			char space[CMSG_SPACE(sizeof(int))];
+		} control = {};
+
+		msghdr msg = {};
+		msg.msg_iov = &part;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.space;
+		msg.msg_controllen = sizeof(control.space);
+
+		if (::recvmsg(channel, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(length)) {
+			return -1;
+		}
+
+		int socket = -1;
+		cmsghdr* header = CMSG_FIRSTHDR(&msg);
+		if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS && header->cmsg_len == CMSG_LEN(sizeof(int))) {
+			memcpy(&socket, CMSG_DATA(header), sizeof(int));
+		}
+
+		message.resize(length[0] | (length[1] << 8));
+		if (!message.empty() && ::recv(channel, message.data(), message.size(), MSG_WAITALL) != (ssize_t)message.size()) {
+			if (socket >= 0) {
+				::close(socket);
+			}
+			return -1;
+		}
+
+		return socket;
+	}
+
+	void setCurrentThreadCore(unsigned core)
+	{
+#ifdef __linux__
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(core, &cpuSet);
+		::pthread_setaffinity_np(::pthread_self(), sizeof(cpuSet), &cpuSet);
+#endif
+	}
+
+	bool LogFile::open(const char* path)
+	{
+		close();
+
+		int fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			return false;
+		}
+
+		fd_ = fd;
+		return true;
+	}
+
+	void LogFile::close()
+	{
+		if (fd_ >= 0) {
+			::close(fd_);
+			fd_ = -1;
+		}
+	}
+
+	bool LogFile::isOpen() const
+	{
+		return fd_ >= 0;
+	}
+
+	void LogFile::write(const char* data, size_t size)
+	{
+		while (size) {
+			ssize_t written = ::write(fd_, data, size);
+			if (written <= 0) {
+				return;
+			}
+			data += written;
+			size -= (size_t)written;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,162 @@
+#include "stdafx.h"
+#include "platform.h"
+
+#ifdef _WIN32
+
+#include <time.h>
+
+#pragma comment(lib, "shlwapi.lib")
+
+namespace platform
+{
+	SystemTime systemTimeAt(int64_t time)
+	{
+		__time64_t seconds = time;
+		struct tm utc = {};
+		::_gmtime64_s(&utc, &seconds);
+
+		return{
+			(uint16_t)(utc.tm_year + 1900), (uint16_t)(utc.tm_mon + 1), (uint16_t)utc.tm_mday,
+			(uint16_t)utc.tm_hour, (uint16_t)utc.tm_min, (uint16_t)utc.tm_sec
+		};
+	}
+
+	unsigned long currentProcessId()
+	{
+		return ::GetCurrentProcessId();
+	}
+
+	bool resetCurrentDirectory()
+	{
+		wchar_t wszPath[MAX_PATH] = { 0 };
+		if (SUCCEEDED(::SHGetFolderPath(NULL, CSIDL_COMMON_APPDATA | CSIDL_FLAG_CREATE, NULL, 0, wszPath))) {
+			::PathAppend(wszPath, L"vncRepeater\\");
+			::CreateDirectory(wszPath, nullptr);
+			::SetCurrentDirectory(wszPath);
+			return true;
+		}
+
+		return false;
+	}
+
+	void setKeepAlive(asio::ip::tcp::socket& socket, size_t keepAliveTime, size_t keepAliveInterval)
+	{
+		DWORD bytes_returned = 0;
+		tcp_keepalive keepalive_requested = { 0 };
+		tcp_keepalive keepalive_returned = { 0 };
+
+		keepalive_requested.onoff = 1;
+		keepalive_requested.keepalivetime = (ULONG)keepAliveTime;
+		keepalive_requested.keepaliveinterval = (ULONG)keepAliveInterval;
+		// 10 probes always used by default in Vista+; not changeable.
+
+		if (0 != WSAIoctl(socket.native_handle(), SIO_KEEPALIVE_VALS,
+			&keepalive_requested, sizeof(keepalive_requested),
+			&keepalive_returned, sizeof(keepalive_returned),
+			&bytes_returned, NULL, NULL))
+		{
+			int lastError = WSAGetLastError();
+			// but still continue even if we couldn't set this
+		}
+	}
+
+	bool setReusePort(asio::ip::tcp::acceptor& acceptor)
+	{
+		// SO_REUSEADDR lets a second socket bind the port, but it doesn't share the connections
+		return false;
+	}
+
+	bool setNotSentLowWater(asio::ip::tcp::socket& socket, size_t bytes)
+	{
+		return false;
+	}
+
+	bool queryRoundTrip(asio::ip::tcp::socket& socket, uint32_t& rttUs)
+	{
+		return false;
+	}
+
+	void raiseSocketBuffers(asio::ip::tcp::socket& socket, size_t sendBytes, size_t receiveBytes)
+	{
+		// send and receive buffers are tuned by the system from the measured path already
+	}
+
+	bool moveSocket(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to)
+	{
+		// a socket stays bound to the completion port it was first associated with
+		return false;
+	}
+
+	bool socketPair(asio::ip::tcp::socket& first, asio::ip::tcp::socket& second)
+	{
+		// no socketpair(), so connect over loopback
+		std::error_code ec;
+		asio::ip::tcp::endpoint loopback(asio::ip::address_v4::loopback(), 0);
+
+		asio::ip::tcp::acceptor acceptor(first.get_io_service());
+		acceptor.open(loopback.protocol(), ec);
+		if (!ec) {
+			acceptor.bind(loopback, ec);
+		}
+		if (!ec) {
+			acceptor.listen(1, ec);
+		}
+		if (!ec) {
+			second.connect(acceptor.local_endpoint(ec), ec);
+		}
+		if (!ec) {
+			acceptor.accept(first, ec);
+		}
+
+		if (ec) {
+			first.close(ec);
+			second.close(ec);
+			return false;
+		}
+
+		first.set_option(asio::ip::tcp::no_delay(true), ec);
+		second.set_option(asio::ip::tcp::no_delay(true), ec);
+		return true;
+	}
+
+	void setCurrentThreadCore(unsigned core)
+	{
+		::SetThreadIdealProcessor(::GetCurrentThread(), core);
+	}
+
+	bool LogFile::open(const char* path)
+	{
+		close();
+
+		HANDLE h = ::CreateFileA(path, GENERIC_WRITE, FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (h == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+
+		::SetFilePointer(h, 0, nullptr, FILE_END);
+
+		handle_ = h;
+		return true;
+	}
+
+	void LogFile::close()
+	{
+		if (handle_) {
+			::CloseHandle(handle_);
+			handle_ = nullptr;
+		}
+	}
+
+	bool LogFile::isOpen() const
+	{
+		return handle_ != nullptr;
+	}
+
+	void LogFile::write(const char* data, size_t size)
+	{
+		DWORD bytesWritten = 0;
+		::WriteFile(handle_, data, (DWORD)size, &bytesWritten, nullptr);
+	}
+}
+
+#endif
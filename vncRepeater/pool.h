@@ -0,0 +1,221 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// thread safe free list, so objects which are expensive to allocate are reused rather than going
+// back to the heap. at most maxIdle objects are kept around while unused.
+template <typename T>
+class ObjectPool
+{
+public:
+	// returns the object to the pool it came from
+	class Deleter
+	{
+	public:
+		Deleter()
+			: pool_(nullptr)
+		{}
+
+		explicit Deleter(ObjectPool* pool)
+			: pool_(pool)
+		{}
+
+		void operator()(T* p) const
+		{
+			pool_->release(p);
+		}
+
+	private:
+		ObjectPool* pool_;
+	};
+
+	using Pointer = std::unique_ptr<T, Deleter>;
+
+	explicit ObjectPool(size_t maxIdle)
+		: maxIdle_(maxIdle)
+	{}
+
+	~ObjectPool()
+	{
+		for (T* p : idle_) {
+			delete p;
+		}
+	}
+
+	ObjectPool(const ObjectPool&) = delete;
+	ObjectPool& operator=(const ObjectPool&) = delete;
+
+	// `args` construct a new object when none is idle, so they should be the same on every call
+	template <typename... Args>
+	Pointer acquire(Args&&... args)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (!idle_.empty()) {
+				T* p = idle_.back();
+				idle_.pop_back();
+				return Pointer(p, Deleter(this));
+			}
+		}
+
+		return Pointer(new T(std::forward<Args>(args)...), Deleter(this));
+	}
+
+private:
+	void release(T* p)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (idle_.size() < maxIdle_) {
+				idle_.push_back(p);
+				return;
+			}
+		}
+
+		delete p;
+	}
+
+	std::mutex mutex_;
+	std::vector<T*> idle_;
+	const size_t maxIdle_;
+};
+
+// allocator for std::allocate_shared which recycles blocks through a free list per thread, so objects
+// created and destroyed at a high rate stop reaching the heap once warmed up. a block freed on another
+// thread joins that thread's list; lists which grow too long pass a batch to a shared list, and empty
+// ones refill from it, so blocks flow back to the threads allocating them with one lock per batch.
+template <typename T>
+class RecyclingAllocator
+{
+public:
+	using value_type = T;
+
+	RecyclingAllocator()
+	{}
+
+	template <typename U>
+	RecyclingAllocator(const RecyclingAllocator<U>&)
+	{}
+
+	T* allocate(size_t n)
+	{
+		if (n == 1) {
+			auto& local = localCache().idle;
+			if (local.empty()) {
+				central().take(local);
+			}
+			if (!local.empty()) {
+				void* p = local.back();
+				local.pop_back();
+				return static_cast<T*>(p);
+			}
+		}
+
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T* p, size_t n)
+	{
+		if (n == 1) {
+			auto& local = localCache().idle;
+			if (local.size() >= localLimit) {
+				central().give(local, batch);
+			}
+			local.push_back(p);
+			return;
+		}
+
+		::operator delete(p);
+	}
+
+	template <typename U>
+	bool operator==(const RecyclingAllocator<U>&) const
+	{
+		return true;
+	}
+
+	template <typename U>
+	bool operator!=(const RecyclingAllocator<U>&) const
+	{
+		return false;
+	}
+
+private:
+	static constexpr size_t batch = 32;
+	static constexpr size_t localLimit = 2 * batch;
+	static constexpr size_t centralLimit = 1024;
+
+	struct Central
+	{
+		std::mutex mutex;
+		std::vector<void*> idle;
+
+		~Central()
+		{
+			for (void* p : idle) {
+				::operator delete(p);
+			}
+		}
+
+		void take(std::vector<void*>& local)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!idle.empty() && local.size() < batch) {
+				local.push_back(idle.back());
+				idle.pop_back();
+			}
+		}
+
+		void give(std::vector<void*>& local, size_t count)
+		{
+			std::vector<void*> excess;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				for (; count && !local.empty(); --count) {
+					if (idle.size() < centralLimit) {
+						idle.push_back(local.back());
+					}
+					else {
+						excess.push_back(local.back());
+					}
+					local.pop_back();
+				}
+			}
+
+			for (void* p : excess) {
+				::operator delete(p);
+			}
+		}
+	};
+
+	struct Local
+	{
+		std::vector<void*> idle;
+
+		Local()
+		{
+			idle.reserve(localLimit);
+		}
+
+		// a thread which exits leaves its blocks to the others
+		~Local()
+		{
+			central().give(idle, idle.size());
+		}
+	};
+
+	static Central& central()
+	{
+		static Central central;
+		return central;
+	}
+
+	static Local& localCache()
+	{
+		thread_local Local local;
+		return local;
+	}
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+// ring buffer for one direction of a relay, over memory which is attached once the relay starts.
+// reads fill the free space while earlier data is still being written out, so the two overlap
+// instead of running strictly read -> write -> read.
+class RelayRing
+{
+public:
+	RelayRing()
+	{}
+
+	RelayRing(const RelayRing&) = delete;
+	RelayRing& operator=(const RelayRing&) = delete;
+
+	void attach(uint8_t* storage, size_t capacity)
+	{
+		storage_ = storage;
+		capacity_ = capacity;
+		begin_ = 0;
+		size_ = 0;
+		held_ = 0;
+	}
+
+	// continue in other memory of at least size() bytes, copying the buffered data to its start.
+	// nothing may be reading into or writing from the ring meanwhile, and nothing may be held
+	void moveTo(uint8_t* storage, size_t capacity)
+	{
+		size_t copied = 0;
+		for (auto& buffer : readable()) {
+			memcpy(storage + copied, asio::buffer_cast<const uint8_t*>(buffer), asio::buffer_size(buffer));
+			copied += asio::buffer_size(buffer);
+		}
+
+		storage_ = storage;
+		capacity_ = capacity;
+		begin_ = 0;
+	}
+
+	void detach()
+	{
+		attach(nullptr, 0);
+	}
+
+	bool attached() const
+	{
+		return storage_ != nullptr;
+	}
+
+	size_t capacity() const
+	{
+		return capacity_;
+	}
+
+	size_t size() const
+	{
+		return size_;
+	}
+
+	bool empty() const
+	{
+		return size_ == 0;
+	}
+
+	// written bytes which still can't be reused; see retain()
+	size_t held() const
+	{
+		return held_;
+	}
+
+	// no free space, between what is buffered and what is held
+	bool full() const
+	{
+		return size_ + held_ == capacity_;
+	}
+
+	// free space after the buffered data, at most `limit` bytes; the second buffer is used when it wraps
+	std::array<asio::mutable_buffer, 2> writable(size_t limit)
+	{
+		size_t available = std::min(limit, capacity() - size_ - held_);
+		size_t end = (begin_ + size_) % capacity();
+		size_t first = std::min(available, capacity() - end);
+
+		return{ {
+			asio::buffer(&storage_[end], first),
+			asio::buffer(&storage_[0], available - first)
+		} };
+	}
+
+	// buffered data in order; the second buffer is used when it wraps
+	std::array<asio::const_buffer, 2> readable() const
+	{
+		size_t first = std::min(size_, capacity() - begin_);
+
+		return{ {
+			asio::buffer(&storage_[begin_], first),
+			asio::buffer(&storage_[0], size_ - first)
+		} };
+	}
+
+	// mark bytes read into writable() as buffered
+	void commit(size_t bytes)
+	{
+		size_ += bytes;
+	}
+
+	// release bytes from readable() once they have been written.
+	// begin_ is never rewound, since a read may already be filling the space after the data
+	void consume(size_t bytes)
+	{
+		size_ -= bytes;
+		begin_ = (begin_ + bytes) % capacity();
+	}
+
+	// like consume(), but the space stays out of writable() until release(), for data the kernel
+	// may still be sending from this memory
+	void retain(size_t bytes)
+	{
+		consume(bytes);
+		held_ += bytes;
+	}
+
+	// make the oldest retained bytes free space again
+	void release(size_t bytes)
+	{
+		held_ -= bytes;
+	}
+
+private:
+	uint8_t* storage_ = nullptr;
+	size_t capacity_ = 0;
+
+	size_t begin_ = 0;
+	size_t size_ = 0;
+
+	// retained bytes, just before begin_
+	size_t held_ = 0;
+};
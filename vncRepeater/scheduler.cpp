@@ -0,0 +1,95 @@
+#include "stdafx.h"
+#include "scheduler.h"
+
+#include <cassert>
+
+using namespace std;
+
+namespace {
+	// a thread which has run this many handlers back to back has more queued than it keeps up with
+	constexpr size_t backlog = 2;
+
+	// the index of the scheduler thread running on this thread, if any
+	thread_local size_t currentThread = SIZE_MAX;
+
+	uint64_t bit(size_t index)
+	{
+		return uint64_t(1) << index;
+	}
+}
+
+StealingScheduler::StealingScheduler(const vector<asio::io_service*>& services)
+{
+	assert(services.size() <= 64);
+
+	for (auto ioService : services) {
+		threads_.emplace_back(new Thread(*ioService));
+	}
+}
+
+void StealingScheduler::run(size_t index)
+{
+	auto& ioService = threads_[index]->ioService;
+	size_t streak = 0;
+
+	currentThread = index;
+
+	while (!ioService.stopped()) {
+		if (ioService.poll_one()) {
+			if (++streak >= backlog && idle_.load(memory_order_relaxed)) {
+				wakeIdle(index);
+			}
+			continue;
+		}
+		streak = 0;
+
+		if (steal(index)) {
+			continue;
+		}
+
+		// nothing anywhere. a thread getting behind after this wakes us once it sees the bit
+		idle_.fetch_or(bit(index));
+		ioService.run_one();
+		idle_.fetch_and(~bit(index));
+	}
+
+	currentThread = SIZE_MAX;
+}
+
+bool StealingScheduler::steal(size_t index)
+{
+	// start from the next thread along, so thieves don't all go for the same one first
+	for (size_t offset = 1; offset < threads_.size(); ++offset) {
+		if (threads_[(index + offset) % threads_.size()]->ioService.poll_one()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void StealingScheduler::wakeIdle(size_t index)
+{
+	uint64_t idle = idle_.load(memory_order_relaxed) & ~bit(index);
+
+	while (idle) {
+		size_t sleeper = 0;
+		while (!(idle & bit(sleeper))) {
+			++sleeper;
+		}
+
+		// whoever clears the bit sends the wake, so a sleeper is only woken once
+		if (!(idle_.fetch_and(~bit(sleeper)) & bit(sleeper))) {
+			idle &= ~bit(sleeper);
+			continue;
+		}
+
+		auto& thread = *threads_[sleeper];
+		thread.ioService.post(MakeBufferedHandler(thread.wakeHandler, [this, sleeper]() {
+			// another thread stole the wake, so the sleeper is still asleep; let the next backlog try again
+			if (currentThread != sleeper) {
+				idle_.fetch_or(bit(sleeper));
+			}
+		}));
+		return;
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include "util.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// runs a group of io threads which each have their own io_service, as with config::perCoreIo, but lets
+// a thread with nothing of its own to do run handlers queued on the others' io_services.
+// every operation still completes on the io_service of the socket or timer it was started on, so a
+// connection's handlers normally run on the thread which owns it, and only move when that thread is
+// behind. a thread looks for work elsewhere only once its own io_service is empty, and a thread which
+// keeps finding work waiting wakes one which went to sleep, so idle threads aren't polling each other.
+// handlers may run on any thread of the group, which the repeater already allows since everything a
+// connection touches is behind its Serializer or kept per thread.
+class StealingScheduler
+{
+public:
+	// at most 64 io_services, one per thread
+	explicit StealingScheduler(const std::vector<asio::io_service*>& services);
+
+	StealingScheduler(const StealingScheduler&) = delete;
+	StealingScheduler& operator=(const StealingScheduler&) = delete;
+
+	// run io thread `index` until its io_service is stopped
+	void run(size_t index);
+
+private:
+	// run one handler queued on another io_service; false if none was ready
+	bool steal(size_t index);
+
+	// have a sleeping thread other than `index` look for something to steal
+	void wakeIdle(size_t index);
+
+	struct Thread
+	{
+		explicit Thread(asio::io_service& ioService)
+			: ioService(ioService)
+			, work(ioService)
+		{}
+
+		asio::io_service& ioService;
+
+		// otherwise run_one would return at once whenever the io_service had nothing outstanding
+		asio::io_service::work work;
+
+		// only one wake is outstanding per thread, since waking clears its idle bit
+		BufferedHandlerAllocator wakeHandler;
+	};
+
+	std::vector<std::unique_ptr<Thread>> threads_;
+
+	// a bit per thread blocked waiting on its own io_service
+	std::atomic<uint64_t> idle_{ 0 };
+};
@@ -0,0 +1,106 @@
+#include "stdafx.h"
+#include "serializer.h"
+
+using namespace std;
+
+namespace {
+	// queued handlers run back to back before the rest are put behind other work on the io_service
+	constexpr size_t drainBatch = 16;
+}
+
+thread_local Serializer::Running* Serializer::running_ = nullptr;
+
+Serializer::Running::Running(const Serializer& serializer)
+	: serializer(&serializer)
+	, outer(running_)
+{
+	running_ = this;
+}
+
+Serializer::Running::~Running()
+{
+	running_ = outer;
+}
+
+Serializer::~Serializer()
+{
+	while (Operation* operation = pop()) {
+		operation->complete(nullptr, operation, false);
+	}
+}
+
+bool Serializer::running_in_this_thread() const
+{
+	for (Running* running = running_; running; running = running->outer) {
+		if (running->serializer == this) {
+			return true;
+		}
+	}
+	return false;
+}
+
+Serializer::Operation* Serializer::pop()
+{
+	Operation* operation = head_;
+	if (operation) {
+		head_ = operation->next;
+		if (!head_) {
+			tail_ = nullptr;
+		}
+		operation->next = nullptr;
+	}
+	return operation;
+}
+
+void Serializer::release()
+{
+	{
+		lock_guard<mutex> lock(mutex_);
+		if (!head_) {
+			locked_ = false;
+			return;
+		}
+	}
+
+	scheduleDrain();
+}
+
+Serializer::Operation* Serializer::next(bool more)
+{
+	{
+		lock_guard<mutex> lock(mutex_);
+		if (!head_) {
+			locked_ = false;
+			return nullptr;
+		}
+		if (more) {
+			return pop();
+		}
+	}
+
+	scheduleDrain();
+	return nullptr;
+}
+
+void Serializer::scheduleDrain()
+{
+	ioService_.post(MakeBufferedHandler(drainHandler_, [this]() {
+		drain();
+	}));
+}
+
+// run queued handlers; the serializer is locked, and its queue isn't empty
+void Serializer::drain()
+{
+	Operation* operation;
+	{
+		lock_guard<mutex> lock(mutex_);
+		operation = pop();
+	}
+
+	Running running(*this);
+
+	for (size_t ran = 1; operation; ++ran) {
+		operation = operation->complete(this, operation, ran < drainBatch);
+	}
+}
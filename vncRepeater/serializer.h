@@ -0,0 +1,354 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include "util.h"
+
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// the asio handler hooks, looked up the way asio does so a handler's own allocator and invocation are used
+namespace serializerHooks
+{
+	using asio::asio_handler_allocate;
+	using asio::asio_handler_deallocate;
+	using asio::asio_handler_invoke;
+	using asio::asio_handler_is_continuation;
+
+	template <typename Context>
+	void* allocate(std::size_t size, Context& context)
+	{
+		return asio_handler_allocate(size, std::addressof(context));
+	}
+
+	template <typename Context>
+	void deallocate(void* pointer, std::size_t size, Context& context)
+	{
+		asio_handler_deallocate(pointer, size, std::addressof(context));
+	}
+
+	template <typename Function, typename Context>
+	void invoke(Function& function, Context& context)
+	{
+		asio_handler_invoke(function, std::addressof(context));
+	}
+
+	template <typename Context>
+	bool isContinuation(Context& context)
+	{
+		return asio_handler_is_continuation(std::addressof(context));
+	}
+}
+
+// runs handlers one at a time, in the order they are posted or dispatched, like asio::strand.
+// asio maps every strand onto one of a fixed 193 implementations by hashing, so with thousands of
+// sessions unrelated ones share an implementation and wait for each other's handlers; a Serializer
+// is only ever shared by the handlers of the object which owns it.
+// a handler dispatched while nothing else of the serializer runs is run at once on the calling
+// thread. one that has to wait is queued in memory from its own asio_handler_allocate, as asio's
+// strand would, so a BufferedHandler still allocates nothing; once the running handler is done,
+// the queue is run from the io_service.
+// the owner must stay alive while handlers are queued, which holds as long as they keep a
+// reference to it.
+class Serializer
+{
+public:
+	explicit Serializer(asio::io_service& ioService)
+		: ioService_(ioService)
+	{}
+
+	// handlers still queued are destroyed without being run
+	~Serializer();
+
+	Serializer(const Serializer&) = delete;
+	Serializer& operator=(const Serializer&) = delete;
+
+	asio::io_service& get_io_service()
+	{
+		return ioService_;
+	}
+
+	// true while a handler of this serializer runs on the calling thread
+	bool running_in_this_thread() const;
+
+	// run `handler` now if this serializer is free or already running on this thread; otherwise queue it
+	template <typename Handler>
+	void dispatch(Handler&& handler)
+	{
+		if (running_in_this_thread()) {
+			handler();
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (locked_) {
+				push(makeOperation(std::forward<Handler>(handler)));
+				return;
+			}
+			locked_ = true;
+		}
+
+		{
+			Running running(*this);
+			handler();
+		}
+
+		release();
+	}
+
+	// queue `handler` to run after everything before it, never from within this call
+	template <typename Handler>
+	void post(Handler&& handler)
+	{
+		Operation* operation = makeOperation(std::forward<Handler>(handler));
+
+		bool schedule = false;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			push(operation);
+			if (!locked_) {
+				locked_ = true;
+				schedule = true;
+			}
+		}
+
+		if (schedule) {
+			scheduleDrain();
+		}
+	}
+
+	template <typename Handler>
+	class Wrapped;
+
+	// a handler which dispatches `handler` on this serializer, with the arguments it is called with
+	template <typename Handler>
+	Wrapped<typename std::decay<Handler>::type> wrap(Handler&& handler)
+	{
+		return Wrapped<typename std::decay<Handler>::type>(*this, std::forward<Handler>(handler));
+	}
+
+private:
+	// a queued handler. `complete` runs it and returns the next one to run, which is null unless `more`
+	// allows another; with a null `serializer` the handler is only destroyed
+	struct Operation
+	{
+		Operation* next = nullptr;
+		Operation* (*complete)(Serializer* serializer, Operation* operation, bool more) = nullptr;
+	};
+
+	template <typename Handler>
+	struct HandlerOperation
+		: Operation
+	{
+		template <typename H>
+		explicit HandlerOperation(H&& h)
+			: handler(std::forward<H>(h))
+		{
+			complete = &HandlerOperation::run;
+		}
+
+		Handler handler;
+
+		static Operation* run(Serializer* serializer, Operation* base, bool more)
+		{
+			auto operation = static_cast<HandlerOperation*>(base);
+
+			// free the operation first, so the handler may reuse its memory for whatever it starts next
+			Handler handler(std::move(operation->handler));
+			operation->~HandlerOperation();
+			serializerHooks::deallocate(operation, sizeof(HandlerOperation), handler);
+
+			if (!serializer) {
+				return nullptr;
+			}
+
+			handler();
+
+			// the handler may hold the last reference to the serializer's owner, so decide what runs next before it goes
+			return serializer->next(more);
+		}
+	};
+
+	template <typename Handler>
+	Operation* makeOperation(Handler&& handler)
+	{
+		typedef HandlerOperation<typename std::decay<Handler>::type> Op;
+
+		void* memory = serializerHooks::allocate(sizeof(Op), handler);
+		return new (memory) Op(std::forward<Handler>(handler));
+	}
+
+	// marks the serializer as running on this thread for its lifetime; these nest
+	struct Running
+	{
+		explicit Running(const Serializer& serializer);
+		~Running();
+
+		const Serializer* serializer;
+		Running* outer;
+	};
+
+	void push(Operation* operation)
+	{
+		if (tail_) {
+			tail_->next = operation;
+		}
+		else {
+			head_ = operation;
+		}
+		tail_ = operation;
+	}
+
+	Operation* pop();
+
+	// after a handler ran directly: unlock, or have the io_service run whatever queued meanwhile
+	void release();
+
+	// the next queued handler, or null once the serializer is unlocked or its queue rescheduled
+	Operation* next(bool more);
+
+	void scheduleDrain();
+	void drain();
+
+	asio::io_service& ioService_;
+
+	std::mutex mutex_;
+	Operation* head_ = nullptr;
+	Operation* tail_ = nullptr;
+
+	// a handler is running, or the queue is waiting for the io_service to run it
+	bool locked_ = false;
+
+	// only one drain is posted at a time
+	BufferedHandlerAllocator drainHandler_;
+
+	static thread_local Running* running_;
+};
+
+// the handler Serializer::wrap returns; it forwards the asio hooks to the handler it wraps,
+// and runs the intermediate steps of composed operations on the serializer as well
+template <typename Handler>
+class Serializer::Wrapped
+{
+public:
+	template <typename H>
+	Wrapped(Serializer& serializer, H&& handler)
+		: serializer_(&serializer)
+		, handler_(std::forward<H>(handler))
+	{}
+
+	template <typename ...Args>
+	void operator()(Args&&... args)
+	{
+		serializer_->dispatch(Bound<typename std::decay<Args>::type...>(handler_, std::forward<Args>(args)...));
+	}
+
+	friend void* asio_handler_allocate(std::size_t size, Wrapped* this_handler)
+	{
+		return serializerHooks::allocate(size, this_handler->handler_);
+	}
+
+	friend void asio_handler_deallocate(void* pointer, std::size_t size, Wrapped* this_handler)
+	{
+		serializerHooks::deallocate(pointer, size, this_handler->handler_);
+	}
+
+	template <typename Function>
+	friend void asio_handler_invoke(Function& function, Wrapped* this_handler)
+	{
+		this_handler->invoke(function);
+	}
+
+	template <typename Function>
+	friend void asio_handler_invoke(const Function& function, Wrapped* this_handler)
+	{
+		this_handler->invoke(function);
+	}
+
+	friend bool asio_handler_is_continuation(Wrapped* this_handler)
+	{
+		return this_handler->serializer_->running_in_this_thread() || serializerHooks::isContinuation(this_handler->handler_);
+	}
+
+private:
+	template <typename Function>
+	void invoke(Function& function)
+	{
+		// already serialized, so the step needn't be copied to be queued
+		if (serializer_->running_in_this_thread()) {
+			serializerHooks::invoke(function, handler_);
+			return;
+		}
+
+		serializer_->dispatch(Rebound<typename std::remove_const<Function>::type>(function, handler_));
+	}
+
+	// the handler with the arguments of its completion
+	template <typename ...Args>
+	struct Bound
+	{
+		template <typename ...A>
+		Bound(const Handler& handler, A&&... args)
+			: handler(handler)
+			, args(std::forward<A>(args)...)
+		{}
+
+		void operator()()
+		{
+			call(std::index_sequence_for<Args...>());
+		}
+
+		template <size_t ...Indices>
+		void call(std::index_sequence<Indices...>)
+		{
+			handler(static_cast<const Args&>(std::get<Indices>(args))...);
+		}
+
+		friend void* asio_handler_allocate(std::size_t size, Bound* this_handler)
+		{
+			return serializerHooks::allocate(size, this_handler->handler);
+		}
+
+		friend void asio_handler_deallocate(void* pointer, std::size_t size, Bound* this_handler)
+		{
+			serializerHooks::deallocate(pointer, size, this_handler->handler);
+		}
+
+		Handler handler;
+		std::tuple<Args...> args;
+	};
+
+	// an intermediate step of a composed operation, which allocates and runs as the handler it ends with
+	template <typename Function>
+	struct Rebound
+	{
+		Rebound(const Function& function, const Handler& handler)
+			: function(function)
+			, handler(handler)
+		{}
+
+		void operator()()
+		{
+			serializerHooks::invoke(function, handler);
+		}
+
+		friend void* asio_handler_allocate(std::size_t size, Rebound* this_handler)
+		{
+			return serializerHooks::allocate(size, this_handler->handler);
+		}
+
+		friend void asio_handler_deallocate(void* pointer, std::size_t size, Rebound* this_handler)
+		{
+			serializerHooks::deallocate(pointer, size, this_handler->handler);
+		}
+
+		Function function;
+		Handler handler;
+	};
+
+	Serializer* serializer_;
+	Handler handler_;
+};
@@ -2,7 +2,7 @@
 #include "service.h"
 #include "vncRepeater.h"
 
-
+#ifdef _WIN32
 
 BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType)
 {
@@ -18,6 +18,11 @@ BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType)
 	return FALSE;
 }
 
+void InstallStopHandler(asio::io_service& ioService)
+{
+	::SetConsoleCtrlHandler(&ConsoleCtrlHandler, TRUE);
+}
+
 
 
 SERVICE_STATUS          _ServiceStatus;
@@ -91,9 +96,37 @@ int BeginService()
 	};
 
 	if (!StartServiceCtrlDispatcher(ServiceTable)) {
-		return GetLastError();
+		DWORD lastError = GetLastError();
+		if (ERROR_FAILED_SERVICE_CONTROLLER_CONNECT == lastError) {
+			return serviceNotStarted;
+		}
+		return lastError;
 	}
 
 	return 0;
 }
 
+#else
+
+// systemd and friends run us in the foreground, so there is no service dispatcher to connect to
+int BeginService()
+{
+	return serviceNotStarted;
+}
+
+void InstallStopHandler(asio::io_service& ioService)
+{
+	// held by its own wait, so it goes with the io_service rather than outliving it
+	auto stopSignals = std::make_shared<asio::signal_set>(ioService, SIGINT, SIGTERM);
+
+	stopSignals->async_wait([stopSignals](const std::error_code& ec, int) {
+		if (ec) {
+			return;
+		}
+
+		StopApplication();
+	});
+}
+
+#endif
+
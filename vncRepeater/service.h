@@ -1,6 +1,9 @@
 #pragma once
 
+// returned by BeginService when the process was not started by a service manager
+constexpr int serviceNotStarted = -1;
 
 int BeginService();
 
-BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType);
+// route console close / termination signals to StopApplication
+void InstallStopHandler(asio::io_service& ioService);
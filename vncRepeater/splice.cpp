@@ -0,0 +1,95 @@
+#include "stdafx.h"
+#include "splice.h"
+
+#ifdef VNCREPEATER_HAS_SPLICE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+	// default pipe capacity on Linux; splice never moves more than the pipe can hold
+	constexpr size_t spliceChunkSize = 0x10000;
+
+	std::error_code lastError()
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return asio::error::would_block;
+		}
+		return std::error_code(errno, asio::error::get_system_category());
+	}
+}
+
+bool SplicePipe::open()
+{
+	close();
+
+	int fds[2] = { -1, -1 };
+	if (0 != ::pipe2(fds, O_NONBLOCK | O_CLOEXEC)) {
+		return false;
+	}
+
+	readEnd_ = fds[0];
+	writeEnd_ = fds[1];
+	pending_ = 0;
+	return true;
+}
+
+void SplicePipe::close()
+{
+	if (readEnd_ >= 0) {
+		::close(readEnd_);
+		readEnd_ = -1;
+	}
+	if (writeEnd_ >= 0) {
+		::close(writeEnd_);
+		writeEnd_ = -1;
+	}
+	pending_ = 0;
+}
+
+size_t SplicePipe::fill(int socket, std::error_code& ec)
+{
+	ec.clear();
+
+	ssize_t moved;
+	do {
+		moved = ::splice(socket, nullptr, writeEnd_, nullptr, spliceChunkSize - pending_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	} while (moved < 0 && errno == EINTR);
+
+	if (moved < 0) {
+		ec = lastError();
+		return 0;
+	}
+
+	pending_ += (size_t)moved;
+	return (size_t)moved;
+}
+
+size_t SplicePipe::drain(int socket, std::error_code& ec)
+{
+	ec.clear();
+
+	size_t total = 0;
+	while (pending_) {
+		ssize_t moved = ::splice(readEnd_, nullptr, socket, nullptr, pending_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (moved < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ec = lastError();
+			break;
+		}
+		if (moved == 0) {
+			ec = asio::error::eof;
+			break;
+		}
+
+		pending_ -= (size_t)moved;
+		total += (size_t)moved;
+	}
+
+	return total;
+}
+
+#endif
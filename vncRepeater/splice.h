@@ -0,0 +1,57 @@
+#pragma once
+
+#include <system_error>
+
+#ifdef __linux__
+#define VNCREPEATER_HAS_SPLICE 1
+#endif
+
+#ifdef VNCREPEATER_HAS_SPLICE
+
+// a kernel pipe used to move data from one socket to another with splice(2),
+// so relayed bytes never have to be copied into user space and back again.
+class SplicePipe
+{
+public:
+	SplicePipe()
+	{}
+
+	~SplicePipe()
+	{
+		close();
+	}
+
+	SplicePipe(const SplicePipe&) = delete;
+	SplicePipe& operator=(const SplicePipe&) = delete;
+
+	// false if pipes are not available; the caller should fall back to copying
+	bool open();
+	void close();
+
+	bool isOpen() const
+	{
+		return writeEnd_ >= 0;
+	}
+
+	// bytes moved into the pipe which have not been drained yet
+	size_t pending() const
+	{
+		return pending_;
+	}
+
+	// move whatever is available on the socket into the pipe.
+	// returns 0 on eof; ec is would_block when nothing was ready
+	size_t fill(int socket, std::error_code& ec);
+
+	// move pending bytes from the pipe to the socket.
+	// ec is would_block when the socket could not take everything
+	size_t drain(int socket, std::error_code& ec);
+
+private:
+	int readEnd_ = -1;
+	int writeEnd_ = -1;
+
+	size_t pending_ = 0;
+};
+
+#endif
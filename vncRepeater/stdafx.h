@@ -5,6 +5,8 @@
 
 #pragma once
 
+#ifdef _WIN32
+
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
@@ -15,23 +17,31 @@
 
 #include <SDKDDKVer.h>
 
-#include <stdio.h>
 #include <tchar.h>
 
+#endif
+
+#include <stdio.h>
+
 #include <cstdint>
 
 #include <memory>
 
+#include <array>
 #include <vector>
 #include <thread>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <sstream>
 #include <chrono>
+#include <future>
 
 #include "asio.hpp"
 
+#ifdef _WIN32
 // for SIO_KEEPALIVE_VALS and etc
 #include <mstcpip.h>
 #include <ShlObj.h>
-#include <Shlwapi.h>
\ No newline at end of file
+#include <Shlwapi.h>
+#endif
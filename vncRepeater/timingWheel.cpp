@@ -0,0 +1,210 @@
+#include "stdafx.h"
+#include "timingWheel.h"
+
+using namespace std;
+
+void WheelTimer::schedule(TimingWheel& wheel, weak_ptr<void> owner, Callback callback, chrono::milliseconds delay)
+{
+	if (wheel_ && wheel_ != &wheel) {
+		cancel();
+	}
+
+	wheel.schedule(*this, move(owner), callback, delay);
+}
+
+void WheelTimer::cancel()
+{
+	if (wheel_) {
+		wheel_->cancel(*this);
+	}
+}
+
+TimingWheel::TimingWheel(asio::io_service& ioService, chrono::milliseconds tick)
+	: tick_(tick)
+	, timer_(new asio::steady_timer(ioService))
+{
+	level0_.fill(nullptr);
+	level1_.fill(nullptr);
+}
+
+void TimingWheel::start()
+{
+	timer_->expires_from_now(tick_);
+	armTimer();
+}
+
+void TimingWheel::stop()
+{
+	timer_.reset();
+}
+
+void TimingWheel::schedule(WheelTimer& timer, weak_ptr<void> owner, WheelTimer::Callback callback, chrono::milliseconds delay)
+{
+	unique_lock<mutex> lock(mutex_);
+
+	if (timer.slot_) {
+		unlink(timer);
+	}
+
+	// round up, plus one since part of the current tick has already passed, so a timer never fires early
+	uint64_t ticks = (uint64_t)((delay.count() + tick_.count() - 1) / tick_.count());
+
+	timer.wheel_ = this;
+	timer.owner_ = move(owner);
+	timer.callback_ = callback;
+	timer.expiry_ = now_ + ticks + 1;
+
+	insert(timer);
+}
+
+void TimingWheel::cancel(WheelTimer& timer)
+{
+	unique_lock<mutex> lock(mutex_);
+
+	if (timer.slot_) {
+		unlink(timer);
+	}
+	timer.owner_.reset();
+}
+
+WheelTimer*& TimingWheel::slotFor(uint64_t expiry)
+{
+	if (expiry - now_ < level0Size) {
+		return level0_[expiry & (level0Size - 1)];
+	}
+
+	// re-hashed into the first level when the second level reaches its slot
+	uint64_t span = min<uint64_t>(expiry >> level0Bits, (now_ >> level0Bits) + level1Size - 1);
+	return level1_[span % level1Size];
+}
+
+void TimingWheel::insert(WheelTimer& timer)
+{
+	if (timer.expiry_ < now_) {
+		timer.expiry_ = now_;
+	}
+
+	link(slotFor(timer.expiry_), timer);
+}
+
+void TimingWheel::link(WheelTimer*& slot, WheelTimer& timer)
+{
+	timer.prev_ = nullptr;
+	timer.next_ = slot;
+	if (slot) {
+		slot->prev_ = &timer;
+	}
+	slot = &timer;
+
+	timer.slot_ = &slot;
+}
+
+void TimingWheel::unlink(WheelTimer& timer)
+{
+	if (timer.prev_) {
+		timer.prev_->next_ = timer.next_;
+	}
+	else {
+		*timer.slot_ = timer.next_;
+	}
+	if (timer.next_) {
+		timer.next_->prev_ = timer.prev_;
+	}
+
+	timer.slot_ = nullptr;
+	timer.prev_ = nullptr;
+	timer.next_ = nullptr;
+}
+
+void TimingWheel::armTimer()
+{
+	timer_->async_wait(MakeBufferedHandler(timerHandler_, [this](const std::error_code& ec) {
+		if (ec) {
+			return;
+		}
+
+		advance();
+
+		// deadlines are relative to the last one, so ticks don't drift
+		timer_->expires_at(timer_->expires_at() + tick_);
+		armTimer();
+	}));
+}
+
+void TimingWheel::advance()
+{
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		++now_;
+
+		// at the start of each first level revolution, move the next second level slot down
+		if ((now_ & (level0Size - 1)) == 0) {
+			auto& span = level1_[(now_ >> level0Bits) % level1Size];
+			WheelTimer* timer = span;
+			span = nullptr;
+
+			while (timer) {
+				WheelTimer* next = timer->next_;
+				timer->slot_ = nullptr;
+				insert(*timer);
+				timer = next;
+			}
+		}
+
+		auto& slot = level0_[now_ & (level0Size - 1)];
+		WheelTimer* timer = slot;
+		slot = nullptr;
+
+		while (timer) {
+			WheelTimer* next = timer->next_;
+
+			timer->slot_ = nullptr;
+			timer->prev_ = nullptr;
+			timer->next_ = nullptr;
+
+			// an owner being destroyed right now can't be locked, and will find its timer already unlinked
+			if (auto owner = timer->owner_.lock()) {
+				expired_.emplace_back(timer->callback_, move(owner));
+			}
+			timer->owner_.reset();
+
+			timer = next;
+		}
+	}
+
+	for (auto& expired : expired_) {
+		expired.first(expired.second);
+	}
+	expired_.clear();
+}
+
+TimingWheels::TimingWheels(chrono::milliseconds tick)
+	: tick_(tick)
+{}
+
+void TimingWheels::open(const vector<asio::io_service*>& threadServices)
+{
+	for (auto ioService : threadServices) {
+		wheels_.emplace_back(new TimingWheel(*ioService, tick_));
+	}
+}
+
+void TimingWheels::start()
+{
+	for (auto& wheel : wheels_) {
+		wheel->start();
+	}
+}
+
+void TimingWheels::stop()
+{
+	for (auto& wheel : wheels_) {
+		wheel->stop();
+	}
+}
+
+TimingWheel& TimingWheels::local()
+{
+	return *wheels_[ioThreadIndex() % wheels_.size()];
+}
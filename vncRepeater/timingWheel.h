@@ -0,0 +1,124 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "util.h"
+
+class TimingWheel;
+
+// an intrusive entry in a TimingWheel; embed it in the object being timed.
+// the wheel only holds a weak reference to the owner, and a destroyed entry cancels itself.
+class WheelTimer
+{
+public:
+	// called from the io_service once the deadline passes; owner is kept alive for the call
+	using Callback = void(*)(const std::shared_ptr<void>& owner);
+
+	WheelTimer()
+	{}
+
+	~WheelTimer()
+	{
+		cancel();
+	}
+
+	WheelTimer(const WheelTimer&) = delete;
+	WheelTimer& operator=(const WheelTimer&) = delete;
+
+	void schedule(TimingWheel& wheel, std::weak_ptr<void> owner, Callback callback, std::chrono::milliseconds delay);
+	void cancel();
+
+private:
+	friend class TimingWheel;
+
+	TimingWheel* wheel_ = nullptr;
+
+	// the slot list this entry is linked into, if any
+	WheelTimer** slot_ = nullptr;
+	WheelTimer* prev_ = nullptr;
+	WheelTimer* next_ = nullptr;
+
+	uint64_t expiry_ = 0;
+
+	std::weak_ptr<void> owner_;
+	Callback callback_ = nullptr;
+};
+
+// two level hashed timing wheel, advanced by one periodic timer.
+// scheduling and cancelling are O(1) and never touch asio's timer queue, so a storm of
+// connections mid-handshake costs a list insert each instead of a heap push under the reactor lock.
+// the first level covers 256 ticks; the second level covers 64 spans of that, and longer delays
+// are parked in the furthest slot and re-hashed until they come into range.
+class TimingWheel
+{
+public:
+	TimingWheel(asio::io_service& ioService, std::chrono::milliseconds tick);
+
+	TimingWheel(const TimingWheel&) = delete;
+	TimingWheel& operator=(const TimingWheel&) = delete;
+
+	void start();
+
+	// close the periodic timer, which has to go before its io_service does. the wheel itself has to
+	// outlive the io_service, since sessions it destroys still cancel their entries
+	void stop();
+
+private:
+	friend class WheelTimer;
+
+	static constexpr size_t level0Bits = 8;
+	static constexpr size_t level0Size = 1 << level0Bits;
+	static constexpr size_t level1Size = 64;
+
+	void schedule(WheelTimer& timer, std::weak_ptr<void> owner, WheelTimer::Callback callback, std::chrono::milliseconds delay);
+	void cancel(WheelTimer& timer);
+
+	void insert(WheelTimer& timer);
+	void link(WheelTimer*& slot, WheelTimer& timer);
+	void unlink(WheelTimer& timer);
+	WheelTimer*& slotFor(uint64_t expiry);
+
+	void armTimer();
+	void advance();
+
+	std::mutex mutex_;
+
+	const std::chrono::milliseconds tick_;
+	std::unique_ptr<asio::steady_timer> timer_;
+	BufferedHandlerAllocator timerHandler_;
+
+	uint64_t now_ = 0;
+
+	std::array<WheelTimer*, level0Size> level0_;
+	std::array<WheelTimer*, level1Size> level1_;
+
+	// reused on every tick to call expired entries outside the lock
+	std::vector<std::pair<WheelTimer::Callback, std::shared_ptr<void>>> expired_;
+};
+
+// one TimingWheel per io thread, so threads mostly schedule on a wheel no other thread is using.
+// each wheel ticks on the io_service its thread runs, given by index
+class TimingWheels
+{
+public:
+	explicit TimingWheels(std::chrono::milliseconds tick);
+
+	// make a wheel for each io_service; before anything is scheduled
+	void open(const std::vector<asio::io_service*>& threadServices);
+
+	void start();
+	void stop();
+
+	// the wheel belonging to the calling io thread
+	TimingWheel& local();
+
+private:
+	const std::chrono::milliseconds tick_;
+	std::vector<std::unique_ptr<TimingWheel>> wheels_;
+};
@@ -0,0 +1,275 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// framing for a trunk: one long lived connection between an edge repeater and the core which
+// carries many sessions as streams. both sides first send the preamble, then frames of
+//   type (1 byte), stream (4 bytes), payload length (4 bytes), payload
+// with integers little endian. the edge opens every stream; data is limited by a credit window
+// per stream, which the receiver extends as it delivers data, so one slow session never holds
+// up the others sharing the connection.
+namespace trunk
+{
+	constexpr char preamble[] = "vncRepeater trunk 1\n";
+	constexpr size_t preambleSize = sizeof(preamble) - 1;
+
+	enum class FrameType : uint8_t
+	{
+		// payload is an OpenInfo
+		open = 1,
+		data = 2,
+		// payload is 4 bytes of credit for the sender of the stream
+		window = 3,
+		// the sender of the frame will send nothing more on the stream; each side sends one
+		close = 4,
+	};
+
+	struct FrameHeader
+	{
+		FrameType type;
+		uint32_t stream;
+		uint32_t length;
+	};
+
+	constexpr size_t headerSize = 9;
+
+	// data frames are streamed as they arrive, but anything else is collected first
+	constexpr size_t maxControlPayload = 0x400;
+
+	inline void putUint16(uint8_t* out, uint16_t value)
+	{
+		out[0] = (uint8_t)value;
+		out[1] = (uint8_t)(value >> 8);
+	}
+
+	inline void putUint32(uint8_t* out, uint32_t value)
+	{
+		putUint16(out, (uint16_t)value);
+		putUint16(out + 2, (uint16_t)(value >> 16));
+	}
+
+	inline uint16_t getUint16(const uint8_t* in)
+	{
+		return (uint16_t)(in[0] | (in[1] << 8));
+	}
+
+	inline uint32_t getUint32(const uint8_t* in)
+	{
+		return getUint16(in) | ((uint32_t)getUint16(in + 2) << 16);
+	}
+
+	inline void appendFrame(std::vector<uint8_t>& out, FrameType type, uint32_t stream, const void* payload, size_t length)
+	{
+		uint8_t header[headerSize];
+		header[0] = (uint8_t)type;
+		putUint32(header + 1, stream);
+		putUint32(header + 5, (uint32_t)length);
+
+		out.insert(out.end(), header, header + headerSize);
+		out.insert(out.end(), (const uint8_t*)payload, (const uint8_t*)payload + length);
+	}
+
+	// what the core needs to know about a server or viewer which connected to the edge
+	struct OpenInfo
+	{
+		bool viewer = false;
+		asio::ip::tcp::endpoint remote;
+		std::string id;
+		std::string rfbVersion;
+		std::string extra;
+	};
+
+	inline void appendString(std::vector<uint8_t>& out, const std::string& value)
+	{
+		uint8_t length[2];
+		putUint16(length, (uint16_t)std::min<size_t>(value.size(), 0xffff));
+		out.insert(out.end(), length, length + 2);
+		out.insert(out.end(), value.begin(), value.begin() + getUint16(length));
+	}
+
+	inline std::vector<uint8_t> encodeOpen(const OpenInfo& info)
+	{
+		std::vector<uint8_t> out;
+		out.push_back(info.viewer ? 1 : 0);
+
+		auto address = info.remote.address();
+		if (address.is_v4()) {
+			auto bytes = address.to_v4().to_bytes();
+			out.push_back(4);
+			out.insert(out.end(), bytes.begin(), bytes.end());
+		}
+		else {
+			auto bytes = address.to_v6().to_bytes();
+			out.push_back(6);
+			out.insert(out.end(), bytes.begin(), bytes.end());
+		}
+
+		uint8_t port[2];
+		putUint16(port, info.remote.port());
+		out.insert(out.end(), port, port + 2);
+
+		appendString(out, info.id);
+		appendString(out, info.rfbVersion);
+		appendString(out, info.extra);
+		return out;
+	}
+
+	inline bool readString(const uint8_t*& in, const uint8_t* end, std::string& value)
+	{
+		if (end - in < 2 || end - in - 2 < getUint16(in)) {
+			return false;
+		}
+		size_t length = getUint16(in);
+		value.assign((const char*)in + 2, length);
+		in += 2 + length;
+		return true;
+	}
+
+	inline bool decodeOpen(const uint8_t* in, size_t size, OpenInfo& info)
+	{
+		const uint8_t* end = in + size;
+		if (size < 2) {
+			return false;
+		}
+
+		info.viewer = in[0] != 0;
+		uint8_t family = in[1];
+		in += 2;
+
+		asio::ip::address address;
+		if (family == 4 && end - in >= 4) {
+			asio::ip::address_v4::bytes_type bytes;
+			std::copy(in, in + bytes.size(), bytes.begin());
+			address = asio::ip::address_v4(bytes);
+			in += bytes.size();
+		}
+		else if (family == 6 && end - in >= 16) {
+			asio::ip::address_v6::bytes_type bytes;
+			std::copy(in, in + bytes.size(), bytes.begin());
+			address = asio::ip::address_v6(bytes);
+			in += bytes.size();
+		}
+		else {
+			return false;
+		}
+
+		if (end - in < 2) {
+			return false;
+		}
+		info.remote = asio::ip::tcp::endpoint(address, getUint16(in));
+		in += 2;
+
+		return readString(in, end, info.id)
+			&& readString(in, end, info.rfbVersion)
+			&& readString(in, end, info.extra)
+			&& in == end;
+	}
+
+	// splits what is read from a trunk into frames. data payloads are handed on in whatever
+	// pieces they arrive in, so they can be copied straight to their stream.
+	// the handler provides
+	//   bool control(const FrameHeader&, const uint8_t* payload)
+	//   bool data(uint32_t stream, const uint8_t* bytes, size_t size)
+	// and returns false to reject the frame, which fails the whole feed.
+	class FrameParser
+	{
+	public:
+		FrameParser()
+		{}
+
+		void reset()
+		{
+			preambleRead_ = 0;
+			headerRead_ = 0;
+			payloadLeft_ = 0;
+			control_.clear();
+		}
+
+		template <typename Handler>
+		bool feed(const uint8_t* in, size_t size, size_t maxData, Handler& handler)
+		{
+			const uint8_t* end = in + size;
+
+			while (in < end) {
+				if (preambleRead_ < preambleSize) {
+					size_t count = std::min<size_t>(end - in, preambleSize - preambleRead_);
+					if (0 != memcmp(in, preamble + preambleRead_, count)) {
+						return false;
+					}
+					preambleRead_ += count;
+					in += count;
+					continue;
+				}
+
+				if (headerRead_ < headerSize) {
+					size_t count = std::min<size_t>(end - in, headerSize - headerRead_);
+					memcpy(&headerBytes_[headerRead_], in, count);
+					headerRead_ += count;
+					in += count;
+
+					if (headerRead_ < headerSize) {
+						break;
+					}
+
+					header_.type = (FrameType)headerBytes_[0];
+					header_.stream = getUint32(&headerBytes_[1]);
+					header_.length = getUint32(&headerBytes_[5]);
+					payloadLeft_ = header_.length;
+
+					if (header_.type < FrameType::open || header_.type > FrameType::close) {
+						return false;
+					}
+					if (header_.length > (header_.type == FrameType::data ? maxData : maxControlPayload)) {
+						return false;
+					}
+				}
+
+				size_t count = std::min<size_t>(end - in, payloadLeft_);
+
+				if (header_.type == FrameType::data) {
+					if (count && !handler.data(header_.stream, in, count)) {
+						return false;
+					}
+				}
+				else {
+					control_.insert(control_.end(), in, in + count);
+				}
+
+				in += count;
+				payloadLeft_ -= count;
+
+				if (payloadLeft_) {
+					break;
+				}
+
+				if (header_.type != FrameType::data) {
+					if (!handler.control(header_, control_.data())) {
+						return false;
+					}
+					control_.clear();
+				}
+				headerRead_ = 0;
+			}
+
+			return true;
+		}
+
+	private:
+		size_t preambleRead_ = 0;
+
+		std::array<uint8_t, headerSize> headerBytes_;
+		size_t headerRead_ = 0;
+
+		FrameHeader header_;
+		size_t payloadLeft_ = 0;
+
+		std::vector<uint8_t> control_;
+	};
+}
@@ -0,0 +1,476 @@
+#include "stdafx.h"
+#include "uring.h"
+
+#ifdef VNCREPEATER_HAS_URING
+
+#include <linux/io_uring.h>
+
+#include <algorithm>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+	// submissions only wait here until the next io_uring_enter, so this is plenty; completions can
+	// pile up faster, and the kernel holds any which overflow the completion ring until it has room
+	constexpr unsigned ringEntries = 1024;
+	constexpr unsigned completionsPerEntry = 4;
+
+	// while a thread reaps completions, what they queue is submitted once the batch is done
+	thread_local bool reaping = false;
+	thread_local Uring* deferred = nullptr;
+
+	int setup(unsigned entries, io_uring_params* params)
+	{
+		return (int)syscall(__NR_io_uring_setup, entries, params);
+	}
+
+	int enter(int ring, unsigned toSubmit, unsigned minComplete, unsigned flags)
+	{
+		return (int)syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, nullptr, 0);
+	}
+
+	int registerRing(int ring, unsigned opcode, const void* arg, unsigned count)
+	{
+		return (int)syscall(__NR_io_uring_register, ring, opcode, arg, count);
+	}
+
+	// every operation the relay and acceptors use, and nothing newer
+	bool supportsOperations(int ring)
+	{
+		constexpr unsigned opCount = 256;
+		vector<uint8_t> memory(sizeof(io_uring_probe) + opCount * sizeof(io_uring_probe_op));
+		auto probe = reinterpret_cast<io_uring_probe*>(memory.data());
+
+		if (registerRing(ring, IORING_REGISTER_PROBE, probe, opCount) < 0) {
+			return false;
+		}
+
+		for (unsigned op : { IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ACCEPT, IORING_OP_ASYNC_CANCEL }) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+UringBuffers::UringBuffers(size_t count, size_t size)
+	: count_(count)
+	, size_(size)
+	, memory_(new uint8_t[count * size])
+{
+	for (size_t index = count; index > 0; --index) {
+		free_.push_back((int)index - 1);
+	}
+}
+
+int UringBuffers::acquire()
+{
+	lock_guard<mutex> lock(mutex_);
+	if (free_.empty()) {
+		return -1;
+	}
+
+	int index = free_.back();
+	free_.pop_back();
+	return index;
+}
+
+void UringBuffers::release(int index)
+{
+	lock_guard<mutex> lock(mutex_);
+	free_.push_back(index);
+}
+
+Uring::Uring(asio::io_service& ioService)
+	: ioService_(ioService)
+	, event_(new asio::posix::stream_descriptor(ioService))
+{}
+
+Uring::~Uring()
+{
+	stop();
+
+	if (sqes_) {
+		::munmap(sqes_, sqesSize_);
+	}
+	if (cqRing_ && cqRing_ != sqRing_) {
+		::munmap(cqRing_, cqRingSize_);
+	}
+	if (sqRing_) {
+		::munmap(sqRing_, sqRingSize_);
+	}
+	if (ring_ >= 0) {
+		::close(ring_);
+	}
+}
+
+void Uring::stop()
+{
+	event_.reset();
+}
+
+bool Uring::open(unsigned entries, UringBuffers* buffers)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * completionsPerEntry;
+
+	ring_ = setup(entries, &params);
+	if (ring_ < 0) {
+		return false;
+	}
+
+	// sockets are polled inside the kernel rather than by a worker thread each, and no completion is lost
+	if (!(params.features & IORING_FEAT_FAST_POLL) || !(params.features & IORING_FEAT_NODROP) || !supportsOperations(ring_)) {
+		return false;
+	}
+
+	sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		sqRingSize_ = cqRingSize_ = max(sqRingSize_, cqRingSize_);
+	}
+
+	sqRing_ = ::mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQ_RING);
+	if (sqRing_ == MAP_FAILED) {
+		sqRing_ = nullptr;
+		return false;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		cqRing_ = sqRing_;
+	}
+	else {
+		cqRing_ = ::mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_CQ_RING);
+		if (cqRing_ == MAP_FAILED) {
+			cqRing_ = nullptr;
+			return false;
+		}
+	}
+
+	sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = ::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		return false;
+	}
+	sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+	auto sq = static_cast<uint8_t*>(sqRing_);
+	sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	sqFlags_ = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+	sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	sqEntries_ = params.sq_entries;
+
+	auto cq = static_cast<uint8_t*>(cqRing_);
+	cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+	cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+
+	int eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eventFd < 0) {
+		return false;
+	}
+
+	std::error_code ec;
+	event_->assign(eventFd, ec);
+	if (ec) {
+		::close(eventFd);
+		return false;
+	}
+
+	if (registerRing(ring_, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0) {
+		return false;
+	}
+
+	if (buffers) {
+		vector<iovec> iovecs(buffers->count());
+		for (size_t index = 0; index < iovecs.size(); ++index) {
+			iovecs[index].iov_base = buffers->data((int)index);
+			iovecs[index].iov_len = buffers->size();
+		}
+
+		// pinning the buffers counts against RLIMIT_MEMLOCK
+		registeredBuffers_ = registerRing(ring_, IORING_REGISTER_BUFFERS, iovecs.data(), (unsigned)iovecs.size()) >= 0;
+		if (!registeredBuffers_) {
+			trace("uring: can't register the relay buffers, so they are used unregistered");
+		}
+	}
+
+	// a write to a socket whose peer has gone raises SIGPIPE, where asio's sends ask not to
+	::signal(SIGPIPE, SIG_IGN);
+
+	return true;
+}
+
+void Uring::start()
+{
+	wait();
+}
+
+io_uring_sqe* Uring::prepare(UringOperation* operation)
+{
+	unsigned tail = *sqTail_;
+	if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) == sqEntries_) {
+		submit();
+		if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) == sqEntries_) {
+			return nullptr;
+		}
+	}
+
+	auto sqe = &sqes_[tail & sqMask_];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = reinterpret_cast<uintptr_t>(operation);
+	return sqe;
+}
+
+void Uring::push()
+{
+	unsigned tail = *sqTail_;
+	sqArray_[tail & sqMask_] = tail & sqMask_;
+	__atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+	++unsubmitted_;
+}
+
+// the kernel isn't taking submissions, so fail the operation the way it would have completed
+void Uring::refuse(UringOperation& operation)
+{
+	ioService_.post([&operation]() {
+		operation.completed(-EBUSY, false);
+	});
+}
+
+void Uring::recv(int socket, const asio::mutable_buffer& buffer, int bufferIndex, UringOperation& operation)
+{
+	{
+		lock_guard<mutex> lock(mutex_);
+		auto sqe = prepare(&operation);
+		if (!sqe) {
+			refuse(operation);
+			return;
+		}
+
+		sqe->fd = socket;
+		sqe->addr = reinterpret_cast<uintptr_t>(asio::buffer_cast<void*>(buffer));
+		sqe->len = (unsigned)asio::buffer_size(buffer);
+
+		if (bufferIndex >= 0 && registeredBuffers_) {
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->buf_index = (uint16_t)bufferIndex;
+			sqe->off = (uint64_t)-1;
+		}
+		else {
+			sqe->opcode = IORING_OP_RECV;
+		}
+
+		push();
+	}
+	queued();
+}
+
+void Uring::send(int socket, const asio::const_buffer& buffer, int bufferIndex, UringOperation& operation)
+{
+	{
+		lock_guard<mutex> lock(mutex_);
+		auto sqe = prepare(&operation);
+		if (!sqe) {
+			refuse(operation);
+			return;
+		}
+
+		sqe->fd = socket;
+		sqe->addr = reinterpret_cast<uintptr_t>(asio::buffer_cast<const void*>(buffer));
+		sqe->len = (unsigned)asio::buffer_size(buffer);
+
+		if (bufferIndex >= 0 && registeredBuffers_) {
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->buf_index = (uint16_t)bufferIndex;
+			sqe->off = (uint64_t)-1;
+		}
+		else {
+			sqe->opcode = IORING_OP_SEND;
+			sqe->msg_flags = MSG_NOSIGNAL;
+		}
+
+		push();
+	}
+	queued();
+}
+
+void Uring::acceptMultishot(int listener, UringOperation& operation)
+{
+	{
+		lock_guard<mutex> lock(mutex_);
+		auto sqe = prepare(&operation);
+		if (!sqe) {
+			refuse(operation);
+			return;
+		}
+
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = listener;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+
+		push();
+	}
+	queued();
+}
+
+void Uring::cancel(UringOperation& operation)
+{
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		// the cancellation's own completion has no operation, and is dropped
+		auto sqe = prepare(nullptr);
+		if (!sqe) {
+			return;
+		}
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = reinterpret_cast<uintptr_t>(&operation);
+
+		push();
+	}
+	queued();
+}
+
+void Uring::queued()
+{
+	if (!reaping) {
+		lock_guard<mutex> lock(mutex_);
+		submit();
+		return;
+	}
+
+	// almost always this thread's own ring; another one is submitted rather than kept waiting
+	if (deferred && deferred != this) {
+		lock_guard<mutex> lock(deferred->mutex_);
+		deferred->submit();
+	}
+	deferred = this;
+}
+
+// a submission the kernel refuses for now goes with the next one
+void Uring::submit()
+{
+	while (unsubmitted_) {
+		int submitted = enter(ring_, unsubmitted_, 0, 0);
+		if (submitted < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		unsubmitted_ -= (unsigned)submitted;
+	}
+}
+
+// reading the eventfd tries the read before waiting, so completions posted between the last look at
+// the ring and this wait are never missed
+void Uring::wait()
+{
+	event_->async_read_some(asio::buffer(&eventCount_, sizeof(eventCount_)), MakeBufferedHandler(eventHandler_, [this](const std::error_code& ec, size_t) {
+		if (ec) {
+			return;
+		}
+		reap();
+	}));
+}
+
+void Uring::reap()
+{
+	reaping = true;
+
+	unsigned head = *cqHead_;
+	unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; ++head) {
+		auto& cqe = cqes_[head & cqMask_];
+		auto operation = reinterpret_cast<UringOperation*>(static_cast<uintptr_t>(cqe.user_data));
+		int result = cqe.res;
+		bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+		// free the entry first; the operation may well start another
+		__atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+
+		if (operation) {
+			operation->completed(result, more);
+		}
+	}
+
+	reaping = false;
+
+	if (deferred) {
+		Uring* ring = deferred;
+		deferred = nullptr;
+
+		lock_guard<mutex> lock(ring->mutex_);
+		ring->submit();
+	}
+
+	// completions which overflowed the ring are moved into it, which signals the eventfd again
+	if (__atomic_load_n(sqFlags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+		enter(ring_, 0, 0, IORING_ENTER_GETEVENTS);
+	}
+
+	wait();
+}
+
+Urings::Urings(const vector<asio::io_service*>& threadServices, size_t bufferCount, size_t bufferSize)
+	: buffers_(bufferCount, bufferSize)
+{
+	for (auto ioService : threadServices) {
+		rings_.emplace_back(new Uring(*ioService));
+	}
+}
+
+bool Urings::open()
+{
+	for (auto& ring : rings_) {
+		if (!ring->open(ringEntries, buffers_.count() ? &buffers_ : nullptr)) {
+			return false;
+		}
+	}
+
+	for (auto& ring : rings_) {
+		ring->start();
+	}
+	return true;
+}
+
+void Urings::stop()
+{
+	for (auto& ring : rings_) {
+		ring->stop();
+	}
+}
+
+Uring& Urings::local()
+{
+	return *rings_[ioThreadIndex() % rings_.size()];
+}
+
+void Urings::cancel(UringOperation& operation)
+{
+	for (auto& ring : rings_) {
+		ring->cancel(operation);
+	}
+}
+
+#endif
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include "util.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define VNCREPEATER_HAS_URING 1
+#endif
+#endif
+
+#ifdef VNCREPEATER_HAS_URING
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// something submitted to a Uring, told about each of its completions on the thread reaping them.
+// `result` is the bytes moved or the accepted descriptor, or a negative errno; `more` is set while
+// a multishot operation keeps going. the operation must stay alive until its last completion
+class UringOperation
+{
+public:
+	virtual void completed(int result, bool more) = 0;
+
+protected:
+	~UringOperation()
+	{}
+};
+
+// equally sized buffers registered with every Uring, so reads and writes through them skip
+// pinning and mapping the user pages on each operation
+class UringBuffers
+{
+public:
+	UringBuffers(size_t count, size_t size);
+
+	UringBuffers(const UringBuffers&) = delete;
+	UringBuffers& operator=(const UringBuffers&) = delete;
+
+	// a free buffer's index, or -1 if all are in use
+	int acquire();
+	void release(int index);
+
+	uint8_t* data(int index)
+	{
+		return memory_.get() + index * size_;
+	}
+
+	size_t count() const
+	{
+		return count_;
+	}
+
+	size_t size() const
+	{
+		return size_;
+	}
+
+private:
+	size_t count_;
+	size_t size_;
+	std::unique_ptr<uint8_t[]> memory_;
+
+	std::mutex mutex_;
+	std::vector<int> free_;
+};
+
+// an io_uring whose completions are reaped on an io_service, which learns of them through an eventfd
+// its reactor watches. operations are queued in the submission ring and submitted with one
+// io_uring_enter: straight away when queued from anywhere else, but at the end of the batch when
+// queued by a completion being reaped, so a relay which completes a read and starts its write and
+// next read submits both in the same system call as every other completion in the batch.
+// any thread may queue operations; each io thread normally uses its own Uring, so the lock is uncontended.
+class Uring
+{
+public:
+	explicit Uring(asio::io_service& ioService);
+	~Uring();
+
+	Uring(const Uring&) = delete;
+	Uring& operator=(const Uring&) = delete;
+
+	// false if the kernel has no io_uring, or lacks what the relay needs; `buffers` may be null,
+	// and are used unregistered if they can't be registered
+	bool open(unsigned entries, UringBuffers* buffers);
+
+	// start reaping completions, once the ring won't be thrown away
+	void start();
+
+	// read from a socket into `buffer`, which lies in registered buffer `bufferIndex` unless that is -1
+	void recv(int socket, const asio::mutable_buffer& buffer, int bufferIndex, UringOperation& operation);
+
+	// write `buffer` to a socket, which may write less than all of it
+	void send(int socket, const asio::const_buffer& buffer, int bufferIndex, UringOperation& operation);
+
+	// accept connections on a listening socket until it fails, completing once for each
+	void acceptMultishot(int listener, UringOperation& operation);
+
+	// ask for `operation` to complete with -ECANCELED, if it is pending on this ring
+	void cancel(UringOperation& operation);
+
+	// close the eventfd, which has to go before its io_service does. the ring itself has to outlive
+	// the io_service, which holds the eventfd's wait
+	void stop();
+
+private:
+	// a free submission entry for `operation`, zeroed, or null if the ring stays full; mutex_ must be held
+	io_uring_sqe* prepare(UringOperation* operation);
+
+	// make the prepared entry visible to the kernel; mutex_ must be held
+	void push();
+
+	void refuse(UringOperation& operation);
+
+	// hand what was pushed to the kernel, now or at the end of the batch being reaped on this thread
+	void queued();
+
+	// mutex_ must be held
+	void submit();
+
+	void wait();
+	void reap();
+
+	asio::io_service& ioService_;
+	std::unique_ptr<asio::posix::stream_descriptor> event_;
+	uint64_t eventCount_ = 0;
+	BufferedHandlerAllocator eventHandler_;
+
+	int ring_ = -1;
+	bool registeredBuffers_ = false;
+
+	void* sqRing_ = nullptr;
+	size_t sqRingSize_ = 0;
+	void* cqRing_ = nullptr;
+	size_t cqRingSize_ = 0;
+	io_uring_sqe* sqes_ = nullptr;
+	size_t sqesSize_ = 0;
+
+	unsigned* sqHead_ = nullptr;
+	unsigned* sqTail_ = nullptr;
+	unsigned* sqFlags_ = nullptr;
+	unsigned* sqArray_ = nullptr;
+	unsigned sqMask_ = 0;
+	unsigned sqEntries_ = 0;
+
+	unsigned* cqHead_ = nullptr;
+	unsigned* cqTail_ = nullptr;
+	io_uring_cqe* cqes_ = nullptr;
+	unsigned cqMask_ = 0;
+
+	std::mutex mutex_;
+
+	// prepared but not yet passed to io_uring_enter
+	unsigned unsubmitted_ = 0;
+};
+
+// one Uring per io thread, each reaped on the io_service its thread runs, given by index, sharing one
+// set of registered buffers
+class Urings
+{
+public:
+	Urings(const std::vector<asio::io_service*>& threadServices, size_t bufferCount, size_t bufferSize);
+
+	// false unless every ring could be opened
+	bool open();
+
+	// the ring belonging to the calling io thread
+	Uring& local();
+
+	UringBuffers& buffers()
+	{
+		return buffers_;
+	}
+
+	// cancel `operation` on whichever ring it was submitted to
+	void cancel(UringOperation& operation);
+
+	void stop();
+
+private:
+	UringBuffers buffers_;
+	std::vector<std::unique_ptr<Uring>> rings_;
+};
+
+#endif
@@ -9,10 +9,39 @@
 // set SO_NODELAY and enable keepalive
 void configureSocket(asio::ip::tcp::socket& socket);
 
-bool resetCurrentDirectory();
-
+// queue a line for the log writer thread; never blocks, and drops the line if the queue is full
 void trace(const char* msg);
 
+// write out queued lines and stop the log writer thread
+void stopTrace();
+
+// io threads are numbered as they start, so per-thread structures can be picked without locking.
+// 0 for any thread which is not an io thread.
+unsigned ioThreadIndex();
+void setIoThreadIndex(unsigned index);
+
+// a member which keeps `count` up to date with how many of its owner exist
+class InstanceCounter
+{
+public:
+	explicit InstanceCounter(std::atomic<size_t>& count)
+		: count_(count)
+	{
+		count_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	~InstanceCounter()
+	{
+		count_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	InstanceCounter(const InstanceCounter&) = delete;
+	InstanceCounter& operator=(const InstanceCounter&) = delete;
+
+private:
+	std::atomic<size_t>& count_;
+};
+
 constexpr size_t buffered_handler_storage_size = 256;
 
 // allocates using internal buffer, with fallback to the heap if full
@@ -3,24 +3,35 @@
 
 #include "stdafx.h"
 
-#include <map>
-
 #include "config.h"
 
 #include "util.h"
 #include "vncRepeater.h"
 #include "service.h"
+#include "platform.h"
+#include "splice.h"
+#include "relayRing.h"
+#include "pool.h"
+#include "broker.h"
+#include "serializer.h"
+#include "scheduler.h"
+#include "uring.h"
+#include "zerocopy.h"
+#include "timingWheel.h"
+#include "logger.h"
+#include "latencyStats.h"
+#include "metrics.h"
+#include "trunkProtocol.h"
+
+#ifndef _WIN32
+#include <climits>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
 constexpr char rfbProtocolVersion[] = "RFB 000.000\n";
 
-bool config::traceToConsole = true;
-
-// should be configurable eventually
-uint16_t config::serverPort = 5500;
-uint16_t config::viewerPort = 5901;
-
 // a connection has a socket and an ID that was read from it immediately after connecting.
 // two matched Connection objects form a ConnectionPair which proxies data from one to the other
 class Connection
@@ -36,6 +47,9 @@ public:
 	string extra;
 	string rfbVersion;
 
+	// when the handshake completed, for measuring how long it waits for its match; zero if unknown
+	chrono::steady_clock::time_point established;
+
 	Connection(asio::io_service& ioService)
 		: socket_(ioService)
 	{}
@@ -46,31 +60,51 @@ public:
 	Connection(Connection&& r) = default;
 	Connection& operator=(Connection&& r) = default;
 	
+	bool isViewer() const
+	{
+		return localEndpoint_.port() == config::viewerPort;
+	}
+
 	void onConnected()
 	{
 		configureSocket(socket_);
 		localEndpoint_ = socket_.local_endpoint();
 		remoteEndpoint_ = socket_.remote_endpoint();
 	}
+
+	// take over another Connection, moving its socket onto this one's io_service if they differ,
+	// so both sides of a pair complete on the same io thread
+	void adopt(Connection&& other)
+	{
+		if (&other.socket_.get_io_service() == &socket_.get_io_service() || !platform::moveSocket(other.socket_, socket_)) {
+			socket_ = move(other.socket_);
+		}
+
+		localEndpoint_ = other.localEndpoint_;
+		remoteEndpoint_ = other.remoteEndpoint_;
+		id = move(other.id);
+		extra = move(other.extra);
+		rfbVersion = move(other.rfbVersion);
+		established = other.established;
+	}
 };
 
+// category and msg must be string literals; the event is formatted later by the log writer thread
 void error(const std::error_code& ec, const Connection& connection, const char* category, const char* msg = "")
 {
-	ostringstream stream;
-	stream
-		<< category
-		<< "\t" << connection.remoteEndpoint_
-		<< "\t" << ((connection.localEndpoint_.port() == config::viewerPort) ? "Viewer" : "Server")
-		<< "\t" << "ID:" << connection.id << " (" << connection.extra << ")"
-		<< "\t" << msg;
-
-	if (ec) {
-		stream << "\t" << ec << " (" << ec.message() << ")";
+	if (config::logLevel < (ec ? config::LogLevel::error : config::LogLevel::info)) {
+		return;
 	}
 
-	string text = stream.str();
+	LogEvent event;
+	event.category = category;
+	event.msg = msg;
+	event.setError(ec);
+	event.setEndpoint(connection.remoteEndpoint_);
+	event.viewer = connection.isViewer();
+	event.setIdAndExtra(connection.id, connection.extra);
 
-	trace(text.c_str());
+	Logger::instance().write(event);
 }
 
 void info(const Connection& connection, const char* category, const char* msg = "")
@@ -78,25 +112,132 @@ void info(const Connection& connection, const char* category, const char* msg =
 	error({}, connection, category, msg);
 }
 
-// when first connected, an IncomingConnection reads the extra info and parses it
+// relays still running, and handshakes still in progress. a process which has handed over to a new one
+// waits for handshakes to reach the broker before giving up its waiting connections, then for every
+// session to end before it exits
+atomic<size_t> activeSessions(0);
+atomic<size_t> pendingHandshakes(0);
+
+// what became of the connections accepted for one role, counted per io thread
+struct HandshakeCounters
+{
+	ShardedCounter accepted;
+	ShardedCounter failedAccepts;
+
+	// accepted, and neither completed nor failed yet
+	ShardedCounter inProgress;
+
+	// handshakes which failed at each step the role lists, which had no ID, and which ran out of time
+	array<ShardedCounter, 3> failedSteps;
+	ShardedCounter noId;
+	ShardedCounter timedOut;
+};
+
+HandshakeCounters serverHandshakes;
+HandshakeCounters viewerHandshakes;
+
+// how long from accepting a connection until its handshake completes, and from then until it is matched
+LatencyStats handshakeLatency;
+LatencyStats matchLatency;
+
+// pairs the broker matched, viewers which joined a broadcast, and servers and viewers waiting for their match
+ShardedCounter pairsMatched;
+ShardedCounter broadcastJoins;
+ShardedCounter waitingServers;
+ShardedCounter waitingViewers;
+
+// the steps of a handshake, in the order a HandshakeRole lists them
+enum class HandshakeStep
+{
+	// send rfbProtocolVersion, which is all a viewer is told until it is matched
+	writeBanner,
+	// read the 250 byte block with the ID
+	readInfo,
+	// read the server's RFB version, which is passed on to its viewer
+	readBanner,
+	done,
+};
+
+struct HandshakeRole
+{
+	bool viewer;
+	const char* category;
+
+	struct
+	{
+		HandshakeStep step;
+		// logged if the step fails
+		const char* category;
+	} steps[3];
+
+	HandshakeCounters* counters;
+};
+
+const HandshakeRole serverRole = { false, "acceptNewServer", {
+	{ HandshakeStep::readInfo, "acceptNewServer-readInfo" },
+	{ HandshakeStep::readBanner, "acceptNewServer-readProtocol" },
+	{ HandshakeStep::done, nullptr },
+}, &serverHandshakes };
+
+const HandshakeRole viewerRole = { true, "acceptNewViewer", {
+	{ HandshakeStep::writeBanner, "acceptNewViewer-writeProtocol" },
+	{ HandshakeStep::readInfo, "acceptNewViewer-readInfo" },
+	{ HandshakeStep::done, nullptr },
+}, &viewerHandshakes };
+
+// when first connected, an IncomingConnection runs the handshake for its role, one step at a time,
 // then the Connection can be moved out from within
+// the handshake has to finish within config::rfbInitTimeout, tracked on a TimingWheel.
+// these are created and dropped for every connection, so their memory is recycled per thread.
 class IncomingConnection
 {
 public:
-	asio::steady_timer timeout_;
+	Serializer strand_;
+	WheelTimer timeout_;
 	Connection connection_;
 
+	InstanceCounter handshake_{ pendingHandshakes };
+
+	// set for connections accepted here; null for those which arrived some other way
+	const HandshakeRole* role_ = nullptr;
+	size_t step_ = 0;
+
+	chrono::steady_clock::time_point acceptedAt_;
+
+	// set once the handshake ran out of time, so the step it interrupts isn't counted as failing
+	bool timedOut_ = false;
+
+	// only one operation is pending at a time, from accepting to the last step
+	BufferedHandlerAllocator handler_;
+
 	array<char, 250> infoBuffer_;
 	array<char, 12> rfbBuffer_;
 
-	IncomingConnection(asio::io_service& ioService)
-		: connection_(ioService)
-		, timeout_(ioService)
+	explicit IncomingConnection(asio::io_service& ioService)
+		: strand_(ioService)
+		, connection_(ioService)
 	{
 		infoBuffer_.fill(0);
 		rfbBuffer_.fill(0);
 	}
 
+	static shared_ptr<IncomingConnection> create(asio::io_service& ioService)
+	{
+		return allocate_shared<IncomingConnection>(RecyclingAllocator<IncomingConnection>(), ioService);
+	}
+
+	static void onTimeout(const shared_ptr<void>& owner)
+	{
+		auto pIncomingConnection = static_pointer_cast<IncomingConnection>(owner);
+
+		pIncomingConnection->strand_.post([pIncomingConnection]() {
+			pIncomingConnection->timedOut_ = true;
+
+			std::error_code dontCare;
+			pIncomingConnection->connection_.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+		});
+	}
+
 	void parseRfbVersion()
 	{
 		string rfbVersion;
@@ -113,8 +254,9 @@ public:
 		string id;
 		string extra;
 
+		// the block is padded with NULs, which are no part of the ID or extra
 		const char* pBegin = infoBuffer_.data();
-		const char* pEnd = pBegin + infoBuffer_.size();
+		const char* pEnd = find(pBegin, pBegin + infoBuffer_.size(), '\0');
 
 		const char* pInfo = pBegin;
 		
@@ -155,438 +297,3365 @@ public:
 	}
 };
 
+// what one process hands over to the next, one socket per message
+enum class HandoverKind : uint8_t
+{
+	serverListener = 1,
+	viewerListener = 2,
+
+	// a server or viewer waiting for its match, described as for a trunk
+	waiting = 3,
+};
+
+vector<uint8_t> handoverMessage(HandoverKind kind, const Connection* connection = nullptr)
+{
+	vector<uint8_t> message;
+
+	if (connection) {
+		trunk::OpenInfo openInfo;
+		openInfo.viewer = connection->isViewer();
+		openInfo.remote = connection->remoteEndpoint_;
+		openInfo.id = connection->id;
+		openInfo.rfbVersion = connection->rfbVersion;
+		openInfo.extra = connection->extra;
+
+		message = trunk::encodeOpen(openInfo);
+	}
+
+	message.insert(message.begin(), (uint8_t)kind);
+	return message;
+}
+
+// the memory a relay direction only needs once both sides are connected.
+// these are pooled, so a pair which is still waiting for its other side holds none of it.
+// every pool hands out one size of buffer
+struct RelayStorage
+{
+	explicit RelayStorage(size_t bufferSize)
+		: buffer(new uint8_t[bufferSize])
+		, bufferSize(bufferSize)
+	{}
+
+	// reads and writes are in flight at the same time, so each needs its own handler storage
+	BufferedHandlerAllocator readHandler;
+	BufferedHandlerAllocator writeHandler;
+
+	unique_ptr<uint8_t[]> buffer;
+	const size_t bufferSize;
+};
+
+// trunk streams' storage; pairs keep their own, see ConnectionPair::PairStorage
+ObjectPool<RelayStorage> relayStoragePool(config::relayStoragePoolSize);
+
+#ifdef VNCREPEATER_HAS_URING
+// the rings relays and acceptors use with config::uringRelay; null when the kernel has none to offer
+Urings* relayUrings = nullptr;
+#endif
+
+// memory held by relay rings grown past their RelayStorage::buffer, limited by config::autotuneBudget
+atomic<size_t> grownRelayBytes(0);
+
+// how long relayed data waits in the repeater, from being read to being fully written
+LatencyStats inputLatency;
+LatencyStats displayLatency;
+
+// what one direction of relaying has done, counted per io thread
+struct DirectionCounters
+{
+	ShardedCounter bytes;
+	ShardedCounter reads;
+	ShardedCounter writes;
+};
+
+DirectionCounters inputCounters;
+DirectionCounters displayCounters;
+
+// how long a handler which is ready waits for an io thread to run it
+LatencyStats schedulingLatency;
+
+class ConnectionBroker;
+class ConnectionPair;
+class BroadcastGroup;
+
+using RepeaterShard = BrokerShard<weak_ptr<ConnectionPair>, weak_ptr<BroadcastGroup>>;
+
+bool isBroadcastId(const string& id)
+{
+	return !config::broadcastPrefix.empty() && 0 == id.compare(0, config::broadcastPrefix.size(), config::broadcastPrefix);
+}
+
 // most activity occurs within the ConnectionPair, which proxies data between the two Connections
-// a single buffer is used for the data, and a BufferedHandlerAllocator eliminates any allocations
-// to hold callbacks. 
+// each direction has a ring buffer so the next read can fill free space while the previous data
+// is still being written, and BufferedHandlerAllocators eliminate any allocations to hold callbacks.
+// reading pauses once config::relayHighWater bytes are waiting to be written.
+// with config::spliceRelay each direction instead moves data through a kernel pipe, falling
+// back to the ring when splice is unavailable.
+// with config::speculativeIo reads and writes are tried on the non-blocking sockets first, and
+// only wait for the io_service when the socket isn't ready.
+// with config::uringRelay reads and writes go through the io thread's io_uring instead, and the
+// server -> viewer ring lives in one of the registered buffers while there are any.
+// with config::zerocopyThreshold large server -> viewer sends are made with MSG_ZEROCOPY, and the
+// ring holds on to their space until the kernel is done with it.
+// the viewer -> server direction carries input, so it only buffers config::inputBufferSize and
+// never queues much behind a slow server; the server -> viewer direction carries framebuffer
+// updates, and limits unsent data in the viewer's socket to config::notSentLowWater so stale
+// frames don't pile up in the kernel.
+// until the second side attaches only the first socket is watched, and no relay memory is held.
+// a pair which closes or outlives config::waitingTtl while waiting is removed from the broker.
 class ConnectionPair
 	: public std::enable_shared_from_this<ConnectionPair>
 {
 public:
-	asio::strand strand_;
+	Serializer strand_;
 
 	Connection first_;
 	Connection second_;
 
 	string rfbServerVersion_;
 
+	// where this pair waits in the ConnectionBroker until it is matched; set by the broker
+	struct WaitingEntry
+	{
+		ConnectionBroker* broker = nullptr;
+		RepeaterShard* shard = nullptr;
+		WaitingTable<weak_ptr<ConnectionPair>>* table = nullptr;
+		size_t hash = 0;
+
+		WheelTimer expiry;
+	};
+
+	WaitingEntry waiting_;
+
+	InstanceCounter session_{ activeSessions };
+
 	ConnectionPair(asio::io_service& ioService, Connection&& first)
 		: strand_(ioService)
 		, first_(move(first))
 		, second_(ioService)
+		, relayFirst_(first_, second_, "readFirst", "readFirst-write")
+		, relaySecond_(second_, first_, "readSecond", "readSecond-write")
 	{}
 
 	void run()
 	{
 		strand_.post([self = shared_from_this()]() {
-			self->readFirst();
+			self->waitFirst();
+		});
+	}
+
+	// shut down a pair the broker has given up on
+	void postExpire()
+	{
+		strand_.post([self = shared_from_this()]() {
+			info(self->first_, "waitFirst", "expired");
+			self->shutdown(self->first_, self->second_);
 		});
 	}
 
+	static void onWaitingExpired(const shared_ptr<void>& owner);
+
 	void postAttach(shared_ptr<IncomingConnection> pIncomingConnection)
 	{
 		strand_.post([self = shared_from_this(), pIncomingConnection]() {
-			self->second_ = move(pIncomingConnection->connection_);
+			self->second_.adopt(move(pIncomingConnection->connection_));
+
+			self->waiting_.expiry.cancel();
+
+			self->attachRelay(self->relayFirst_);
+			self->attachRelay(self->relaySecond_);
+			self->attached_ = true;
 
 			self->flushRfbVersion();
 
-			self->readSecond();
+			self->startRelay(self->relaySecond_);
 		});
 	}
 
-protected:
-
-	array<uint8_t, config::bufferSize> bufferFirst_;
-	array<uint8_t, config::bufferSize> bufferSecond_;
-
-	BufferedHandlerAllocator handlerFirst_;
-	BufferedHandlerAllocator handlerSecond_;
-
-	void shutdown(Connection& closing, Connection& lingering)
+#ifdef VNCREPEATER_HAS_HANDOVER
+	// pass the waiting side to another process over `channel`, and finish with it here either way.
+	// the broker must already have let go of the pair
+	void handOver(int channel)
 	{
-		std::error_code dontCare;
+		if (attached_) {
+			return;
+		}
 
-		if (closing.socket_.is_open()) {
-			closing.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+		handedOver_ = true;
+		waiting_.expiry.cancel();
+
+		if (platform::sendSocket(channel, first_.socket_.native_handle(), handoverMessage(HandoverKind::waiting, &first_))) {
+			info(first_, "handOver", "handed over");
 		}
-		if (lingering.socket_.is_open()) {
-			lingering.socket_.shutdown(asio::socket_base::shutdown_receive, dontCare);
+		else {
+			error(asio::error::broken_pipe, first_, "handOver");
 		}
-	}
 
-	void shutdownFirst()
-	{
-		shutdown(first_, second_);
+		std::error_code dontCare;
+		first_.socket_.close(dontCare);
 	}
+#endif
 
-	void shutdownSecond()
-	{
-		shutdown(second_, first_);
-	}
+protected:
 
-	void readFirst()
+	struct Relay;
+
+#ifdef VNCREPEATER_HAS_URING
+	// a relay read or write submitted to a Uring; its completion carries on on the pair's strand
+	struct UringStep
+		: UringOperation
 	{
-		auto self = shared_from_this();
+		ConnectionPair* pair = nullptr;
+		Relay* relay = nullptr;
+		void (ConnectionPair::*handler)(Relay& relay, int result) = nullptr;
+		BufferedHandlerAllocator* allocator = nullptr;
+
+		// what a read asked for; what a write set out to send, what it has sent so far, and what was
+		// written before it started
+		size_t requested = 0;
+		size_t sent = 0;
+		size_t alreadyWritten = 0;
+
+		void completed(int result, bool) override
+		{
+			pair->strand_.dispatch(MakeBufferedHandler(*allocator, [this, result]() {
+				Completion completion(*pair);
 
-		self->first_.socket_.async_read_some(asio::buffer(self->bufferFirst_), self->strand_.wrap(MakeBufferedHandler(self->handlerFirst_, [self](const std::error_code& ec, size_t bytesTransferred) {
-			if (ec) {
-				error(ec, self->first_, "readFirst");
-				self->shutdownFirst();
-				return;
+				(pair->*handler)(*relay, result);
+			}));
+		}
+	};
+#endif
+
+	// a relay direction's RelayStorage, pooled along with what its relay mode needs besides, so a
+	// pair holds none of it until it relays. input comes from a pool of its own, with buffers of
+	// config::inputBufferSize
+	struct PairStorage
+		: RelayStorage
+	{
+		explicit PairStorage(size_t bufferSize)
+			: RelayStorage(bufferSize)
+		{}
+
+#ifdef VNCREPEATER_HAS_SPLICE
+		SplicePipe pipe;
+#endif
+
+#ifdef VNCREPEATER_HAS_URING
+		UringStep uringRead;
+		UringStep uringWrite;
+#endif
+
+#ifdef VNCREPEATER_HAS_ZEROCOPY
+		// waiting for the kernel to finish with zero copy sends is in flight alongside reads and writes
+		BufferedHandlerAllocator zerocopyHandler;
+		ZerocopySends zerocopySends;
+#endif
+	};
+
+	static ObjectPool<PairStorage> displayStoragePool_;
+	static ObjectPool<PairStorage> inputStoragePool_;
+
+	// one direction of the relay, reading from `from` and writing to `to`
+	struct Relay
+	{
+		Relay(Connection& from, Connection& to, const char* readCategory, const char* writeCategory)
+			: from(from)
+			, to(to)
+			, readCategory(readCategory)
+			, writeCategory(writeCategory)
+		{}
+
+		~Relay()
+		{
+			// the storage goes back to its pool without the descriptors this relay opened
+			if (storage) {
+#ifdef VNCREPEATER_HAS_SPLICE
+				storage->pipe.close();
+#endif
+#ifdef VNCREPEATER_HAS_ZEROCOPY
+				storage->zerocopySends.close();
+#endif
 			}
 
-			if (!bytesTransferred) {
-				error(asio::error::eof, self->first_, "readFirst", "0 byte op");
-				self->shutdownFirst();
-				return;
+			if (grown) {
+				grownRelayBytes.fetch_sub(ring.capacity(), memory_order_relaxed);
 			}
 
-			if (!self->second_.socket_.is_open()) {
-				error(asio::error::not_connected, self->first_, "readFirst", "other side not open");
-				self->shutdownFirst();
-				return;
+#ifdef VNCREPEATER_HAS_URING
+			if (uringBuffer >= 0) {
+				relayUrings->buffers().release(uringBuffer);
 			}
+#endif
+		}
 
-			async_write(self->second_.socket_, asio::buffer(self->bufferFirst_, bytesTransferred), self->strand_.wrap(MakeBufferedHandler(self->handlerFirst_, [self](const std::error_code& ec, size_t bytesTransferred) {
-				if (ec) {
-					error(ec, self->second_, "readFirst-write");
-					self->shutdownSecond();
-					return;
-				}
+		Connection& from;
+		Connection& to;
 
-				if (!bytesTransferred) {
-					error(asio::error::eof, self->second_, "readFirst-write", "0 byte op");
-					self->shutdownSecond();
-					return;
-				}
+		const char* readCategory;
+		const char* writeCategory;
 
-				self->readFirst();
-			})));
-		})));
-	}
+		// set when attached; true for the viewer -> server direction
+		bool input = false;
+		LatencyStats* latency = nullptr;
+		DirectionCounters* counters = nullptr;
 
-	void readSecond()
-	{
-		auto self = shared_from_this();
+		// when the oldest data not yet being written arrived, and the oldest data being written; zero if none
+		chrono::steady_clock::time_point pendingSince;
+		chrono::steady_clock::time_point writingSince;
 
-		self->second_.socket_.async_read_some(asio::buffer(self->bufferSecond_), self->strand_.wrap(MakeBufferedHandler(self->handlerSecond_, [self](const std::error_code& ec, size_t bytesTransferred) {
-			if (ec) {
-				error(ec, self->second_, "readSecond");
-				self->shutdownSecond();
-				return;
-			}
+		ObjectPool<PairStorage>::Pointer storage;
+		RelayRing ring;
 
-			if (!bytesTransferred) {
-				error(asio::error::eof, self->second_, "readSecond", "0 byte op");
-				self->shutdownSecond();
-				return;
-			}
+		// see tune(); bytes written since the path was last sampled, when that was, and the shortest round trip seen
+		size_t sampledBytes = 0;
+		chrono::steady_clock::time_point sampledAt;
+		uint32_t minRttUs = UINT32_MAX;
 
-			async_write(self->first_.socket_, asio::buffer(self->bufferSecond_, bytesTransferred), self->strand_.wrap(MakeBufferedHandler(self->handlerSecond_, [self](const std::error_code& ec, size_t bytesTransferred) {
-				if (ec) {
-					error(ec, self->first_, "readSecond-write");
-					self->shutdownFirst();
-					return;
-				}
+		// ring capacity the path calls for, and the memory the ring moved to once it outgrew storage->buffer
+		size_t wantedCapacity = 0;
+		unique_ptr<uint8_t[]> grown;
 
-				if (!bytesTransferred) {
-					error(asio::error::eof, self->first_, "readSecond-write", "0 byte op");
-					self->shutdownFirst();
-					return;
-				}
+		bool reading = false;
+		bool writing = false;
 
-				self->readSecond();
-			})));
-		})));
-	}
+		// bytes read back to back, each read filling all the space offered; see config::relayQuantum
+		size_t burst = 0;
 
-	// the rfbVersion has to be held and echoed to the other connection once the match is made
-	void flushRfbVersion()
-	{
-		auto& rfbConnection = first_.rfbVersion.empty() ? second_ : first_;
-		auto& otherConnection = first_.rfbVersion.empty() ? first_ : second_;
-		
-		async_write(otherConnection.socket_, asio::buffer(rfbConnection.rfbVersion), strand_.wrap([self = shared_from_this(), &rfbConnection, &otherConnection](const std::error_code& ec, size_t bytesTransferred) {
-			if (ec) {
-				error(ec, otherConnection, "flushRfbVersion");
-				self->shutdown(otherConnection, rfbConnection);
-				return;
-			}
+		// a read tried at once is completing; see read()
+		bool speculating = false;
 
-			if (!bytesTransferred) {
-				error(asio::error::eof, otherConnection, "flushRfbVersion", "0 byte op");
-				self->shutdown(otherConnection, rfbConnection);
-				return;
-			}
+		// reads and writes go through relayUrings
+		bool onUring = false;
 
-			// read should already be in progress
-		}));
-	}
-};
+		// set once `from` has failed; `from` is shut down after the ring drains
+		bool readClosed = false;
 
-// Connection objects are matched by ID; multiple can wait on a single ID as well.
-// upon a match, a ConnectionPair is created and run.
-// a multimap is used to handle multiple waiters; while this generally ends up having
-// stable ordering for multiple values on one key, that is not necessarily guaranteed.
-class ConnectionBroker
-{
-public:
-	asio::strand strand_;
+#ifdef VNCREPEATER_HAS_URING
+		// the registered buffer the ring was attached to, or -1
+		int uringBuffer = -1;
+#endif
 
-	ConnectionBroker(asio::io_service& ioService)
-		: strand_(ioService)
-	{}
+#ifdef VNCREPEATER_HAS_ZEROCOPY
+		// big enough sends use MSG_ZEROCOPY; cleared once the kernel turns out to copy them anyway
+		bool zerocopy = false;
 
-	void postPendingViewer(shared_ptr<IncomingConnection> pIncomingConnection) {
-		strand_.post([this, pIncomingConnection]() {
-			handleNewConnection(pIncomingConnection, waitingServers_, waitingViewers_);
-		});
-	}
+		// the send in flight uses MSG_ZEROCOPY
+		bool sendingZerocopy = false;
 
-	void postPendingServer(shared_ptr<IncomingConnection> pIncomingConnection) {
-		strand_.post([this, pIncomingConnection]() {
-			handleNewConnection(pIncomingConnection, waitingViewers_, waitingServers_);
-		});
-	}
+		// waiting for the kernel to report on storage->zerocopySends
+		bool awaitingZerocopy = false;
+#endif
+	};
 
-protected:
+	Relay relayFirst_;
+	Relay relaySecond_;
+
+	// only used to watch the first side while waiting for the second
+	BufferedHandlerAllocator waitHandler_;
+
+	bool attached_ = false;
 
-	void handleNewConnection(shared_ptr<IncomingConnection> pIncomingConnection, multimap<string, weak_ptr<ConnectionPair>>& fromWaiting, multimap<string, weak_ptr<ConnectionPair>>& toWaiting)
+	// the first side went to another process, so this pair has nothing left to do
+	bool handedOver_ = false;
+
+	// relay handlers capture the pair by pointer, so relaying costs no reference counting. instead
+	// the pair holds a reference to itself while any relay operation is pending, and lets go once
+	// the last one completes, when both directions have shut down. only used on strand_
+	shared_ptr<ConnectionPair> self_;
+	size_t pending_ = 0;
+
+	// a relay operation is about to start
+	void started()
 	{
-		auto matches = fromWaiting.equal_range(pIncomingConnection->connection_.id);
+		if (pending_++ == 0) {
+			self_ = shared_from_this();
+		}
+	}
 
-		for (auto it = matches.first; it != matches.second;) {
-			auto pConnection = it->second.lock();
+	// held by a relay handler while it runs; the operation it completes stops being pending at the end
+	struct Completion
+	{
+		explicit Completion(ConnectionPair& pair)
+			: pair(pair)
+		{}
 
-			if (!pConnection) {
-				fromWaiting.erase(it++);
-				continue;
+		~Completion()
+		{
+			if (--pair.pending_ == 0) {
+				// the reference is dropped from a later handler on the pair's own strand, which is done with
+				// the pair before that handler goes; the pair can't be freed while its strand still runs this one
+				pair.strand_.post([self = move(pair.self_)]() {});
 			}
+		}
 
-			fromWaiting.erase(it);
+		ConnectionPair& pair;
+	};
 
-			info(pIncomingConnection->connection_, "handleNewConnection", "matched");
+	void attachRelay(Relay& relay)
+	{
+		relay.input = relay.from.isViewer();
+		relay.latency = relay.input ? &inputLatency : &displayLatency;
+		relay.counters = relay.input ? &inputCounters : &displayCounters;
 
-			pConnection->postAttach(pIncomingConnection);
-			return;
+		relay.storage = relay.input ? inputStoragePool_.acquire(config::inputBufferSize) : displayStoragePool_.acquire(config::bufferSize);
+		relay.ring.attach(relay.storage->buffer.get(), relay.storage->bufferSize);
+		relay.sampledAt = chrono::steady_clock::now();
+
+		if (!relay.input && config::notSentLowWater) {
+			platform::setNotSentLowWater(relay.to.socket_, config::notSentLowWater);
 		}
 
-		// otherwise, add a new waiting ConnectionPair
-		{
-			auto id = pIncomingConnection->connection_.id;
+		// each relay sets the side it reads from, which covers both
+		if (config::speculativeIo) {
+			std::error_code dontCare;
+			relay.from.socket_.non_blocking(true, dontCare);
+		}
 
-			auto pConnection = make_shared<ConnectionPair>(strand_.get_io_service(), move(pIncomingConnection->connection_));
-			toWaiting.emplace(id, pConnection);
-			
-			info(pConnection->first_, "handleNewConnection", "waiting");
+#ifdef VNCREPEATER_HAS_URING
+		if (relayUrings) {
+			attachUring(relay);
+		}
+#endif
 
-			pConnection->run();
+#ifdef VNCREPEATER_HAS_ZEROCOPY
+		// splice and io_uring relays don't send from the ring
+		if (config::zerocopyThreshold && !relay.input && !relay.onUring && !config::spliceRelay) {
+			relay.zerocopy = relay.storage->zerocopySends.open(relay.to.socket_);
 		}
+#endif
 	}
 
-	multimap<string, weak_ptr<ConnectionPair>> waitingServers_;
-	multimap<string, weak_ptr<ConnectionPair>> waitingViewers_;
-};
+#ifdef VNCREPEATER_HAS_URING
+	// input is too little to gain from a registered buffer, so only server -> viewer relays take one
+	void attachUring(Relay& relay)
+	{
+		relay.onUring = true;
 
-// handle incoming server and viewer connections, and pass them off to the ConnectionBroker once initialized
-class Server
-{
-public:
-	asio::io_service ioService_;
+		if (!relay.input) {
+			auto& buffers = relayUrings->buffers();
+			relay.uringBuffer = buffers.acquire();
+			if (relay.uringBuffer >= 0) {
+				relay.ring.attach(buffers.data(relay.uringBuffer), buffers.size());
+			}
+		}
 
-	asio::strand serverStrand_;
-	asio::strand viewerStrand_;
+		auto& storage = *relay.storage;
 
-	asio::ip::tcp::acceptor serverAcceptor_;
-	asio::ip::tcp::acceptor viewerAcceptor_;
+		storage.uringRead.pair = this;
+		storage.uringRead.relay = &relay;
+		storage.uringRead.handler = &ConnectionPair::uringReadCompleted;
+		storage.uringRead.allocator = &storage.readHandler;
 
-	ConnectionBroker broker_;
+		storage.uringWrite.pair = this;
+		storage.uringWrite.relay = &relay;
+		storage.uringWrite.handler = &ConnectionPair::uringWriteCompleted;
+		storage.uringWrite.allocator = &storage.writeHandler;
+	}
+#endif
 
-	Server()
-		: Server(config::serverPort, config::viewerPort)
-	{}
+	void arrived(Relay& relay)
+	{
+		if (relay.pendingSince == chrono::steady_clock::time_point()) {
+			relay.pendingSince = chrono::steady_clock::now();
+		}
+	}
 
-	Server(uint16_t serverPort, uint16_t viewerPort)
-		: ioService_()
-		, serverStrand_(ioService_)
-		, viewerStrand_(ioService_)
-		, serverAcceptor_(ioService_, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), serverPort))
-		, viewerAcceptor_(ioService_, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), viewerPort))
-		, broker_(ioService_)
-	{}
+	void writeStarted(Relay& relay)
+	{
+		relay.writingSince = relay.pendingSince;
+		relay.pendingSince = chrono::steady_clock::time_point();
+	}
+
+	void written(Relay& relay)
+	{
+		relay.latency->record(chrono::steady_clock::now() - relay.writingSince);
+	}
 
-	void acceptNewServer()
+	// the first side is not expected to send anything before the second side attaches,
+	// so wait for it to become readable without a buffer; normally that is the first
+	// data after the match, but before then it means the first side closed.
+	void waitFirst()
 	{
-		auto pIncomingConnection = std::make_shared<IncomingConnection>(ioService_);
-		serverAcceptor_.async_accept(pIncomingConnection->connection_.socket_, serverStrand_.wrap([this, pIncomingConnection](const std::error_code& ec) {
-			if (!ioService_.stopped()) {
-				acceptNewServer();
+		first_.socket_.async_read_some(asio::null_buffers(), strand_.wrap(MakeBufferedHandler(waitHandler_, [self = shared_from_this()](const std::error_code& ec, size_t) {
+			if (self->handedOver_) {
+				return;
 			}
 
-			if (ec) {
-				error(ec, pIncomingConnection->connection_, "acceptNewServer");
+			if (self->attached_ && !ec) {
+				self->startRelay(self->relayFirst_);
 				return;
 			}
 
-			pIncomingConnection->connection_.onConnected();
+			if (ec) {
+				error(ec, self->first_, "readFirst");
+			}
+			else {
+				// readiness alone doesn't mean the first side closed; only a read of 0 bytes does
+				std::error_code peekEc;
+				uint8_t peeked;
+				auto wasNonBlocking = self->first_.socket_.non_blocking();
+				self->first_.socket_.non_blocking(true, peekEc);
+				self->first_.socket_.receive(asio::buffer(&peeked, sizeof(peeked)), asio::socket_base::message_peek, peekEc);
 
-			info(pIncomingConnection->connection_, "acceptNewServer", "accepted");
+				std::error_code dontCare;
+				self->first_.socket_.non_blocking(wasNonBlocking, dontCare);
 
-			// setup init timeout
-			pIncomingConnection->timeout_.expires_from_now(std::chrono::seconds(config::rfbInitTimeout));
-			pIncomingConnection->timeout_.async_wait(serverStrand_.wrap([this, pIncomingConnection](const std::error_code& ec) {
-				if (ec) {
-					if (ec != asio::error::operation_aborted) {
-						error(ec, pIncomingConnection->connection_, "acceptNewServer-timeout");
-					}
-					// probably cancelled
+				if (peekEc == asio::error::would_block || peekEc == asio::error::interrupted) {
+					self->waitFirst();
 					return;
 				}
 
-				std::error_code dontCare;
-				pIncomingConnection->connection_.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
-			}));
-
-			// read connection info
-			async_read(pIncomingConnection->connection_.socket_, asio::buffer(pIncomingConnection->infoBuffer_), serverStrand_.wrap([this, pIncomingConnection](const std::error_code& ec, size_t bytesTransferred) {
-
-				if (ec) {
-					error(ec, pIncomingConnection->connection_, "acceptNewServer-readInfo");
-					return;
+				// asio reports the read of 0 bytes as eof
+				if (peekEc == asio::error::eof) {
+					error(asio::error::eof, self->first_, "readFirst", "0 byte op");
 				}
+				else if (peekEc) {
+					error(peekEc, self->first_, "readFirst");
+				}
+				else {
+					error(asio::error::not_connected, self->first_, "readFirst", "other side not open");
+				}
+			}
+			self->shutdown(self->first_, self->second_);
 
-				pIncomingConnection->parseInfo();
+			if (!self->attached_) {
+				self->leaveBroker();
+			}
+		})));
+	}
 
-				if (pIncomingConnection->connection_.id.empty()) {
-					error(asio::error::invalid_argument, pIncomingConnection->connection_, "acceptNewServer-readInfo", "no ID");
+	// stop waiting for a second side which will never be attached now
+	void leaveBroker();
 
-					std::error_code dontCare;
-					pIncomingConnection->timeout_.cancel(dontCare);
-					return;
+	void shutdown(Connection& closing, Connection& lingering)
+	{
+		std::error_code dontCare;
+
+		if (closing.socket_.is_open()) {
+			closing.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+		}
+		if (lingering.socket_.is_open()) {
+			lingering.socket_.shutdown(asio::socket_base::shutdown_receive, dontCare);
+		}
+	}
+
+	void startRelay(Relay& relay)
+	{
+#ifdef VNCREPEATER_HAS_SPLICE
+		// input stays on the small ring, which a pipe's 64 KiB would defeat
+		if (config::spliceRelay && !relay.input && !relay.onUring && relay.storage->pipe.open()) {
+			spliceRead(relay);
+			return;
+		}
+#endif
+		read(relay);
+	}
+
+	// read into the free space of the ring, unless a read is already pending or the ring is above the high water mark.
+	// with config::speculativeIo, a read following one which filled the ring's free space is first tried at once,
+	// and completes here; only a socket with nothing to read waits for the io_service
+	void read(Relay& relay)
+	{
+		// a read completing here writes, and the write completing reads again; this loop does that read instead
+		if (relay.speculating) {
+			return;
+		}
+
+		for (;;) {
+			if (relay.reading || relay.readClosed) {
+				return;
+			}
+
+			size_t highWater = relay.grown ? relay.ring.capacity() : std::min(config::relayHighWater, relay.ring.capacity());
+			if (relay.ring.size() >= highWater) {
+				return;
+			}
+
+			// the rest of the ring is still being sent by the kernel; reading resumes as it lets go of it
+			if (relay.ring.full()) {
+				return;
+			}
+
+			// a read which completes at once runs its handler next, so a busy sender could keep this thread to itself;
+			// once it has had its quantum, the read waits behind whatever else is ready
+			if (relay.burst >= config::relayQuantum) {
+				relay.burst = 0;
+				relay.reading = true;
+				started();
+				strand_.post(MakeBufferedHandler(relay.storage->readHandler, [this, &relay]() {
+					Completion completion(*this);
+
+					relay.reading = false;
+					read(relay);
+				}));
+				return;
+			}
+
+			auto buffer = relay.ring.writable(highWater - relay.ring.size());
+			size_t requested = asio::buffer_size(buffer);
+
+			// after a short read the socket is most likely empty, and the io_service tries the read once anyway
+			if (config::speculativeIo && relay.burst && !relay.onUring) {
+				std::error_code ec;
+				size_t bytesTransferred = relay.from.socket_.read_some(buffer, ec);
+
+				if (ec != asio::error::would_block) {
+					relay.speculating = true;
+					bool more = readCompleted(relay, ec, bytesTransferred, requested);
+					relay.speculating = false;
+
+					if (more) {
+						continue;
+					}
+					return;
+				}
+			}
+
+			relay.reading = true;
+			started();
+
+#ifdef VNCREPEATER_HAS_URING
+			if (relay.onUring) {
+				relay.storage->uringRead.requested = asio::buffer_size(buffer[0]);
+				relayUrings->local().recv(relay.from.socket_.native_handle(), buffer[0], uringBufferIndex(relay), relay.storage->uringRead);
+				return;
+			}
+#endif
+
+			relay.from.socket_.async_read_some(buffer, strand_.wrap(MakeBufferedHandler(relay.storage->readHandler, [this, &relay, requested](const std::error_code& ec, size_t bytesTransferred) {
+				Completion completion(*this);
+
+				relay.reading = false;
+
+				if (readCompleted(relay, ec, bytesTransferred, requested)) {
+					read(relay);
+				}
+			})));
+			return;
+		}
+	}
+
+	// buffer and start writing what a read returned; false if the relay stops reading
+	bool readCompleted(Relay& relay, const std::error_code& ec, size_t bytesTransferred, size_t requested)
+	{
+		if (ec) {
+			error(ec, relay.from, relay.readCategory);
+			readFailed(relay);
+			return false;
+		}
+
+		if (!bytesTransferred) {
+			error(asio::error::eof, relay.from, relay.readCategory, "0 byte op");
+			readFailed(relay);
+			return false;
+		}
+
+		if (!relay.to.socket_.is_open()) {
+			error(asio::error::not_connected, relay.from, relay.readCategory, "other side not open");
+			shutdown(relay.from, relay.to);
+			return false;
+		}
+
+		relay.ring.commit(bytesTransferred);
+		arrived(relay);
+
+		relay.counters->reads.add();
+		relay.counters->bytes.add(bytesTransferred);
+
+		// a short read emptied the socket, so the sender isn't outpacing the relay
+		relay.burst = bytesTransferred < requested ? 0 : relay.burst + bytesTransferred;
+
+		write(relay);
+		return true;
+	}
+
+	// write everything buffered in the ring, unless a write is already pending.
+	// with config::speculativeIo the write is first tried at once; whatever the socket doesn't take waits for the io_service
+	void write(Relay& relay)
+	{
+		if (relay.writing || relay.ring.empty()) {
+			return;
+		}
+
+		writeStarted(relay);
+
+		size_t alreadyWritten = 0;
+
+		if (config::speculativeIo && !relay.onUring && !zerocopyWanted(relay)) {
+			std::error_code ec;
+			size_t bytesTransferred = relay.to.socket_.write_some(relay.ring.readable(), ec);
+
+			if (ec != asio::error::would_block) {
+				if (ec || bytesTransferred == relay.ring.size()) {
+					writeCompleted(relay, ec, bytesTransferred, 0);
+					return;
+				}
+
+				consumeWritten(relay, bytesTransferred);
+				alreadyWritten = bytesTransferred;
+			}
+		}
+
+		relay.writing = true;
+		started();
+
+#ifdef VNCREPEATER_HAS_URING
+		if (relay.onUring) {
+			relay.storage->uringWrite.requested = relay.ring.size();
+			relay.storage->uringWrite.sent = 0;
+			relay.storage->uringWrite.alreadyWritten = alreadyWritten;
+			uringSend(relay);
+			return;
+		}
+#endif
+
+#ifdef VNCREPEATER_HAS_ZEROCOPY
+		if (relay.zerocopy) {
+			zerocopySend(relay, alreadyWritten, relay.ring.size());
+			return;
+		}
+#endif
+
+		async_write(relay.to.socket_, relay.ring.readable(), strand_.wrap(MakeBufferedHandler(relay.storage->writeHandler, [this, &relay, alreadyWritten](const std::error_code& ec, size_t bytesTransferred) {
+			Completion completion(*this);
+
+			relay.writing = false;
+
+			writeCompleted(relay, ec, bytesTransferred, alreadyWritten);
+		})));
+	}
+
+	// release what was written from the ring and carry on; alreadyWritten was written and released before the write waited
+	void writeCompleted(Relay& relay, const std::error_code& ec, size_t bytesTransferred, size_t alreadyWritten)
+	{
+		if (ec) {
+			error(ec, relay.to, relay.writeCategory);
+			shutdown(relay.to, relay.from);
+			return;
+		}
+
+		if (!bytesTransferred) {
+			error(asio::error::eof, relay.to, relay.writeCategory, "0 byte op");
+			shutdown(relay.to, relay.from);
+			return;
+		}
+
+		consumeWritten(relay, bytesTransferred);
+		written(relay);
+
+		relay.counters->writes.add();
+
+		if (relay.readClosed && relay.ring.empty()) {
+			shutdown(relay.from, relay.to);
+			return;
+		}
+
+		tune(relay, alreadyWritten + bytesTransferred);
+
+		write(relay);
+		read(relay);
+	}
+
+	// every config::autotuneInterval bytes, size the buffers of a server -> viewer relay for twice what it
+	// delivered over one round trip to the viewer. while the buffers are what limits the relay, each sample
+	// doubles them; once the path is, they settle at its bandwidth delay product. the shortest round trip
+	// seen is used, since data queued in bigger buffers would otherwise stretch the round trip and grow
+	// them further. a LAN round trip is so short that those sessions stay within the pooled buffer
+	void tune(Relay& relay, size_t bytesWritten)
+	{
+		if (relay.input || !config::autotuneInterval) {
+			return;
+		}
+
+		relay.sampledBytes += bytesWritten;
+		if (relay.sampledBytes >= config::autotuneInterval) {
+			auto now = chrono::steady_clock::now();
+			auto elapsedUs = (uint64_t)chrono::duration_cast<chrono::microseconds>(now - relay.sampledAt).count();
+
+			uint32_t rttUs = 0;
+			if (elapsedUs && platform::queryRoundTrip(relay.to.socket_, rttUs)) {
+				relay.minRttUs = std::min(relay.minRttUs, rttUs);
+
+				uint64_t delivered = (uint64_t)relay.sampledBytes * relay.minRttUs / elapsedUs;
+
+				// in powers of two, so a ring is moved a few times at most
+				size_t wanted = config::bufferSize;
+				while (wanted < 2 * delivered && wanted < config::maxTunedBuffer) {
+					wanted *= 2;
+				}
+
+				if (wanted > relay.ring.capacity()) {
+					platform::raiseSocketBuffers(relay.to.socket_, wanted, 0);
+					platform::raiseSocketBuffers(relay.from.socket_, 0, wanted);
+
+					relay.wantedCapacity = wanted;
+				}
+			}
+
+			relay.sampledBytes = 0;
+			relay.sampledAt = now;
+		}
+
+		// the ring can only move while no read is filling it and the kernel isn't sending from it; a
+		// full ring stops reading, which is when a bigger one matters
+		if (relay.wantedCapacity > relay.ring.capacity() && !relay.reading && !relay.ring.held()) {
+			growRing(relay);
+		}
+	}
+
+	void growRing(Relay& relay)
+	{
+		size_t capacity = relay.wantedCapacity;
+		relay.wantedCapacity = 0;
+
+		size_t released = relay.grown ? relay.ring.capacity() : 0;
+		if (grownRelayBytes.fetch_add(capacity - released, memory_order_relaxed) + capacity - released > config::autotuneBudget) {
+			grownRelayBytes.fetch_sub(capacity - released, memory_order_relaxed);
+			return;
+		}
+
+		unique_ptr<uint8_t[]> grown(new uint8_t[capacity]);
+		relay.ring.moveTo(grown.get(), capacity);
+		relay.grown = move(grown);
+	}
+
+	// free what was written from the ring, unless the kernel may still be sending it from there
+	void consumeWritten(Relay& relay, size_t bytes)
+	{
+#ifdef VNCREPEATER_HAS_ZEROCOPY
+		if (relay.sendingZerocopy || !relay.storage->zerocopySends.empty()) {
+			if (relay.sendingZerocopy) {
+				relay.storage->zerocopySends.sent(bytes);
+			}
+			else {
+				relay.storage->zerocopySends.copied(bytes);
+			}
+			relay.sendingZerocopy = false;
+
+			relay.ring.retain(bytes);
+			reapZerocopy(relay);
+			return;
+		}
+#endif
+		relay.ring.consume(bytes);
+	}
+
+	bool zerocopyWanted(const Relay& relay) const
+	{
+#ifdef VNCREPEATER_HAS_ZEROCOPY
+		return relay.zerocopy && relay.ring.size() >= config::zerocopyThreshold && !relay.storage->zerocopySends.full();
+#else
+		return false;
+#endif
+	}
+
+	// deliver whatever is still buffered before shutting down
+	void readFailed(Relay& relay)
+	{
+		relay.readClosed = true;
+
+		if (!relay.writing) {
+			shutdown(relay.from, relay.to);
+		}
+	}
+
+#ifdef VNCREPEATER_HAS_SPLICE
+	// wait for the reactor to report data, then splice it from the socket into the pipe
+	void spliceRead(Relay& relay)
+	{
+		std::error_code dontCare;
+		if (!relay.from.socket_.non_blocking()) {
+			relay.from.socket_.non_blocking(true, dontCare);
+		}
+
+		started();
+
+		relay.from.socket_.async_read_some(asio::null_buffers(), strand_.wrap(MakeBufferedHandler(relay.storage->readHandler, [this, &relay](const std::error_code& ec, size_t) {
+			Completion completion(*this);
+
+			if (ec) {
+				error(ec, relay.from, "spliceRead");
+				shutdown(relay.from, relay.to);
+				return;
+			}
+
+			std::error_code spliceEc;
+			size_t bytesTransferred = relay.storage->pipe.fill(relay.from.socket_.native_handle(), spliceEc);
+
+			if (spliceEc == asio::error::would_block) {
+				spliceRead(relay);
+				return;
+			}
+
+			if (spliceEc == asio::error::invalid_argument && !relay.storage->pipe.pending()) {
+				// this socket can't be spliced after all; copy through the ring instead
+				relay.storage->pipe.close();
+				read(relay);
+				return;
+			}
+
+			if (spliceEc) {
+				error(spliceEc, relay.from, "spliceRead");
+				shutdown(relay.from, relay.to);
+				return;
+			}
+
+			if (!bytesTransferred) {
+				error(asio::error::eof, relay.from, "spliceRead", "0 byte op");
+				shutdown(relay.from, relay.to);
+				return;
+			}
+
+			if (!relay.to.socket_.is_open()) {
+				error(asio::error::not_connected, relay.from, "spliceRead", "other side not open");
+				shutdown(relay.from, relay.to);
+				return;
+			}
+
+			arrived(relay);
+			writeStarted(relay);
+
+			relay.counters->reads.add();
+			relay.counters->bytes.add(bytesTransferred);
+
+			spliceWrite(relay);
+		})));
+	}
+
+	// drain the pipe into the other socket, waiting for it to become writable as often as needed
+	void spliceWrite(Relay& relay)
+	{
+		std::error_code ec;
+		if (!relay.to.socket_.non_blocking()) {
+			relay.to.socket_.non_blocking(true, ec);
+		}
+
+		relay.storage->pipe.drain(relay.to.socket_.native_handle(), ec);
+
+		if (ec && ec != asio::error::would_block) {
+			error(ec, relay.to, "spliceWrite");
+			shutdown(relay.to, relay.from);
+			return;
+		}
+
+		if (!relay.storage->pipe.pending()) {
+			written(relay);
+			relay.counters->writes.add();
+			spliceRead(relay);
+			return;
+		}
+
+		started();
+
+		relay.to.socket_.async_write_some(asio::null_buffers(), strand_.wrap(MakeBufferedHandler(relay.storage->writeHandler, [this, &relay](const std::error_code& ec, size_t) {
+			Completion completion(*this);
+
+			if (ec) {
+				error(ec, relay.to, "spliceWrite");
+				shutdown(relay.to, relay.from);
+				return;
+			}
+
+			spliceWrite(relay);
+		})));
+	}
+#endif
+
+#ifdef VNCREPEATER_HAS_ZEROCOPY
+	// send the `remaining` bytes a write set out to send a send at a time, each big enough one with
+	// MSG_ZEROCOPY, so every one can be held in the ring until the kernel is done with it
+	void zerocopySend(Relay& relay, size_t alreadyWritten, size_t remaining)
+	{
+		relay.sendingZerocopy = zerocopyWanted(relay);
+
+		relay.to.socket_.async_send(relay.ring.readable(), relay.sendingZerocopy ? MSG_ZEROCOPY : 0, strand_.wrap(MakeBufferedHandler(relay.storage->writeHandler, [this, &relay, alreadyWritten, remaining](const std::error_code& ec, size_t bytesTransferred) {
+			Completion completion(*this);
+
+			if (!ec && bytesTransferred && bytesTransferred < remaining) {
+				consumeWritten(relay, bytesTransferred);
+
+				started();
+				zerocopySend(relay, alreadyWritten + bytesTransferred, remaining - bytesTransferred);
+				return;
+			}
+
+			// a send which failed wasn't numbered
+			if (ec || !bytesTransferred) {
+				relay.sendingZerocopy = false;
+			}
+
+			relay.writing = false;
+
+			writeCompleted(relay, ec, bytesTransferred, alreadyWritten);
+		})));
+	}
+
+	// release the ring space of sends the kernel has finished with, and wait for it to report on the rest;
+	// true if any space was freed. `woken` is set when the wait completed: if there was nothing to read,
+	// the socket has hung up or failed, and the next wait is paced
+	bool reapZerocopy(Relay& relay, bool woken = false)
+	{
+		bool reported = false;
+		std::error_code ec;
+		size_t released = relay.storage->zerocopySends.reap(reported, ec);
+
+		if (ec) {
+			error(ec, relay.to, relay.writeCategory, "zerocopy");
+			shutdown(relay.to, relay.from);
+			return false;
+		}
+
+		if (relay.storage->zerocopySends.kernelCopies()) {
+			relay.zerocopy = false;
+		}
+
+		relay.ring.release(released);
+
+		if (!relay.awaitingZerocopy && !relay.storage->zerocopySends.empty()) {
+			awaitZerocopy(relay, woken && !reported);
+		}
+		return released != 0;
+	}
+
+	void awaitZerocopy(Relay& relay, bool paced)
+	{
+		relay.awaitingZerocopy = true;
+		started();
+
+		relay.storage->zerocopySends.asyncWait(paced, strand_.wrap(MakeBufferedHandler(relay.storage->zerocopyHandler, [this, &relay](const std::error_code& ec, size_t) {
+			Completion completion(*this);
+
+			relay.awaitingZerocopy = false;
+
+			if (ec) {
+				if (ec != asio::error::operation_aborted) {
+					error(ec, relay.to, relay.writeCategory, "zerocopy");
+				}
+				return;
+			}
+
+			if (reapZerocopy(relay, true)) {
+				read(relay);
+			}
+		})));
+	}
+#endif
+
+#ifdef VNCREPEATER_HAS_URING
+	// the registered buffer a relay's reads and writes are in; none once the ring has grown out of it
+	int uringBufferIndex(const Relay& relay) const
+	{
+		return relay.grown ? -1 : relay.uringBuffer;
+	}
+
+	void uringSend(Relay& relay)
+	{
+		relayUrings->local().send(relay.to.socket_.native_handle(), relay.ring.readable()[0], uringBufferIndex(relay), relay.storage->uringWrite);
+	}
+
+	void uringReadCompleted(Relay& relay, int result)
+	{
+		relay.reading = false;
+
+		// an older kernel gives up on a non-blocking socket with nothing to read rather than waiting
+		// for it, so let the reactor wait
+		if (result == -EAGAIN) {
+			relay.reading = true;
+			started();
+
+			relay.from.socket_.async_read_some(asio::null_buffers(), strand_.wrap(MakeBufferedHandler(relay.storage->readHandler, [this, &relay](const std::error_code& ec, size_t) {
+				Completion completion(*this);
+
+				relay.reading = false;
+
+				if (ec) {
+					error(ec, relay.from, relay.readCategory);
+					readFailed(relay);
+					return;
+				}
+				read(relay);
+			})));
+			return;
+		}
+
+		std::error_code ec;
+		if (result < 0) {
+			ec = std::error_code(-result, asio::error::get_system_category());
+		}
+
+		if (readCompleted(relay, ec, result < 0 ? 0 : result, relay.storage->uringRead.requested)) {
+			read(relay);
+		}
+	}
+
+	// a send may take less than it was given, or only the part before the end of the ring;
+	// the write only completes once everything it set out to send has gone
+	void uringWriteCompleted(Relay& relay, int result)
+	{
+		auto& step = relay.storage->uringWrite;
+
+		if (result == -EAGAIN) {
+			started();
+
+			relay.to.socket_.async_write_some(asio::null_buffers(), strand_.wrap(MakeBufferedHandler(relay.storage->writeHandler, [this, &relay](const std::error_code& ec, size_t) {
+				Completion completion(*this);
+
+				if (ec) {
+					relay.writing = false;
+					writeCompleted(relay, ec, 0, 0);
+					return;
+				}
+
+				started();
+				uringSend(relay);
+			})));
+			return;
+		}
+
+		if (result > 0 && step.sent + result < step.requested) {
+			relay.ring.consume(result);
+			step.sent += result;
+
+			started();
+			uringSend(relay);
+			return;
+		}
+
+		relay.writing = false;
+
+		std::error_code ec;
+		if (result < 0) {
+			ec = std::error_code(-result, asio::error::get_system_category());
+		}
+
+		writeCompleted(relay, ec, result < 0 ? 0 : result, step.alreadyWritten + step.sent);
+	}
+#endif
+
+	// the rfbVersion has to be held and echoed to the other connection once the match is made
+	void flushRfbVersion()
+	{
+		auto& rfbConnection = first_.rfbVersion.empty() ? second_ : first_;
+		auto& otherConnection = first_.rfbVersion.empty() ? first_ : second_;
+		
+		async_write(otherConnection.socket_, asio::buffer(rfbConnection.rfbVersion), strand_.wrap([self = shared_from_this(), &rfbConnection, &otherConnection](const std::error_code& ec, size_t bytesTransferred) {
+			if (ec) {
+				error(ec, otherConnection, "flushRfbVersion");
+				self->shutdown(otherConnection, rfbConnection);
+				return;
+			}
+
+			if (!bytesTransferred) {
+				error(asio::error::eof, otherConnection, "flushRfbVersion", "0 byte op");
+				self->shutdown(otherConnection, rfbConnection);
+				return;
+			}
+
+			// read should already be in progress
+		}));
+	}
+};
+
+ObjectPool<ConnectionPair::PairStorage> ConnectionPair::displayStoragePool_(config::relayStoragePoolSize);
+ObjectPool<ConnectionPair::PairStorage> ConnectionPair::inputStoragePool_(config::relayStoragePoolSize);
+
+// a piece of a broadcast server's stream, shared by every viewer which has yet to send it.
+// chunks are linked in stream order, so a viewer holding one can reach everything after it,
+// and each is freed once the last viewer still behind it moves on.
+struct BroadcastChunk
+{
+	array<uint8_t, config::broadcastChunkSize> data;
+	size_t size = 0;
+
+	shared_ptr<BroadcastChunk> next;
+};
+
+// one server relayed to every viewer which joins its ID, for a session many people watch.
+// the server's stream is read once into shared chunks, and each viewer writes them out from its
+// own position without copying. the first viewer to join controls the session: its input goes
+// to the server, and the broadcast ends when it leaves. other viewers' input is read and dropped.
+// every viewer is sent the stream from its first byte, which the relay can't resynchronize
+// part way through, so viewers can only join until the server has sent config::broadcastHistory
+// bytes; and a viewer more than config::broadcastLag bytes behind the server is disconnected.
+class BroadcastGroup
+	: public std::enable_shared_from_this<BroadcastGroup>
+{
+public:
+	Serializer strand_;
+
+	Connection server_;
+
+	// where this group is registered in the ConnectionBroker; set by the broker
+	struct WaitingEntry
+	{
+		ConnectionBroker* broker = nullptr;
+		RepeaterShard* shard = nullptr;
+		size_t hash = 0;
+
+		// until the controlling viewer joins
+		WheelTimer expiry;
+	};
+
+	WaitingEntry waiting_;
+
+	InstanceCounter session_{ activeSessions };
+
+	BroadcastGroup(asio::io_service& ioService, Connection&& server)
+		: strand_(ioService)
+		, server_(move(server))
+		, tail_(make_shared<BroadcastChunk>())
+		, history_(tail_)
+	{
+		// viewers are sent the server's protocol version as the start of the stream
+		auto& rfbVersion = server_.rfbVersion;
+		memcpy(tail_->data.data(), rfbVersion.data(), rfbVersion.size());
+		tail_->size = rfbVersion.size();
+		streamSize_ = tail_->size;
+	}
+
+	void run()
+	{
+		strand_.post([self = shared_from_this()]() {
+			self->readServer();
+		});
+	}
+
+	void postJoin(shared_ptr<IncomingConnection> pIncomingConnection)
+	{
+		strand_.post([self = shared_from_this(), pIncomingConnection]() {
+			self->join(move(pIncomingConnection->connection_));
+		});
+	}
+
+	// shut down a group whose controlling viewer never came
+	void postExpire()
+	{
+		strand_.post([self = shared_from_this()]() {
+			if (!self->controlled_) {
+				info(self->server_, "broadcast", "expired");
+				self->end();
+			}
+		});
+	}
+
+	static void onWaitingExpired(const shared_ptr<void>& owner);
+
+protected:
+	struct Viewer
+	{
+		explicit Viewer(asio::io_service& ioService)
+			: connection(ioService)
+		{}
+
+		Connection connection;
+
+		bool controlling = false;
+		bool reading = false;
+		bool writing = false;
+		bool closed = false;
+
+		// the next byte of the stream to send is chunk->data[position], at stream offset `offset`
+		shared_ptr<BroadcastChunk> chunk;
+		size_t position = 0;
+		uint64_t offset = 0;
+
+		// input read from the viewer; only the controlling viewer's is passed on to the server
+		array<uint8_t, config::inputBufferSize> input;
+		RelayRing inputRing;
+
+		BufferedHandlerAllocator readHandler;
+		BufferedHandlerAllocator writeHandler;
+	};
+
+	vector<shared_ptr<Viewer>> viewers_;
+
+	// the chunk being read into, and the first chunk of the stream while viewers may still join
+	shared_ptr<BroadcastChunk> tail_;
+	shared_ptr<BroadcastChunk> history_;
+	uint64_t streamSize_ = 0;
+
+	shared_ptr<Viewer> controller_;
+
+	bool controlled_ = false;
+	bool readingServer_ = false;
+	bool serverClosed_ = false;
+	bool ended_ = false;
+	bool writingServer_ = false;
+
+	BufferedHandlerAllocator serverReadHandler_;
+	BufferedHandlerAllocator serverWriteHandler_;
+
+	void join(Connection&& connection)
+	{
+		auto pViewer = make_shared<Viewer>(strand_.get_io_service());
+		pViewer->connection.adopt(move(connection));
+
+		if (ended_ || !history_) {
+			error(asio::error::already_started, pViewer->connection, "broadcast", "too late to join");
+			std::error_code dontCare;
+			pViewer->connection.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+			return;
+		}
+
+		pViewer->controlling = !controlled_;
+		if (pViewer->controlling) {
+			controlled_ = true;
+			controller_ = pViewer;
+			waiting_.expiry.cancel();
+		}
+
+		pViewer->chunk = history_;
+		pViewer->inputRing.attach(pViewer->input.data(), pViewer->input.size());
+
+		if (config::notSentLowWater) {
+			platform::setNotSentLowWater(pViewer->connection.socket_, config::notSentLowWater);
+		}
+
+		info(pViewer->connection, "broadcast", pViewer->controlling ? "controlling" : "watching");
+
+		viewers_.push_back(pViewer);
+
+		writeViewer(pViewer);
+		readViewer(pViewer);
+	}
+
+	// the server is paced by the controlling viewer, as it would be in a pair: reading pauses while
+	// config::relayHighWater bytes are waiting to be sent to it, or to anyone before it joins
+	void readServer()
+	{
+		if (readingServer_ || serverClosed_) {
+			return;
+		}
+
+		uint64_t controllerOffset = controller_ ? controller_->offset : 0;
+		if (streamSize_ - controllerOffset >= config::relayHighWater) {
+			return;
+		}
+
+		if (tail_->size == tail_->data.size()) {
+			tail_->next = make_shared<BroadcastChunk>();
+			tail_ = tail_->next;
+		}
+
+		auto free = asio::buffer(&tail_->data[tail_->size], tail_->data.size() - tail_->size);
+
+		readingServer_ = true;
+
+		server_.socket_.async_read_some(free, strand_.wrap(MakeBufferedHandler(serverReadHandler_, [self = shared_from_this()](const std::error_code& ec, size_t bytesTransferred) {
+			self->readingServer_ = false;
+
+			if (ec || !bytesTransferred) {
+				if (self->serverClosed_) {
+					return;
+				}
+
+				error(ec ? ec : asio::error::eof, self->server_, "broadcast-readServer");
+				self->serverClosed();
+				return;
+			}
+
+			self->tail_->size += bytesTransferred;
+			self->streamSize_ += bytesTransferred;
+
+			displayCounters.reads.add();
+			displayCounters.bytes.add(bytesTransferred);
+
+			// new viewers couldn't be sent the whole stream any more, so stop holding on to its start
+			if (self->history_ && self->streamSize_ > config::broadcastHistory) {
+				self->history_.reset();
+			}
+
+			for (size_t i = 0; i < self->viewers_.size();) {
+				auto pViewer = self->viewers_[i];
+
+				if (!pViewer->controlling && self->streamSize_ - pViewer->offset > config::broadcastLag) {
+					error(asio::error::no_buffer_space, pViewer->connection, "broadcast", "lagging");
+					self->drop(*pViewer);
+					continue;
+				}
+
+				self->writeViewer(pViewer);
+				++i;
+			}
+
+			self->readServer();
+		})));
+	}
+
+	// send the viewer what follows its position, up to two chunks at a time
+	void writeViewer(const shared_ptr<Viewer>& pViewer)
+	{
+		Viewer& viewer = *pViewer;
+		if (viewer.writing || viewer.closed) {
+			return;
+		}
+
+		while (viewer.position == viewer.chunk->size && viewer.chunk->next) {
+			viewer.chunk = viewer.chunk->next;
+			viewer.position = 0;
+		}
+
+		if (viewer.position == viewer.chunk->size) {
+			// caught up; once the server is gone there is nothing more to send
+			if (serverClosed_) {
+				drop(viewer);
+			}
+			return;
+		}
+
+		// asio keeps a two buffer array in its write operation as is, so the handler stays small
+		array<asio::const_buffer, 2> buffers;
+		BroadcastChunk* chunk = viewer.chunk.get();
+		size_t position = viewer.position;
+		for (auto& buffer : buffers) {
+			buffer = chunk ? asio::buffer(&chunk->data[position], chunk->size - position) : asio::const_buffer();
+			chunk = chunk ? chunk->next.get() : nullptr;
+			position = 0;
+		}
+
+		viewer.writing = true;
+
+		async_write(viewer.connection.socket_, buffers, strand_.wrap(MakeBufferedHandler(viewer.writeHandler, [self = shared_from_this(), pViewer](const std::error_code& ec, size_t bytesTransferred) {
+			Viewer& viewer = *pViewer;
+			viewer.writing = false;
+
+			if (ec) {
+				if (!viewer.closed) {
+					error(ec, viewer.connection, "broadcast-writeViewer");
+					self->drop(viewer);
+				}
+				return;
+			}
+
+			viewer.offset += bytesTransferred;
+			if (viewer.controlling) {
+				self->readServer();
+			}
+
+			displayCounters.writes.add();
+
+			while (bytesTransferred) {
+				size_t step = std::min(bytesTransferred, viewer.chunk->size - viewer.position);
+				viewer.position += step;
+				bytesTransferred -= step;
+
+				if (viewer.position == viewer.chunk->size && viewer.chunk->next) {
+					viewer.chunk = viewer.chunk->next;
+					viewer.position = 0;
+				}
+			}
+
+			self->writeViewer(pViewer);
+		})));
+	}
+
+	void readViewer(const shared_ptr<Viewer>& pViewer)
+	{
+		Viewer& viewer = *pViewer;
+		if (viewer.reading || viewer.closed) {
+			return;
+		}
+
+		// the controlling viewer waits for the server to catch up on its input
+		if (viewer.inputRing.size() == viewer.inputRing.capacity()) {
+			return;
+		}
+
+		viewer.reading = true;
+
+		viewer.connection.socket_.async_read_some(viewer.inputRing.writable(viewer.inputRing.capacity()), strand_.wrap(MakeBufferedHandler(viewer.readHandler, [self = shared_from_this(), pViewer](const std::error_code& ec, size_t bytesTransferred) {
+			Viewer& viewer = *pViewer;
+			viewer.reading = false;
+
+			if (ec || !bytesTransferred) {
+				if (!viewer.closed) {
+					error(ec ? ec : asio::error::eof, viewer.connection, "broadcast-readViewer");
+					self->drop(viewer);
+				}
+				return;
+			}
+
+			viewer.inputRing.commit(bytesTransferred);
+
+			inputCounters.reads.add();
+			inputCounters.bytes.add(bytesTransferred);
+
+			if (viewer.controlling) {
+				self->writeServer(pViewer);
+			}
+			else {
+				viewer.inputRing.consume(bytesTransferred);
+			}
+
+			self->readViewer(pViewer);
+		})));
+	}
+
+	// pass the controlling viewer's input on to the server
+	void writeServer(const shared_ptr<Viewer>& pViewer)
+	{
+		Viewer& viewer = *pViewer;
+		if (writingServer_ || viewer.inputRing.empty() || ended_) {
+			return;
+		}
+
+		writingServer_ = true;
+
+		async_write(server_.socket_, viewer.inputRing.readable(), strand_.wrap(MakeBufferedHandler(serverWriteHandler_, [self = shared_from_this(), pViewer](const std::error_code& ec, size_t bytesTransferred) {
+			self->writingServer_ = false;
+
+			if (ec) {
+				if (!self->ended_) {
+					error(ec, self->server_, "broadcast-writeServer");
+					self->end();
+				}
+				return;
+			}
+
+			pViewer->inputRing.consume(bytesTransferred);
+
+			inputCounters.writes.add();
+
+			self->writeServer(pViewer);
+			self->readViewer(pViewer);
+		})));
+	}
+
+	// viewers still get whatever was read before the server went away
+	void serverClosed()
+	{
+		serverClosed_ = true;
+		leaveBroker();
+
+		std::error_code dontCare;
+		server_.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+
+		if (viewers_.empty()) {
+			ended_ = true;
+			return;
+		}
+
+		for (size_t i = 0; i < viewers_.size();) {
+			auto pViewer = viewers_[i];
+			writeViewer(pViewer);
+			if (i < viewers_.size() && viewers_[i] == pViewer) {
+				++i;
+			}
+		}
+	}
+
+	void drop(Viewer& viewer)
+	{
+		// once the server is gone, viewers leave independently as they finish
+		if (viewer.controlling && !serverClosed_) {
+			info(viewer.connection, "broadcast", "controlling viewer left");
+			end();
+			return;
+		}
+
+		viewer.closed = true;
+
+		std::error_code dontCare;
+		viewer.connection.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+
+		auto found = find_if(viewers_.begin(), viewers_.end(), [&viewer](const shared_ptr<Viewer>& pViewer) {
+			return pViewer.get() == &viewer;
+		});
+		if (found != viewers_.end()) {
+			*found = move(viewers_.back());
+			viewers_.pop_back();
+		}
+	}
+
+	// disconnect the server and every viewer
+	void end()
+	{
+		if (ended_) {
+			return;
+		}
+		ended_ = true;
+
+		if (!serverClosed_) {
+			serverClosed_ = true;
+			leaveBroker();
+		}
+
+		std::error_code dontCare;
+		server_.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+
+		controller_.reset();
+
+		auto viewers = move(viewers_);
+		for (auto& pViewer : viewers) {
+			pViewer->closed = true;
+			pViewer->connection.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+		}
+	}
+
+	// stop new viewers being sent to a group which is going away
+	void leaveBroker();
+};
+
+// Connection objects are matched by ID; multiple can wait on a single ID as well.
+// upon a match, a ConnectionPair is created and run.
+// a broadcast server instead waits in its shard's broadcasts as a BroadcastGroup, which every
+// viewer of that ID joins until the server leaves.
+// IDs are split across config::brokerShards shards by hash, each with its own strand and
+// tables, so matching for different IDs proceeds in parallel on all io threads.
+// the order in which multiple waiters on one ID are matched is not guaranteed.
+// with config::perCoreIo the shards are spread over the per-thread io_services, and the broker is
+// the only place where one io thread hands work to another.
+class ConnectionBroker
+{
+public:
+	using Shard = RepeaterShard;
+
+	ConnectionBroker(const vector<asio::io_service*>& ioServices, TimingWheels& wheels)
+		: shards_(ioServices, config::brokerShards)
+		, wheels_(wheels)
+	{}
+
+	void postPendingViewer(shared_ptr<IncomingConnection> pIncomingConnection) {
+		size_t hash = hashId(pIncomingConnection->connection_.id);
+		auto& shard = shards_.shardFor(hash);
+
+		if (isBroadcastId(pIncomingConnection->connection_.id)) {
+			shard.strand.post([this, &shard, hash, pIncomingConnection]() {
+				joinBroadcast(shard, hash, pIncomingConnection);
+			});
+			return;
+		}
+
+		shard.strand.post([this, &shard, hash, pIncomingConnection]() {
+			countWaiting(shard, [&]() {
+				handleNewConnection(shard, hash, pIncomingConnection, shard.waitingServers, shard.waitingViewers);
+			});
+		});
+	}
+
+	void postPendingServer(shared_ptr<IncomingConnection> pIncomingConnection) {
+		size_t hash = hashId(pIncomingConnection->connection_.id);
+		auto& shard = shards_.shardFor(hash);
+
+		if (isBroadcastId(pIncomingConnection->connection_.id)) {
+			shard.strand.post([this, &shard, hash, pIncomingConnection]() {
+				startBroadcast(shard, hash, pIncomingConnection);
+			});
+			return;
+		}
+
+		shard.strand.post([this, &shard, hash, pIncomingConnection]() {
+			countWaiting(shard, [&]() {
+				handleNewConnection(shard, hash, pIncomingConnection, shard.waitingViewers, shard.waitingServers);
+			});
+		});
+	}
+
+	// drop the entry of a waiting pair which closed, or expired if it is still there
+	void postRemoveWaiting(shared_ptr<ConnectionPair> pConnection, bool expire)
+	{
+		pConnection->waiting_.shard->strand.post([this, pConnection, expire]() {
+			bool found = false;
+
+			// stale entries for the same ID go too
+			countWaiting(*pConnection->waiting_.shard, [&]() {
+				pConnection->waiting_.table->erase(pConnection->waiting_.hash, pConnection->first_.id, [&pConnection, &found](const weak_ptr<ConnectionPair>& waiting) {
+					auto pWaiting = waiting.lock();
+					if (pWaiting == pConnection) {
+						found = true;
+						return true;
+					}
+					return !pWaiting;
+				});
+			});
+
+			if (expire && found) {
+				pConnection->postExpire();
+			}
+		});
+	}
+
+	void postRemoveBroadcast(shared_ptr<BroadcastGroup> pGroup)
+	{
+		pGroup->waiting_.shard->strand.post([pGroup]() {
+			pGroup->waiting_.shard->broadcasts.erase(pGroup->waiting_.hash, pGroup->server_.id, [&pGroup](const weak_ptr<BroadcastGroup>& registered) {
+				auto pRegistered = registered.lock();
+				return !pRegistered || pRegistered == pGroup;
+			});
+		});
+	}
+
+	// take every waiting pair out of the broker, so nothing can be matched with them any more.
+	// blocks until each shard has given them up, so it must not be called from an io thread
+	vector<shared_ptr<ConnectionPair>> takeWaiting()
+	{
+		vector<shared_ptr<ConnectionPair>> pairs;
+
+		for (size_t index = 0; index < shards_.size(); ++index) {
+			auto& shard = shards_[index];
+
+			promise<void> taken;
+			shard.strand.post([this, &shard, &pairs, &taken]() {
+				auto take = [&pairs](const weak_ptr<ConnectionPair>& waiting) {
+					if (auto pConnection = waiting.lock()) {
+						pairs.push_back(pConnection);
+					}
+				};
+				countWaiting(shard, [&]() {
+					shard.waitingServers.clear(take);
+					shard.waitingViewers.clear(take);
+				});
+				taken.set_value();
+			});
+			taken.get_future().wait();
+		}
+
+		return pairs;
+	}
+
+protected:
+
+	// keep the waiting gauges in step with what `change` does to the shard's tables
+	template <typename Change>
+	void countWaiting(Shard& shard, Change change)
+	{
+		int64_t servers = (int64_t)shard.waitingServers.size();
+		int64_t viewers = (int64_t)shard.waitingViewers.size();
+
+		change();
+
+		waitingServers.add((int64_t)shard.waitingServers.size() - servers);
+		waitingViewers.add((int64_t)shard.waitingViewers.size() - viewers);
+	}
+
+	// the live group for an ID, if any; groups which have gone are cleared out on the way
+	shared_ptr<BroadcastGroup> findBroadcast(Shard& shard, size_t hash, const string& id)
+	{
+		shared_ptr<BroadcastGroup> pGroup;
+		shard.broadcasts.erase(hash, id, [&pGroup](const weak_ptr<BroadcastGroup>& registered) {
+			auto pRegistered = registered.lock();
+			if (pRegistered) {
+				pGroup = pRegistered;
+			}
+			return !pRegistered;
+		});
+		return pGroup;
+	}
+
+	void startBroadcast(Shard& shard, size_t hash, shared_ptr<IncomingConnection> pIncomingConnection)
+	{
+		auto& connection = pIncomingConnection->connection_;
+
+		if (findBroadcast(shard, hash, connection.id)) {
+			error(asio::error::already_started, connection, "handleNewConnection", "broadcast already has a server");
+			std::error_code dontCare;
+			connection.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+			return;
+		}
+
+		auto id = connection.id;
+
+		// the group stays on the io_service which accepted its server
+		auto& ioService = connection.socket_.get_io_service();
+
+		auto pGroup = make_shared<BroadcastGroup>(ioService, move(connection));
+		shard.broadcasts.insert(hash, move(id), pGroup);
+
+		pGroup->waiting_.broker = this;
+		pGroup->waiting_.shard = &shard;
+		pGroup->waiting_.hash = hash;
+
+		if (config::waitingTtl) {
+			pGroup->waiting_.expiry.schedule(wheels_.local(), pGroup, &BroadcastGroup::onWaitingExpired, std::chrono::seconds(config::waitingTtl));
+		}
+
+		info(pGroup->server_, "handleNewConnection", "broadcasting");
+
+		pGroup->run();
+	}
+
+	void joinBroadcast(Shard& shard, size_t hash, shared_ptr<IncomingConnection> pIncomingConnection)
+	{
+		auto pGroup = findBroadcast(shard, hash, pIncomingConnection->connection_.id);
+		if (!pGroup) {
+			error(asio::error::not_connected, pIncomingConnection->connection_, "handleNewConnection", "no broadcast for this ID");
+			std::error_code dontCare;
+			pIncomingConnection->connection_.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+			return;
+		}
+
+		broadcastJoins.add();
+		pGroup->postJoin(pIncomingConnection);
+	}
+
+	void handleNewConnection(Shard& shard, size_t hash, shared_ptr<IncomingConnection> pIncomingConnection, WaitingTable<weak_ptr<ConnectionPair>>& fromWaiting, WaitingTable<weak_ptr<ConnectionPair>>& toWaiting)
+	{
+		shared_ptr<ConnectionPair> pConnection;
+
+		weak_ptr<ConnectionPair> match;
+		bool matched = fromWaiting.take(hash, pIncomingConnection->connection_.id, [&pConnection](const weak_ptr<ConnectionPair>& waiting) {
+			pConnection = waiting.lock();
+			return !!pConnection;
+		}, match);
+
+		if (matched) {
+			info(pIncomingConnection->connection_, "handleNewConnection", "matched");
+
+			pairsMatched.add();
+			if (pConnection->first_.established != chrono::steady_clock::time_point()) {
+				matchLatency.record(chrono::steady_clock::now() - pConnection->first_.established);
+			}
+
+			pConnection->postAttach(pIncomingConnection);
+			return;
+		}
+
+		// otherwise, add a new waiting ConnectionPair
+		{
+			auto id = pIncomingConnection->connection_.id;
+
+			// the pair stays on the io_service which accepted its first side
+			auto& ioService = pIncomingConnection->connection_.socket_.get_io_service();
+
+			pConnection = make_shared<ConnectionPair>(ioService, move(pIncomingConnection->connection_));
+			toWaiting.insert(hash, move(id), pConnection);
+
+			pConnection->waiting_.broker = this;
+			pConnection->waiting_.shard = &shard;
+			pConnection->waiting_.table = &toWaiting;
+			pConnection->waiting_.hash = hash;
+
+			if (config::waitingTtl) {
+				pConnection->waiting_.expiry.schedule(wheels_.local(), pConnection, &ConnectionPair::onWaitingExpired, std::chrono::seconds(config::waitingTtl));
+			}
+			
+			info(pConnection->first_, "handleNewConnection", "waiting");
+
+			pConnection->run();
+		}
+	}
+
+	BrokerShards<weak_ptr<ConnectionPair>, weak_ptr<BroadcastGroup>> shards_;
+	TimingWheels& wheels_;
+};
+
+void ConnectionPair::onWaitingExpired(const shared_ptr<void>& owner)
+{
+	auto pConnection = static_pointer_cast<ConnectionPair>(owner);
+	pConnection->waiting_.broker->postRemoveWaiting(pConnection, true);
+}
+
+void ConnectionPair::leaveBroker()
+{
+	waiting_.expiry.cancel();
+	waiting_.broker->postRemoveWaiting(shared_from_this(), false);
+}
+
+void BroadcastGroup::onWaitingExpired(const shared_ptr<void>& owner)
+{
+	static_pointer_cast<BroadcastGroup>(owner)->postExpire();
+}
+
+void BroadcastGroup::leaveBroker()
+{
+	waiting_.expiry.cancel();
+	waiting_.broker->postRemoveBroadcast(shared_from_this());
+}
+
+// one session carried over a Trunk.
+// at the edge the socket is the server's or viewer's own; at the core it is one end of a local
+// socket pair whose other end went to the ConnectionBroker as an ordinary Connection, so matching,
+// relaying and broadcasting treat sessions from a trunk like any other.
+struct TrunkStream
+{
+	TrunkStream(asio::io_service& ioService, uint32_t id)
+		: connection(ioService)
+		, id(id)
+	{}
+
+	Connection connection;
+	uint32_t id;
+
+	// bytes which may still be sent before the other side extends the window
+	size_t credit = config::trunkWindow;
+
+	// bytes delivered to the socket which the other side hasn't been given credit for yet
+	size_t delivered = 0;
+
+	// data from the other side waiting to be written to the socket; up to config::trunkWindow
+	ObjectPool<RelayStorage>::Pointer storage;
+	RelayRing received;
+
+	// read from the socket, one data frame at a time
+	array<uint8_t, 0x4000> sendBuffer;
+
+	bool reading = false;
+	bool writing = false;
+
+	// waiting for the trunk to drain before reading again
+	bool blocked = false;
+
+	bool closeSent = false;
+	bool closeReceived = false;
+
+	// set once the stream is gone from its trunk; handlers still completing have nothing left to do
+	bool detached = false;
+
+	InstanceCounter session{ activeSessions };
+};
+
+// a long lived connection between an edge repeater and the core, multiplexing many streams.
+// all of a trunk's state, including its streams, belongs to its strand. frames from every stream
+// are gathered into one buffer and written together, which the streams stop filling at
+// config::trunkHighWater; incoming data never waits, since the credit window guarantees room for it.
+// an edge trunk reconnects after config::trunkRetry seconds whenever it fails, which closes every
+// stream it carried. a core trunk ends when its connection does.
+class Trunk
+	: public std::enable_shared_from_this<Trunk>
+{
+public:
+	Serializer strand_;
+	asio::ip::tcp::socket socket_;
+
+	// the edge connects to `upstream`; the core passes its streams to `broker`
+	Trunk(asio::io_service& ioService, string upstream, ConnectionBroker* broker)
+		: strand_(ioService)
+		, socket_(ioService)
+		, resolver_(ioService)
+		, retryTimer_(ioService)
+		, upstream_(move(upstream))
+		, broker_(broker)
+	{}
+
+	bool up() const
+	{
+		return up_;
+	}
+
+	// edge
+	void postConnect()
+	{
+		strand_.post([self = shared_from_this()]() {
+			self->connect();
+		});
+	}
+
+	// core, once accepted
+	void postStart()
+	{
+		strand_.post([self = shared_from_this()]() {
+			self->start();
+		});
+	}
+
+	// edge: carry a server or viewer which finished its handshake to the core
+	void postOpen(shared_ptr<IncomingConnection> pIncomingConnection)
+	{
+		strand_.post([self = shared_from_this(), pIncomingConnection]() {
+			auto& connection = pIncomingConnection->connection_;
+
+			if (!self->up_) {
+				error(asio::error::not_connected, connection, "trunkOpen", "no trunk to the core");
+				std::error_code dontCare;
+				connection.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+				return;
+			}
+
+			auto pStream = make_shared<TrunkStream>(self->socket_.get_io_service(), self->nextStream_++);
+			pStream->connection.adopt(move(connection));
+
+			trunk::OpenInfo openInfo;
+			openInfo.viewer = pStream->connection.isViewer();
+			openInfo.remote = pStream->connection.remoteEndpoint_;
+			openInfo.id = pStream->connection.id;
+			openInfo.rfbVersion = pStream->connection.rfbVersion;
+			openInfo.extra = pStream->connection.extra;
+
+			auto payload = trunk::encodeOpen(openInfo);
+			trunk::appendFrame(self->pending_, trunk::FrameType::open, pStream->id, payload.data(), payload.size());
+
+			info(pStream->connection, "trunkOpen", "forwarded");
+
+			self->attach(pStream);
+			self->flush();
+		});
+	}
+
+	// called by the FrameParser
+	bool control(const trunk::FrameHeader& header, const uint8_t* payload)
+	{
+		if (header.type == trunk::FrameType::open) {
+			return open(header.stream, payload, header.length);
+		}
+
+		auto pStream = find(header.stream);
+
+		if (header.type == trunk::FrameType::window) {
+			if (header.length != 4) {
+				return false;
+			}
+			if (pStream) {
+				pStream->credit += trunk::getUint32(payload);
+				if (pStream->credit > config::trunkWindow) {
+					return false;
+				}
+				read(pStream);
+			}
+			return true;
+		}
+
+		// close; whatever is still buffered is delivered first
+		if (pStream) {
+			pStream->closeReceived = true;
+			if (pStream->received.empty()) {
+				closeSocket(pStream);
+			}
+			remove(pStream);
+		}
+		return true;
+	}
+
+	bool data(uint32_t stream, const uint8_t* bytes, size_t size)
+	{
+		auto pStream = find(stream);
+
+		// a stream which has closed discards whatever was already on its way
+		if (!pStream || pStream->closeSent) {
+			return true;
+		}
+
+		if (pStream->closeReceived || pStream->received.capacity() - pStream->received.size() < size) {
+			return false;
+		}
+
+		asio::buffer_copy(pStream->received.writable(size), asio::buffer(bytes, size));
+		pStream->received.commit(size);
+
+		write(pStream);
+		return true;
+	}
+
+private:
+	void connect()
+	{
+		auto separator = upstream_.rfind(':');
+		asio::ip::tcp::resolver::query query(upstream_.substr(0, separator), upstream_.substr(separator + 1));
+
+		resolver_.async_resolve(query, strand_.wrap([self = shared_from_this()](const std::error_code& ec, asio::ip::tcp::resolver::iterator endpoints) {
+			if (ec) {
+				self->traceEvent("resolve failed", ec);
+				self->retry();
+				return;
+			}
+
+			asio::async_connect(self->socket_, endpoints, self->strand_.wrap([self](const std::error_code& ec, asio::ip::tcp::resolver::iterator) {
+				if (ec) {
+					std::error_code dontCare;
+					self->socket_.close(dontCare);
+					self->traceEvent("connect failed", ec);
+					self->retry();
+					return;
+				}
+
+				self->start();
+			}));
+		}));
+	}
+
+	void retry()
+	{
+		retryTimer_.expires_from_now(std::chrono::seconds(config::trunkRetry));
+		retryTimer_.async_wait(strand_.wrap([self = shared_from_this()](const std::error_code& ec) {
+			if (!ec) {
+				self->connect();
+			}
+		}));
+	}
+
+	void start()
+	{
+		configureSocket(socket_);
+
+		std::error_code dontCare;
+		remoteEndpoint_ = socket_.remote_endpoint(dontCare);
+
+		up_ = true;
+		traceEvent("connected");
+
+		pending_.insert(pending_.end(), trunk::preamble, trunk::preamble + trunk::preambleSize);
+		flush();
+
+		readTrunk();
+	}
+
+	void fail(const std::error_code& ec)
+	{
+		traceEvent("closed", ec);
+
+		up_ = false;
+		++generation_;
+
+		std::error_code dontCare;
+		socket_.close(dontCare);
+
+		// every session on the trunk goes with it
+		for (auto& entry : streams_) {
+			auto& pStream = entry.second;
+			pStream->detached = true;
+			pStream->connection.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+		}
+		streams_.clear();
+		blocked_.clear();
+
+		pending_.clear();
+		writingTrunk_ = false;
+		parser_.reset();
+		nextStream_ = 1;
+
+		if (!broker_) {
+			retry();
+		}
+	}
+
+	void readTrunk()
+	{
+		socket_.async_read_some(asio::buffer(readBuffer_), strand_.wrap(MakeBufferedHandler(readHandler_, [self = shared_from_this(), generation = generation_](const std::error_code& ec, size_t bytesTransferred) {
+			if (generation != self->generation_) {
+				return;
+			}
+
+			if (ec || !bytesTransferred) {
+				self->fail(ec ? ec : asio::error::eof);
+				return;
+			}
+
+			if (!self->parser_.feed(self->readBuffer_.data(), bytesTransferred, config::trunkWindow, *self)) {
+				self->fail(asio::error::invalid_argument);
+				return;
+			}
+
+			self->readTrunk();
+		})));
+	}
+
+	// write out everything gathered since the last write, unless a write is already pending
+	void flush()
+	{
+		if (writingTrunk_ || pending_.empty() || !up_) {
+			return;
+		}
+
+		writingTrunk_ = true;
+		writing_.swap(pending_);
+
+		async_write(socket_, asio::buffer(writing_), strand_.wrap(MakeBufferedHandler(writeHandler_, [self = shared_from_this(), generation = generation_](const std::error_code& ec, size_t) {
+			if (generation != self->generation_) {
+				return;
+			}
+
+			if (ec) {
+				self->fail(ec);
+				return;
+			}
+
+			self->writingTrunk_ = false;
+			self->writing_.clear();
+
+			auto blocked = move(self->blocked_);
+			self->blocked_.clear();
+			for (auto& pStream : blocked) {
+				pStream->blocked = false;
+				self->read(pStream);
+			}
+
+			self->flush();
+		})));
+	}
+
+	shared_ptr<TrunkStream> find(uint32_t stream)
+	{
+		auto found = streams_.find(stream);
+		return found == streams_.end() ? nullptr : found->second;
+	}
+
+	void attach(shared_ptr<TrunkStream> pStream)
+	{
+		pStream->storage = relayStoragePool.acquire(config::bufferSize);
+		pStream->received.attach(pStream->storage->buffer.get(), config::trunkWindow);
+
+		streams_[pStream->id] = pStream;
+		read(pStream);
+	}
+
+	// core: a new server or viewer on the edge becomes a Connection for the broker
+	bool open(uint32_t stream, const uint8_t* payload, size_t size)
+	{
+		trunk::OpenInfo openInfo;
+		if (!broker_ || !trunk::decodeOpen(payload, size, openInfo) || openInfo.id.empty() || find(stream)) {
+			return false;
+		}
+
+		auto& ioService = socket_.get_io_service();
+		auto pIncomingConnection = IncomingConnection::create(ioService);
+		auto pStream = make_shared<TrunkStream>(ioService, stream);
+
+		auto& connection = pIncomingConnection->connection_;
+		connection.localEndpoint_ = asio::ip::tcp::endpoint(asio::ip::tcp::v4(), openInfo.viewer ? config::viewerPort : config::serverPort);
+		connection.remoteEndpoint_ = openInfo.remote;
+		connection.id = move(openInfo.id);
+		connection.extra = move(openInfo.extra);
+		connection.rfbVersion = move(openInfo.rfbVersion);
+
+		pStream->connection.localEndpoint_ = connection.localEndpoint_;
+		pStream->connection.remoteEndpoint_ = connection.remoteEndpoint_;
+		pStream->connection.id = connection.id;
+
+		if (!platform::socketPair(connection.socket_, pStream->connection.socket_)) {
+			error(asio::error::no_descriptors, connection, "trunkOpen", "no socket pair");
+
+			// refused before it started; anything already sent for it is discarded
+			trunk::appendFrame(pending_, trunk::FrameType::close, stream, nullptr, 0);
+			flush();
+			return true;
+		}
+
+		info(connection, "trunkOpen", "accepted");
+
+		attach(pStream);
+
+		if (openInfo.viewer) {
+			broker_->postPendingViewer(pIncomingConnection);
+		}
+		else {
+			broker_->postPendingServer(pIncomingConnection);
+		}
+		return true;
+	}
+
+	// read from the stream's socket and send it on, as far as the window and the trunk allow
+	void read(shared_ptr<TrunkStream> pStream)
+	{
+		if (pStream->reading || pStream->closeSent || pStream->closeReceived || !pStream->credit) {
+			return;
+		}
+
+		if (pending_.size() >= config::trunkHighWater) {
+			if (!pStream->blocked) {
+				pStream->blocked = true;
+				blocked_.push_back(pStream);
+			}
+			return;
+		}
+
+		pStream->reading = true;
+
+		size_t limit = std::min(pStream->credit, pStream->sendBuffer.size());
+		pStream->connection.socket_.async_read_some(asio::buffer(pStream->sendBuffer.data(), limit), strand_.wrap(MakeBufferedHandler(pStream->storage->readHandler, [self = shared_from_this(), pStream](const std::error_code& ec, size_t bytesTransferred) {
+			pStream->reading = false;
+
+			if (pStream->detached) {
+				return;
+			}
+
+			if (ec || !bytesTransferred) {
+				if (ec) {
+					error(ec, pStream->connection, "trunkRead");
+				}
+				else {
+					error(asio::error::eof, pStream->connection, "trunkRead", "0 byte op");
+				}
+				self->closeSocket(pStream);
+				return;
+			}
+
+			trunk::appendFrame(self->pending_, trunk::FrameType::data, pStream->id, pStream->sendBuffer.data(), bytesTransferred);
+			pStream->credit -= bytesTransferred;
+
+			self->flush();
+			self->read(pStream);
+		})));
+	}
+
+	// deliver data from the other side, extending its window a quarter at a time
+	void write(shared_ptr<TrunkStream> pStream)
+	{
+		if (pStream->writing || pStream->received.empty()) {
+			return;
+		}
+
+		pStream->writing = true;
+
+		async_write(pStream->connection.socket_, pStream->received.readable(), strand_.wrap(MakeBufferedHandler(pStream->storage->writeHandler, [self = shared_from_this(), pStream](const std::error_code& ec, size_t bytesTransferred) {
+			pStream->writing = false;
+
+			if (pStream->detached) {
+				return;
+			}
+
+			if (ec) {
+				error(ec, pStream->connection, "trunkWrite");
+				self->closeSocket(pStream);
+				return;
+			}
+
+			pStream->received.consume(bytesTransferred);
+			pStream->delivered += bytesTransferred;
+
+			if (pStream->closeSent) {
+				return;
+			}
+
+			if (pStream->closeReceived) {
+				if (pStream->received.empty()) {
+					self->closeSocket(pStream);
+					return;
 				}
+			}
+			else if (pStream->delivered >= config::trunkWindow / 4) {
+				uint8_t credit[4];
+				trunk::putUint32(credit, (uint32_t)pStream->delivered);
+				trunk::appendFrame(self->pending_, trunk::FrameType::window, pStream->id, credit, sizeof(credit));
+				pStream->delivered = 0;
+				self->flush();
+			}
+
+			self->write(pStream);
+		})));
+	}
+
+	// a close from either side ends the session in both directions, dropping anything undelivered
+	void closeSocket(shared_ptr<TrunkStream> pStream)
+	{
+		std::error_code dontCare;
+		pStream->connection.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
+		sendClose(pStream);
+	}
+
+	void sendClose(shared_ptr<TrunkStream> pStream)
+	{
+		if (pStream->closeSent) {
+			return;
+		}
+		pStream->closeSent = true;
+
+		trunk::appendFrame(pending_, trunk::FrameType::close, pStream->id, nullptr, 0);
+		flush();
+
+		remove(pStream);
+	}
+
+	// a stream is finished once both sides have closed it
+	void remove(shared_ptr<TrunkStream> pStream)
+	{
+		if (pStream->closeSent && pStream->closeReceived) {
+			pStream->detached = true;
+			streams_.erase(pStream->id);
+
+			std::error_code dontCare;
+			pStream->connection.socket_.close(dontCare);
+		}
+	}
+
+	void traceEvent(const char* event, const std::error_code& ec = {})
+	{
+		ostringstream text;
+		text << "trunk\t";
+		if (broker_) {
+			text << "from " << remoteEndpoint_;
+		}
+		else {
+			text << "to " << upstream_;
+		}
+		text << "\t" << event;
+		if (ec) {
+			text << "\t" << ec.message();
+		}
+		trace(text.str().c_str());
+	}
+
+	asio::ip::tcp::resolver resolver_;
+	asio::steady_timer retryTimer_;
+
+	string upstream_;
+	ConnectionBroker* broker_;
+
+	asio::ip::tcp::endpoint remoteEndpoint_;
+
+	atomic<bool> up_{ false };
+
+	// a trunk which fails drops everything belonging to its connection, including handlers still pending
+	uint64_t generation_ = 0;
+
+	unordered_map<uint32_t, shared_ptr<TrunkStream>> streams_;
+	uint32_t nextStream_ = 1;
+
+	// streams waiting for the trunk to drain below config::trunkHighWater
+	vector<shared_ptr<TrunkStream>> blocked_;
+
+	vector<uint8_t> pending_;
+	vector<uint8_t> writing_;
+	bool writingTrunk_ = false;
+
+	trunk::FrameParser parser_;
+	array<uint8_t, 0x10000> readBuffer_;
+
+	BufferedHandlerAllocator readHandler_;
+	BufferedHandlerAllocator writeHandler_;
+};
+
+// the cores io threads run on
+vector<unsigned> ioCores()
+{
+	auto coreCount = std::thread::hardware_concurrency();
+	auto coreStep = 1U;
+
+	if (coreCount == 3) {
+		coreCount = 2;
+	}
+	if (coreCount < 1) {
+		coreCount = 1;
+	}
+	if (coreCount > 16) {
+		coreCount = 16;
+	}
+
+	// adjust coreStep to only run on even cores.
+	// this really does not need that many cores anyway!
+
+	if (coreCount >= 4) {
+		coreStep = 2;
+	}
+
+	vector<unsigned> cores;
+	for (auto core = 0U; core < coreCount; core += coreStep) {
+		cores.push_back(core);
+	}
+	return cores;
+}
+
+// an io_service with its own acceptors, and the strands for connections it accepts.
+// normally all io threads run a single IoShard; with config::perCoreIo each thread runs its own,
+// listening on SO_REUSEPORT sockets so the kernel spreads new connections across the threads,
+// and a connection is handled by the thread which accepted it from then on.
+class IoShard
+{
+public:
+	asio::io_service ioService_;
+
+	// an acceptor can't be used from two threads at once, so its accepts complete on one of these;
+	// each handshake then runs on its IncomingConnection's own strand
+	Serializer serverStrand_;
+	Serializer viewerStrand_;
+
+	asio::ip::tcp::acceptor serverAcceptor_;
+	asio::ip::tcp::acceptor viewerAcceptor_;
+
+	// see Server::probeScheduling
+	asio::steady_timer probeTimer_;
+
+	IoShard()
+		: ioService_()
+		, serverStrand_(ioService_)
+		, viewerStrand_(ioService_)
+		, serverAcceptor_(ioService_)
+		, viewerAcceptor_(ioService_)
+		, probeTimer_(ioService_)
+	{}
+
+	// take over listening sockets handed over from another process
+	void adopt(int serverListener, int viewerListener)
+	{
+		serverAcceptor_.assign(asio::ip::tcp::v4(), serverListener);
+		viewerAcceptor_.assign(asio::ip::tcp::v4(), viewerListener);
+	}
+
+	// returns false if the ports couldn't be shared, in which case nothing is listening yet
+	bool listen(uint16_t serverPort, uint16_t viewerPort, bool reusePort)
+	{
+		return listen(serverAcceptor_, serverPort, reusePort)
+			&& listen(viewerAcceptor_, viewerPort, reusePort);
+	}
+
+private:
+	static bool listen(asio::ip::tcp::acceptor& acceptor, uint16_t port, bool reusePort)
+	{
+		asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+
+		acceptor.open(endpoint.protocol());
+		acceptor.set_option(asio::socket_base::reuse_address(true));
+
+		if (reusePort && !platform::setReusePort(acceptor)) {
+			acceptor.close();
+			return false;
+		}
+
+		acceptor.bind(endpoint);
+		acceptor.listen(config::listenBacklog ? (int)config::listenBacklog : asio::socket_base::max_connections);
+		return true;
+	}
+};
+
+// what a new process takes over from the one it replaces; see Server::handOver
+struct Inheritance
+{
+	// server and viewer listening sockets, a pair for each IoShard of the old process
+	vector<pair<int, int>> listeners;
+
+	// servers and viewers still waiting for their match
+	vector<pair<trunk::OpenInfo, int>> waiting;
+};
+
+// run `f` on the strand and wait for its result; only for threads which aren't running the io_service
+bool runOn(Serializer& strand, function<bool()> f)
+{
+	promise<bool> result;
+	strand.post([&result, &f]() {
+		result.set_value(f());
+	});
+	return result.get_future().get();
+}
+
+// handle incoming server and viewer connections, and pass them off to the ConnectionBroker once initialized.
+// an edge repeater passes them to its trunks instead, and the core accepts trunks alongside them.
+class Server
+{
+public:
+	// first, so it is destroyed after the io_services: sessions they still hold when they go cancel
+	// their deadlines on it
+	TimingWheels wheels_;
+
+#ifdef VNCREPEATER_HAS_URING
+	// with config::uringRelay, once they could be opened; see relayUrings. before the io_services
+	// too, which hold the wait on each ring's eventfd
+	unique_ptr<Urings> urings_;
+#endif
+
+	vector<unique_ptr<IoShard>> ioShards_;
+
+	// the io_service run by each io thread
+	vector<asio::io_service*> threadServices_;
+
+	// with config::workStealing and more than one io_service, runs the io threads in place of io_service::run
+	unique_ptr<StealingScheduler> scheduler_;
+
+#ifdef VNCREPEATER_HAS_URING
+	// a multishot accept on one of a shard's listening sockets
+	struct UringAccept
+		: UringOperation
+	{
+		UringAccept(Server& server, IoShard& shard, const HandshakeRole& role)
+			: server(server)
+			, shard(shard)
+			, role(role)
+		{}
+
+		void completed(int result, bool more) override
+		{
+			server.uringAccepted(*this, result, more);
+		}
+
+		Server& server;
+		IoShard& shard;
+		const HandshakeRole& role;
+	};
+
+	vector<unique_ptr<UringAccept>> uringAccepts_;
+#endif
+
+	ConnectionBroker broker_;
+
+	asio::steady_timer statsTimer_;
+
+	// accept totals when the stats were last logged
+	struct
+	{
+		int64_t servers;
+		int64_t viewers;
+		int64_t failed;
+	} reported_ = {};
+
+	// edge: connections to the core, spread over the io threads
+	vector<shared_ptr<Trunk>> trunks_;
+	atomic<size_t> nextTrunk_{ 0 };
+
+	// core
+	asio::ip::tcp::acceptor trunkAcceptor_;
+
+#ifdef VNCREPEATER_HAS_HANDOVER
+	// where a new process asks to take over, and the thread which hands everything to it
+	asio::local::stream_protocol::acceptor handoverAcceptor_;
+	asio::local::stream_protocol::socket handoverChannel_;
+	thread handoverThread_;
+#endif
+
+	// once handed over, checks whether the sessions still relaying here have ended
+	asio::steady_timer drainTimer_;
+
+	unique_ptr<MetricsEndpoint> metrics_;
+
+	Server()
+		: Server(Inheritance())
+	{}
+
+	explicit Server(const Inheritance& inheritance)
+		: wheels_(std::chrono::milliseconds(config::wheelTick))
+		, ioShards_(makeIoShards(config::serverPort, config::viewerPort, inheritance.listeners))
+		, threadServices_(mapThreadServices(ioShards_))
+		, scheduler_(config::workStealing && ioShards_.size() > 1 ? make_unique<StealingScheduler>(threadServices_) : nullptr)
+		, broker_(threadServices_, wheels_)
+		, statsTimer_(ioShards_.front()->ioService_)
+		, trunkAcceptor_(ioShards_.front()->ioService_)
+#ifdef VNCREPEATER_HAS_HANDOVER
+		, handoverAcceptor_(ioShards_.front()->ioService_)
+		, handoverChannel_(ioShards_.front()->ioService_)
+#endif
+		, drainTimer_(ioShards_.front()->ioService_)
+	{
+		wheels_.open(threadServices_);
+
+#ifdef VNCREPEATER_HAS_URING
+		if (config::uringRelay) {
+			urings_.reset(new Urings(threadServices_, config::uringBuffers, config::bufferSize));
+			if (urings_->open()) {
+				relayUrings = urings_.get();
+			}
+			else {
+				urings_.reset();
+				trace("uring: io_uring is not available, so relays and acceptors use epoll");
+			}
+		}
+#endif
+
+		if (!config::trunkUpstream.empty()) {
+			for (size_t index = 0; index < config::trunkConnections; ++index) {
+				trunks_.push_back(make_shared<Trunk>(*threadServices_[index % threadServices_.size()], config::trunkUpstream, nullptr));
+			}
+		}
+
+		if (config::trunkPort) {
+			asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), config::trunkPort);
+			trunkAcceptor_.open(endpoint.protocol());
+			trunkAcceptor_.set_option(asio::socket_base::reuse_address(true));
+			trunkAcceptor_.bind(endpoint);
+			trunkAcceptor_.listen();
+		}
+	}
+
+	~Server()
+	{
+		wheels_.stop();
+
+#ifdef VNCREPEATER_HAS_URING
+		if (urings_) {
+			urings_->stop();
+		}
+#endif
+	}
+
+	void startTrunks()
+	{
+		for (auto& pTrunk : trunks_) {
+			pTrunk->postConnect();
+		}
+
+		if (trunkAcceptor_.is_open()) {
+			acceptTrunk();
+		}
+	}
+
+	// each trunk from an edge gets the next io thread in turn
+	void acceptTrunk()
+	{
+		auto pSocket = make_shared<asio::ip::tcp::socket>(trunkAcceptor_.get_io_service());
+		trunkAcceptor_.async_accept(*pSocket, [this, pSocket](const std::error_code& ec) {
+			if (trunkAcceptor_.get_io_service().stopped()) {
+				return;
+			}
+			acceptTrunk();
+
+			if (ec) {
+				return;
+			}
+
+			auto& ioService = *threadServices_[nextTrunk_++ % threadServices_.size()];
+			auto pTrunk = make_shared<Trunk>(ioService, string(), &broker_);
+			if (&ioService == &pSocket->get_io_service() || !platform::moveSocket(*pSocket, pTrunk->socket_)) {
+				pTrunk->socket_ = move(*pSocket);
+			}
+
+			pTrunk->postStart();
+		});
+	}
+
+	// a server or viewer has finished its handshake
+	void handOff(shared_ptr<IncomingConnection> pIncomingConnection, bool viewer)
+	{
+		if (!trunks_.empty()) {
+			// prefer a trunk which is up
+			size_t start = nextTrunk_++;
+			auto pTrunk = trunks_[start % trunks_.size()];
+			for (size_t index = 1; index < trunks_.size() && !pTrunk->up(); ++index) {
+				pTrunk = trunks_[(start + index) % trunks_.size()];
+			}
+
+			pTrunk->postOpen(pIncomingConnection);
+			return;
+		}
+
+		if (viewer) {
+			broker_.postPendingViewer(pIncomingConnection);
+		}
+		else {
+			broker_.postPendingServer(pIncomingConnection);
+		}
+	}
+
+	// log relay latency for each direction, scheduling latency, and how fast connections are accepted, every config::statsInterval seconds
+	void reportStats()
+	{
+		statsTimer_.expires_from_now(std::chrono::seconds(config::statsInterval));
+		statsTimer_.async_wait([this](const std::error_code& ec) {
+			if (ec) {
+				return;
+			}
+
+			string text = "relay latency"
+				"\tinput " + LatencyStats::format(inputLatency.summarize()) +
+				"\tdisplay " + LatencyStats::format(displayLatency.summarize());
+			trace(text.c_str());
+
+			text = "scheduling latency\t" + LatencyStats::format(schedulingLatency.summarize());
+			trace(text.c_str());
+
+			auto servers = serverHandshakes.accepted.total();
+			auto viewers = viewerHandshakes.accepted.total();
+			auto failed = serverHandshakes.failedAccepts.total() + viewerHandshakes.failedAccepts.total();
+			text = "accepted"
+				"\tservers " + to_string(servers - reported_.servers) + " (" + to_string((servers - reported_.servers) / config::statsInterval) + "/s)"
+				"\tviewers " + to_string(viewers - reported_.viewers) + " (" + to_string((viewers - reported_.viewers) / config::statsInterval) + "/s)"
+				"\tfailed " + to_string(failed - reported_.failed);
+			reported_ = { servers, viewers, failed };
+			trace(text.c_str());
+
+			reportStats();
+		});
+	}
+
+	// serve renderMetrics on config::metricsPort, alongside everything else on the first io_service
+	void startMetrics()
+	{
+		metrics_.reset(new MetricsEndpoint(ioShards_.front()->ioService_, [this]() {
+			return renderMetrics();
+		}));
+
+		if (!metrics_->start(config::metricsPort)) {
+			string text = "metrics: can't listen on port " + to_string(config::metricsPort);
+			trace(text.c_str());
+		}
+	}
+
+	// every counter and latency, added up across the io threads as of now
+	string renderMetrics()
+	{
+		MetricsText text;
+
+		const pair<const char*, HandshakeCounters*> roles[] = {
+			{ "role=\"server\"", &serverHandshakes },
+			{ "role=\"viewer\"", &viewerHandshakes },
+		};
+
+		text.family("vncrepeater_accepted_total", "counter", "connections accepted");
+		for (auto& role : roles) {
+			text.sample("vncrepeater_accepted_total", role.first, role.second->accepted.total());
+		}
+
+		text.family("vncrepeater_accept_failures_total", "counter", "accepts which failed");
+		for (auto& role : roles) {
+			text.sample("vncrepeater_accept_failures_total", role.first, role.second->failedAccepts.total());
+		}
+
+		text.family("vncrepeater_handshake_failures_total", "counter", "handshakes which failed, by the stage they reached");
+		for (auto& role : { make_pair(&serverRole, roles[0].first), make_pair(&viewerRole, roles[1].first) }) {
+			auto& counters = *role.first->counters;
+			for (size_t step = 0; role.first->steps[step].step != HandshakeStep::done; ++step) {
+				// the step's log category is "acceptNewServer-readInfo" and so on
+				string stage = strchr(role.first->steps[step].category, '-') + 1;
+				text.sample("vncrepeater_handshake_failures_total", string(role.second) + ",stage=\"" + stage + "\"", counters.failedSteps[step].total());
+			}
+			text.sample("vncrepeater_handshake_failures_total", string(role.second) + ",stage=\"noId\"", counters.noId.total());
+			text.sample("vncrepeater_handshake_failures_total", string(role.second) + ",stage=\"timeout\"", counters.timedOut.total());
+		}
+
+		text.family("vncrepeater_handshakes_pending", "gauge", "handshakes in progress");
+		for (auto& role : roles) {
+			text.sample("vncrepeater_handshakes_pending", role.first, role.second->inProgress.total());
+		}
+
+		text.family("vncrepeater_handshake_seconds", "summary", "time from accepting a connection until its handshake completes");
+		text.summary("vncrepeater_handshake_seconds", "", handshakeLatency.summarize());
 
-				info(pIncomingConnection->connection_, "acceptNewServer", "established");
+		text.family("vncrepeater_waiting", "gauge", "servers and viewers waiting for their match");
+		text.sample("vncrepeater_waiting", roles[0].first, waitingServers.total());
+		text.sample("vncrepeater_waiting", roles[1].first, waitingViewers.total());
 
-				// read protocol version
-				async_read(pIncomingConnection->connection_.socket_, asio::buffer(pIncomingConnection->rfbBuffer_), serverStrand_.wrap([this, pIncomingConnection](const std::error_code& ec, size_t bytesTransferred) {
+		text.family("vncrepeater_matched_total", "counter", "servers and viewers paired up");
+		text.sample("vncrepeater_matched_total", "", pairsMatched.total());
 
-					std::error_code dontCare;
-					pIncomingConnection->timeout_.cancel(dontCare);
+		text.family("vncrepeater_broadcast_joins_total", "counter", "viewers which joined a broadcast");
+		text.sample("vncrepeater_broadcast_joins_total", "", broadcastJoins.total());
 
-					if (ec) {
-						error(ec, pIncomingConnection->connection_, "acceptNewServer-readProtocol");
-						return;
-					}
+		text.family("vncrepeater_match_wait_seconds", "summary", "time from completing the handshake until the match arrived, for the side which waited");
+		text.summary("vncrepeater_match_wait_seconds", "", matchLatency.summarize());
 
-					pIncomingConnection->parseRfbVersion();
+		text.family("vncrepeater_sessions", "gauge", "pairs, broadcasts and trunk streams still relaying");
+		text.sample("vncrepeater_sessions", "", (int64_t)activeSessions.load());
 
-					broker_.postPendingServer(pIncomingConnection);
-				}));
-			}));
-		}));
+		const pair<const char*, DirectionCounters*> directions[] = {
+			{ "direction=\"input\"", &inputCounters },
+			{ "direction=\"display\"", &displayCounters },
+		};
+
+		text.family("vncrepeater_relayed_bytes_total", "counter", "bytes read for relaying; input is viewer to server, display server to viewer");
+		for (auto& direction : directions) {
+			text.sample("vncrepeater_relayed_bytes_total", direction.first, direction.second->bytes.total());
+		}
+
+		text.family("vncrepeater_relay_reads_total", "counter", "relay reads completed");
+		for (auto& direction : directions) {
+			text.sample("vncrepeater_relay_reads_total", direction.first, direction.second->reads.total());
+		}
+
+		text.family("vncrepeater_relay_writes_total", "counter", "relay writes completed");
+		for (auto& direction : directions) {
+			text.sample("vncrepeater_relay_writes_total", direction.first, direction.second->writes.total());
+		}
+
+		text.family("vncrepeater_relay_latency_seconds", "summary", "time relayed data waits in the repeater, from being read to being fully written");
+		text.summary("vncrepeater_relay_latency_seconds", directions[0].first, inputLatency.summarize());
+		text.summary("vncrepeater_relay_latency_seconds", directions[1].first, displayLatency.summarize());
+
+		text.family("vncrepeater_scheduling_latency_seconds", "summary", "time a ready handler waits for an io thread");
+		text.summary("vncrepeater_scheduling_latency_seconds", "", schedulingLatency.summarize());
+
+		text.family("vncrepeater_grown_buffer_bytes", "gauge", "memory held by relay buffers grown for long paths");
+		text.sample("vncrepeater_grown_buffer_bytes", "", (int64_t)grownRelayBytes.load());
+
+		return text.text();
+	}
+
+	// a timer which is due runs once the handlers queued ahead of it have, so how late it runs is how long
+	// any ready handler on the shard's io_service waits for a thread
+	void probeScheduling(IoShard& shard)
+	{
+		shard.probeTimer_.expires_from_now(std::chrono::milliseconds(config::schedulingProbeInterval));
+		shard.probeTimer_.async_wait([this, &shard](const std::error_code& ec) {
+			if (ec) {
+				return;
+			}
+
+			schedulingLatency.record(chrono::steady_clock::now() - shard.probeTimer_.expires_at());
+
+			probeScheduling(shard);
+		});
+	}
+
+	void stop()
+	{
+		for (auto& shard : ioShards_) {
+			shard->ioService_.stop();
+		}
+	}
+
+	bool stopped()
+	{
+		return ioShards_.front()->ioService_.stopped();
+	}
+
+	// servers and viewers handed over from the previous process go back to waiting for their match
+	void adoptWaiting(const vector<pair<trunk::OpenInfo, int>>& waiting)
+	{
+		for (size_t index = 0; index < waiting.size(); ++index) {
+			auto& openInfo = waiting[index].first;
+			auto& shard = *ioShards_[index % ioShards_.size()];
+
+			auto pIncomingConnection = IncomingConnection::create(shard.ioService_);
+			auto& connection = pIncomingConnection->connection_;
+
+			// the socket was configured when it was first accepted, and might be closed by now
+			connection.socket_.assign(asio::ip::tcp::v4(), waiting[index].second);
+			connection.localEndpoint_ = asio::ip::tcp::endpoint(asio::ip::tcp::v4(), openInfo.viewer ? config::viewerPort : config::serverPort);
+			connection.remoteEndpoint_ = openInfo.remote;
+			connection.id = openInfo.id;
+			connection.extra = openInfo.extra;
+			connection.rfbVersion = openInfo.rfbVersion;
+
+			info(connection, "takeOver", "waiting");
+
+			handOff(pIncomingConnection, openInfo.viewer);
+		}
+	}
+
+#ifdef VNCREPEATER_HAS_HANDOVER
+	// wait for a new process to take over from this one
+	void listenForHandover()
+	{
+		// left behind by a process which is gone, or by the one just taken over from
+		std::remove(config::handoverPath.c_str());
+
+		asio::local::stream_protocol::endpoint endpoint(config::handoverPath);
+
+		std::error_code ec;
+		handoverAcceptor_.open(endpoint.protocol(), ec);
+		if (!ec) {
+			handoverAcceptor_.bind(endpoint, ec);
+		}
+		if (!ec) {
+			handoverAcceptor_.listen(asio::socket_base::max_connections, ec);
+		}
+		if (ec) {
+			string text = "handover: can't listen on " + config::handoverPath + "\t" + ec.message();
+			trace(text.c_str());
+			return;
+		}
+
+		handoverAcceptor_.async_accept(handoverChannel_, [this](const std::error_code& ec) {
+			if (ec) {
+				return;
+			}
+
+			// handing over waits on the io threads, so it can't run on one
+			handoverThread_ = thread([this]() {
+				handOver();
+			});
+		});
+	}
+
+	// give every listening socket and waiting connection to the new process, then keep relaying the
+	// sessions which are already running until they end.
+	// sessions can't be moved without losing whatever they have buffered, and broadcasts which have
+	// started can't be joined part way through, so those stay here
+	void handOver()
+	{
+		int channel = handoverChannel_.native_handle();
+
+		std::error_code dontCare;
+		handoverAcceptor_.close(dontCare);
+		std::remove(config::handoverPath.c_str());
+
+		trace("handover: started");
+
+#ifdef VNCREPEATER_HAS_URING
+		// a multishot accept holds on to its listening socket after it is closed here, and would go on taking connections
+		if (relayUrings) {
+			for (auto& accept : uringAccepts_) {
+				relayUrings->cancel(*accept);
+			}
+		}
+#endif
+
+		// from here on, new connections queue in the listening sockets until the new process accepts them
+		for (auto& shard : ioShards_) {
+			bool sent = runOn(shard->serverStrand_, [channel, &shard]() {
+				return sendListener(channel, shard->serverAcceptor_, HandoverKind::serverListener);
+			}) && runOn(shard->viewerStrand_, [channel, &shard]() {
+				return sendListener(channel, shard->viewerAcceptor_, HandoverKind::viewerListener);
+			});
+
+			if (!sent) {
+				trace("handover: failed to pass on the listening sockets");
+				handoverChannel_.close(dontCare);
+				return;
+			}
+		}
+
+		// handshakes already under way still come to this broker
+		auto deadline = chrono::steady_clock::now() + chrono::seconds(config::rfbInitTimeout) + chrono::milliseconds(2 * config::wheelTick);
+		while (pendingHandshakes.load() && chrono::steady_clock::now() < deadline) {
+			this_thread::sleep_for(chrono::milliseconds(10));
+		}
+
+		auto waiting = broker_.takeWaiting();
+		for (auto& pConnection : waiting) {
+			runOn(pConnection->strand_, [channel, &pConnection]() {
+				pConnection->handOver(channel);
+				return true;
+			});
+		}
+
+		// the new process starts its own metrics endpoint once the channel closes
+		if (metrics_) {
+			runOn(metrics_->strand(), [this]() {
+				metrics_->stop();
+				return true;
+			});
+		}
+
+		handoverChannel_.close(dontCare);
+
+		string text = "handover: handed over " + to_string(waiting.size()) + " waiting connections";
+		trace(text.c_str());
+
+		ioShards_.front()->ioService_.post([this]() {
+			drain();
+		});
+	}
+
+	static bool sendListener(int channel, asio::ip::tcp::acceptor& acceptor, HandoverKind kind)
+	{
+		if (!platform::sendSocket(channel, acceptor.native_handle(), handoverMessage(kind))) {
+			return false;
+		}
+
+		std::error_code dontCare;
+		acceptor.close(dontCare);
+		return true;
+	}
+#endif
+
+	void drain()
+	{
+		drainTimer_.expires_from_now(std::chrono::seconds(1));
+		drainTimer_.async_wait([this](const std::error_code& ec) {
+			if (ec) {
+				return;
+			}
+
+			if (!activeSessions.load()) {
+				trace("handover: all sessions have ended");
+				stop();
+				return;
+			}
+
+			drain();
+		});
+	}
+
+	// keep config::pendingAccepts accepts in flight for `role` on the shard
+	void startAccepting(IoShard& shard, const HandshakeRole& role)
+	{
+#ifdef VNCREPEATER_HAS_URING
+		// one multishot accept replaces the accepts kept in flight
+		if (relayUrings) {
+			uringAccepts_.emplace_back(new UringAccept(*this, shard, role));
+			uringAccept(*uringAccepts_.back());
+			return;
+		}
+#endif
+
+		for (size_t i = 0; i < config::pendingAccepts; ++i) {
+			accept(shard, role);
+		}
 	}
 
-	void acceptNewViewer()
+	// accept the next connection for `role` on the shard, and start its handshake.
+	// each completed accept arms the next one, so the number in flight stays the same
+	void accept(IoShard& shard, const HandshakeRole& role)
 	{
-		auto pIncomingConnection = std::make_shared<IncomingConnection>(ioService_);
-		viewerAcceptor_.async_accept(pIncomingConnection->connection_.socket_, viewerStrand_.wrap([this, pIncomingConnection](const std::error_code& ec) {
-			if (!ioService_.stopped()) {
-				acceptNewViewer();
+		auto& acceptor = role.viewer ? shard.viewerAcceptor_ : shard.serverAcceptor_;
+		auto& strand = role.viewer ? shard.viewerStrand_ : shard.serverStrand_;
+
+		auto pIncomingConnection = IncomingConnection::create(shard.ioService_);
+		pIncomingConnection->role_ = &role;
+
+		acceptor.async_accept(pIncomingConnection->connection_.socket_, strand.wrap(MakeBufferedHandler(pIncomingConnection->handler_, [this, &shard, &role, &acceptor, pIncomingConnection](const std::error_code& ec) {
+			// the listening socket is closed once handed over
+			if (!shard.ioService_.stopped() && acceptor.is_open()) {
+				accept(shard, role);
 			}
 
+			// every pending accept is aborted when the listening socket closes, which isn't worth a log line each
+			if (ec == asio::error::operation_aborted) {
+				return;
+			}
 			if (ec) {
-				error(ec, pIncomingConnection->connection_, "acceptNewViewer");
+				role.counters->failedAccepts.add();
+				error(ec, pIncomingConnection->connection_, role.category);
 				return;
 			}
 
-			pIncomingConnection->connection_.onConnected();
+			accepted(pIncomingConnection);
+		})));
+	}
+
+	// start the handshake of a connection just accepted for its role
+	void accepted(const shared_ptr<IncomingConnection>& pIncomingConnection)
+	{
+		auto& role = *pIncomingConnection->role_;
+
+		role.counters->accepted.add();
+		role.counters->inProgress.add();
+		pIncomingConnection->acceptedAt_ = chrono::steady_clock::now();
+
+		pIncomingConnection->connection_.onConnected();
+
+		info(pIncomingConnection->connection_, role.category, "accepted");
+
+		pIncomingConnection->timeout_.schedule(wheels_.local(), pIncomingConnection, &IncomingConnection::onTimeout, std::chrono::seconds(config::rfbInitTimeout));
 
-			info(pIncomingConnection->connection_, "acceptNewViewer", "accepted");
+		handshake(pIncomingConnection);
+	}
+
+#ifdef VNCREPEATER_HAS_URING
+	void uringAccept(UringAccept& accept)
+	{
+		auto& acceptor = accept.role.viewer ? accept.shard.viewerAcceptor_ : accept.shard.serverAcceptor_;
+		relayUrings->local().acceptMultishot(acceptor.native_handle(), accept);
+	}
+
+	// one connection accepted, or the multishot accept failed; it goes on while `more` is set,
+	// and otherwise is armed again like the asio accepts
+	void uringAccepted(UringAccept& accept, int result, bool more)
+	{
+		auto& strand = accept.role.viewer ? accept.shard.viewerStrand_ : accept.shard.serverStrand_;
+
+		strand.dispatch([this, &accept, result, more]() {
+			auto& shard = accept.shard;
+			auto& role = accept.role;
+			auto& acceptor = role.viewer ? shard.viewerAcceptor_ : shard.serverAcceptor_;
+
+			auto pIncomingConnection = IncomingConnection::create(shard.ioService_);
+			pIncomingConnection->role_ = &role;
 
-			// setup init timeout
-			pIncomingConnection->timeout_.expires_from_now(std::chrono::seconds(config::rfbInitTimeout));
-			pIncomingConnection->timeout_.async_wait(viewerStrand_.wrap([this, pIncomingConnection](const std::error_code& ec) {
+			std::error_code ec;
+			if (result >= 0) {
+				pIncomingConnection->connection_.socket_.assign(asio::ip::tcp::v4(), result, ec);
 				if (ec) {
-					if (ec != asio::error::operation_aborted) {
-						error(ec, pIncomingConnection->connection_, "acceptNewViewer-timeout");
-					}
-					// probably cancelled
-					return;
+					::close(result);
 				}
+			}
+			else {
+				ec = std::error_code(-result, asio::error::get_system_category());
+			}
 
-				std::error_code dontCare;
-				pIncomingConnection->connection_.socket_.shutdown(asio::socket_base::shutdown_both, dontCare);
-			}));
+			if (!ec) {
+				accepted(pIncomingConnection);
+			}
+			// cancelled when the listening socket is handed over, and not worth a log line
+			else if (result != -ECANCELED) {
+				role.counters->failedAccepts.add();
+				error(ec, pIncomingConnection->connection_, role.category);
+			}
 
-			// send protocol version
-			async_write(pIncomingConnection->connection_.socket_, asio::buffer(rfbProtocolVersion, _countof(rfbProtocolVersion) - 1), viewerStrand_.wrap([this, pIncomingConnection](const std::error_code& ec, size_t bytesTransferred) {
-				if (ec) {
-					error(ec, pIncomingConnection->connection_, "acceptNewViewer-writeProtocol");
-					return;
+			if (more || result == -ECANCELED || shard.ioService_.stopped() || !acceptor.is_open()) {
+				return;
+			}
+
+			// a kernel without multishot accept refuses it outright
+			if (result == -EINVAL) {
+				trace("uring: multishot accept is not supported, so listening sockets use epoll");
+				for (size_t i = 0; i < config::pendingAccepts; ++i) {
+					this->accept(shard, role);
 				}
+				return;
+			}
 
-				// read connection info
-				async_read(pIncomingConnection->connection_.socket_, asio::buffer(pIncomingConnection->infoBuffer_), viewerStrand_.wrap([this, pIncomingConnection](const std::error_code& ec, size_t bytesTransferred) {
+			uringAccept(accept);
+		});
+	}
+#endif
 
-					std::error_code dontCare;
-					pIncomingConnection->timeout_.cancel(dontCare);
+	// start the current step of the handshake, as the connection's role lists it
+	void handshake(const shared_ptr<IncomingConnection>& pIncomingConnection)
+	{
+		auto& socket = pIncomingConnection->connection_.socket_;
+		auto step = pIncomingConnection->role_->steps[pIncomingConnection->step_].step;
 
-					if (ec) {
-						error(ec, pIncomingConnection->connection_, "acceptNewViewer-readInfo");
-						return;
-					}
+		auto completed = pIncomingConnection->strand_.wrap(MakeBufferedHandler(pIncomingConnection->handler_, [this, pIncomingConnection](const std::error_code& ec, size_t) {
+			stepCompleted(pIncomingConnection, ec);
+		}));
 
-					pIncomingConnection->parseInfo();
+		switch (step) {
+		case HandshakeStep::writeBanner:
+			async_write(socket, asio::buffer(rfbProtocolVersion, sizeof(rfbProtocolVersion) - 1), completed);
+			break;
 
-					if (pIncomingConnection->connection_.id.empty()) {
-						error(asio::error::invalid_argument, pIncomingConnection->connection_, "acceptNewViewer-readInfo", "no ID");
-						return;
-					}
+		case HandshakeStep::readInfo:
+			async_read(socket, asio::buffer(pIncomingConnection->infoBuffer_), completed);
+			break;
 
-					info(pIncomingConnection->connection_, "acceptNewViewer", "established");
+		case HandshakeStep::readBanner:
+			async_read(socket, asio::buffer(pIncomingConnection->rfbBuffer_), completed);
+			break;
 
-					broker_.postPendingViewer(pIncomingConnection);
-				}));
-			}));
-		}));
+		case HandshakeStep::done:
+			pIncomingConnection->timeout_.cancel();
+
+			pIncomingConnection->connection_.established = chrono::steady_clock::now();
+			handshakeLatency.record(pIncomingConnection->connection_.established - pIncomingConnection->acceptedAt_);
+			pIncomingConnection->role_->counters->inProgress.add(-1);
+
+			handOff(pIncomingConnection, pIncomingConnection->role_->viewer);
+			break;
+		}
+	}
+
+	void stepCompleted(const shared_ptr<IncomingConnection>& pIncomingConnection, const std::error_code& ec)
+	{
+		auto& connection = pIncomingConnection->connection_;
+		auto& role = *pIncomingConnection->role_;
+		auto& step = role.steps[pIncomingConnection->step_];
+
+		if (ec) {
+			if (pIncomingConnection->timedOut_) {
+				role.counters->timedOut.add();
+			}
+			else {
+				role.counters->failedSteps[pIncomingConnection->step_].add();
+			}
+			role.counters->inProgress.add(-1);
+
+			error(ec, connection, step.category);
+			pIncomingConnection->timeout_.cancel();
+			return;
+		}
+
+		if (step.step == HandshakeStep::readInfo) {
+			pIncomingConnection->parseInfo();
+
+			if (connection.id.empty()) {
+				role.counters->noId.add();
+				role.counters->inProgress.add(-1);
+				error(asio::error::invalid_argument, connection, step.category, "no ID");
+				pIncomingConnection->timeout_.cancel();
+				return;
+			}
+
+			info(connection, role.category, "established");
+		}
+		else if (step.step == HandshakeStep::readBanner) {
+			pIncomingConnection->parseRfbVersion();
+		}
+
+		++pIncomingConnection->step_;
+		handshake(pIncomingConnection);
+	}
+private:
+	static vector<unique_ptr<IoShard>> makeIoShards(uint16_t serverPort, uint16_t viewerPort, const vector<pair<int, int>>& listeners)
+	{
+		vector<unique_ptr<IoShard>> shards;
+
+		// carry on with the layout of the process taken over from, as far as there are io threads for it
+		if (!listeners.empty()) {
+			asio::io_service closing;
+
+			for (size_t index = 0; index < listeners.size(); ++index) {
+				if (index < ioCores().size()) {
+					shards.emplace_back(new IoShard());
+					shards.back()->adopt(listeners[index].first, listeners[index].second);
+					continue;
+				}
+
+				asio::ip::tcp::acceptor serverAcceptor(closing);
+				asio::ip::tcp::acceptor viewerAcceptor(closing);
+				serverAcceptor.assign(asio::ip::tcp::v4(), listeners[index].first);
+				viewerAcceptor.assign(asio::ip::tcp::v4(), listeners[index].second);
+			}
+
+			if (shards.size() < listeners.size()) {
+				trace("takeover: more listening sockets than io threads; connections queued in the others are lost");
+			}
+			return shards;
+		}
+
+		if (config::perCoreIo || config::workStealing) {
+			auto shardCount = ioCores().size();
+			for (size_t index = 0; index < shardCount; ++index) {
+				shards.emplace_back(new IoShard());
+				if (!shards.back()->listen(serverPort, viewerPort, true)) {
+					shards.clear();
+					trace("perCoreIo: SO_REUSEPORT is not available, so all io threads share one io_service");
+					break;
+				}
+			}
+		}
+
+		if (shards.empty()) {
+			shards.emplace_back(new IoShard());
+			shards.back()->listen(serverPort, viewerPort, false);
+		}
+
+		return shards;
+	}
+
+	static vector<asio::io_service*> mapThreadServices(const vector<unique_ptr<IoShard>>& shards)
+	{
+		vector<asio::io_service*> services;
+		for (auto index = 0U; index < ioCores().size(); ++index) {
+			services.push_back(&shards[index % shards.size()]->ioService_);
+		}
+		return services;
 	}
 };
 
+#ifdef VNCREPEATER_HAS_HANDOVER
+// take over from a repeater listening for a handover on `path`, if one is running
+Inheritance takeOver(const string& path)
+{
+	Inheritance inheritance;
+
+	asio::io_service ioService;
+	asio::local::stream_protocol::socket channel(ioService);
+
+	std::error_code ec;
+	channel.connect(asio::local::stream_protocol::endpoint(path), ec);
+	if (ec) {
+		return inheritance;
+	}
+
+	vector<uint8_t> message;
+	int serverListener = -1;
+
+	for (;;) {
+		int socket = platform::receiveSocket(channel.native_handle(), message);
+		if (socket < 0) {
+			break;
+		}
+
+		auto kind = message.empty() ? HandoverKind() : (HandoverKind)message[0];
+
+		trunk::OpenInfo openInfo;
+		if (kind == HandoverKind::serverListener && serverListener < 0) {
+			serverListener = socket;
+		}
+		else if (kind == HandoverKind::viewerListener && serverListener >= 0) {
+			inheritance.listeners.emplace_back(serverListener, socket);
+			serverListener = -1;
+		}
+		else if (kind == HandoverKind::waiting && trunk::decodeOpen(message.data() + 1, message.size() - 1, openInfo) && !openInfo.id.empty()) {
+			inheritance.waiting.emplace_back(move(openInfo), socket);
+		}
+		else {
+			asio::ip::tcp::socket unknown(ioService);
+			unknown.assign(asio::ip::tcp::v4(), socket, ec);
+		}
+	}
+
+	string text = "takeover: took over " + to_string(inheritance.listeners.size()) + " listening sockets and " + to_string(inheritance.waiting.size()) + " waiting connections";
+	trace(text.c_str());
+
+	return inheritance;
+}
+#endif
+
 int InitService()
 {
 	config::traceToConsole = false;
-	resetCurrentDirectory();
+	platform::resetCurrentDirectory();
 	return 0;
 }
 
-Server theServer;
+// created once the command line has been parsed
+unique_ptr<Server> theServer;
 
 int RunApplication()
 {
-	auto coreCount = std::thread::hardware_concurrency();
-	auto coreStep = 1U;
-
-	if (coreCount == 3) {
-		coreCount = 2;
-	}
-	if (coreCount < 1) {
-		coreCount = 1;
-	}
-	if (coreCount > 16) {
-		coreCount = 16;
-	}
-
-	// adjust coreStep to only run on even cores.
-	// this really does not need that many cores anyway!
-
-	if (coreCount >= 4) {
-		coreStep = 2;
-	}
+	auto cores = ioCores();
 
 	{
 		ostringstream header;
 		header << "vncRepeater" << "\r\n";
 
-		for (auto core = 0U; core < coreCount; core += coreStep) {
+		for (auto core : cores) {
 			header << "\t... running on core " << core << "\r\n";
 		}
 
@@ -594,56 +3663,121 @@ int RunApplication()
 	}
 	
 
-	theServer.acceptNewServer();
-	theServer.acceptNewViewer();
+	theServer->wheels_.start();
+	theServer->reportStats();
+	theServer->startTrunks();
+
+	if (config::metricsPort) {
+		theServer->startMetrics();
+	}
+
+#ifdef VNCREPEATER_HAS_HANDOVER
+	if (!config::handoverPath.empty()) {
+		theServer->listenForHandover();
+	}
+#endif
+
+	for (auto& shard : theServer->ioShards_) {
+		theServer->startAccepting(*shard, serverRole);
+		theServer->startAccepting(*shard, viewerRole);
+		theServer->probeScheduling(*shard);
+	}
 
 	vector<thread> threads;
 
 
-	for (auto core = 0U; core < coreCount; core += coreStep) {
-		threads.push_back(thread([core]() {
-			::SetThreadIdealProcessor(::GetCurrentThread(), core);
+	for (auto index = 0U; index < cores.size(); ++index) {
+		threads.push_back(thread([index, core = cores[index]]() {
+			platform::setCurrentThreadCore(core);
+			setIoThreadIndex(index);
+
+			if (theServer->scheduler_) {
+				theServer->scheduler_->run(index);
+				return;
+			}
 
-			while (!theServer.ioService_.stopped()) {
-				auto ran = theServer.ioService_.run();
+			auto& ioService = *theServer->threadServices_[index];
+
+			while (!ioService.stopped()) {
+				auto ran = ioService.run();
 			}
 		}));
 	}
 
-	vector<HANDLE> threadHandles;
 	for (auto& thread : threads) {
-		threadHandles.push_back(thread.native_handle());
+		thread.join();
 	}
 
-	int ret = ::WaitForMultipleObjects((DWORD)threadHandles.size(), &threadHandles[0], TRUE, INFINITE);
-
-	for (auto& thread : threads) {
-		thread.join();
+#ifdef VNCREPEATER_HAS_HANDOVER
+	if (theServer->handoverThread_.joinable()) {
+		theServer->handoverThread_.join();
 	}
+#endif
 
 	return 0;
 }
 
 int StopApplication()
 {
-	if (!theServer.ioService_.stopped()) {
-		theServer.ioService_.stop();
+	if (theServer && !theServer->stopped()) {
+		theServer->stop();
 		trace("requested stop");
 		return 1;
 	}
 	return 0;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-	::SetConsoleCtrlHandler(&ConsoleCtrlHandler, TRUE);
+	if (!config::parseCommandLine(argc, argv)) {
+		return 1;
+	}
+
+	// sessions on a trunk live in the process which accepted the trunk, so there is no way to hand them over
+	if (!config::handoverPath.empty() && config::trunkPort) {
+		puts("--handover can't be combined with --trunkPort");
+		return 1;
+	}
+
+#ifndef _WIN32
+	// no service dispatcher moves us to the log directory here, so do it now; the handover socket
+	// is still named from where we were started
+	if (!config::handoverPath.empty() && config::handoverPath.front() != '/') {
+		char startedIn[PATH_MAX];
+		if (::getcwd(startedIn, sizeof(startedIn))) {
+			config::handoverPath = string(startedIn) + "/" + config::handoverPath;
+		}
+	}
+	platform::resetCurrentDirectory();
+#endif
+
+	Inheritance inheritance;
+#ifdef VNCREPEATER_HAS_HANDOVER
+	if (!config::handoverPath.empty()) {
+		inheritance = takeOver(config::handoverPath);
+	}
+#else
+	if (!config::handoverPath.empty()) {
+		trace("handover: not available on this system");
+	}
+#endif
+
+	theServer = make_unique<Server>(inheritance);
+	theServer->adoptWaiting(inheritance.waiting);
+
+	InstallStopHandler(theServer->ioShards_.front()->ioService_);
 	
 	int ret = BeginService();
 
-	if (ERROR_FAILED_SERVICE_CONTROLLER_CONNECT == ret) {
+	if (serviceNotStarted == ret) {
 		ret = RunApplication();
 	}
 
+	// while this thread's pools and the logger are still there for the sessions it closes
+	theServer.reset();
+
+	stopTrace();
+
 	return ret;
 }
 
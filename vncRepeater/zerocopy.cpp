@@ -0,0 +1,144 @@
+#include "stdafx.h"
+#include "zerocopy.h"
+
+#ifdef VNCREPEATER_HAS_ZEROCOPY
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+constexpr std::chrono::milliseconds ZerocopySends::pacedWait;
+
+bool ZerocopySends::open(asio::ip::tcp::socket& socket)
+{
+	std::error_code ec;
+	auto protocol = socket.local_endpoint(ec).protocol();
+	if (ec) {
+		return false;
+	}
+
+	int enable = 1;
+	if (0 != ::setsockopt(socket.native_handle(), SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable))) {
+		return false;
+	}
+
+	int watched = ::fcntl(socket.native_handle(), F_DUPFD_CLOEXEC, 0);
+	if (watched < 0) {
+		return false;
+	}
+
+	std::unique_ptr<asio::ip::tcp::socket> watch(new asio::ip::tcp::socket(socket.get_io_service()));
+	watch->assign(protocol, watched, ec);
+	if (ec) {
+		::close(watched);
+		return false;
+	}
+
+	watch_ = std::move(watch);
+	pace_.reset(new asio::steady_timer(socket.get_io_service()));
+	return true;
+}
+
+void ZerocopySends::close()
+{
+	watch_.reset();
+	pace_.reset();
+
+	first_ = 0;
+	count_ = 0;
+	nextId_ = 0;
+	nextDone_ = false;
+	kernelCopies_ = false;
+}
+
+void ZerocopySends::sent(size_t bytes)
+{
+	sends_[(first_ + count_) % slots] = { nextId_++, bytes, nextDone_ };
+	++count_;
+
+	nextDone_ = false;
+}
+
+void ZerocopySends::copied(size_t bytes)
+{
+	sends_[(first_ + count_ - 1) % slots].bytes += bytes;
+}
+
+size_t ZerocopySends::reap(bool& reported, std::error_code& ec)
+{
+	ec.clear();
+	reported = false;
+
+	for (;;) {
+		char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+
+		msghdr message = {};
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		if (::recvmsg(watch_->native_handle(), &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				ec = std::error_code(errno, asio::error::get_system_category());
+			}
+			break;
+		}
+
+		reported = true;
+
+		for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+			if (!(header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR)
+				&& !(header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR)) {
+				continue;
+			}
+
+			auto report = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(header));
+			if (report->ee_origin != SO_EE_ORIGIN_ZEROCOPY || report->ee_errno != 0) {
+				continue;
+			}
+
+			// sends ee_info to ee_data inclusive are done; the numbers wrap
+			uint32_t span = report->ee_data - report->ee_info;
+			for (size_t i = 0; i < count_; ++i) {
+				auto& send = sends_[(first_ + i) % slots];
+				if (send.id - report->ee_info <= span) {
+					send.done = true;
+				}
+			}
+			if (nextId_ - report->ee_info <= span) {
+				nextDone_ = true;
+			}
+
+			if (report->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				kernelCopies_ = true;
+			}
+		}
+	}
+
+	size_t released = 0;
+	while (count_ && sends_[first_].done) {
+		released += sends_[first_].bytes;
+		first_ = (first_ + 1) % slots;
+		--count_;
+	}
+	return released;
+}
+
+#endif
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "asio.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <system_error>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/errqueue.h>)
+#define VNCREPEATER_HAS_ZEROCOPY 1
+#endif
+#endif
+
+#ifdef VNCREPEATER_HAS_ZEROCOPY
+
+#include <sys/socket.h>
+
+// older C libraries lack these, though the kernel has them from 4.14
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+// sends on a socket made with MSG_ZEROCOPY, which the kernel transmits straight from user memory
+// instead of copying it into the socket buffer. that memory can't be reused until the kernel reports
+// on the socket's error queue that it has finished with the send, so each one is held here, in the
+// order sent, until it has been. the kernel numbers the sends and reports ranges of them, in no
+// particular order, so a send is only released once every send before it has been.
+class ZerocopySends
+{
+public:
+	// sends which can be outstanding at once; beyond these, sends are copied as usual
+	static constexpr size_t slots = 8;
+
+	ZerocopySends()
+	{}
+
+	ZerocopySends(const ZerocopySends&) = delete;
+	ZerocopySends& operator=(const ZerocopySends&) = delete;
+
+	// allow MSG_ZEROCOPY on `socket`, and open a second handle to it for watching the error queue.
+	// false where the kernel can't, or for sockets which aren't TCP
+	bool open(asio::ip::tcp::socket& socket);
+
+	// close the second handle and forget every send, so this can be opened on another socket
+	void close();
+
+	bool isOpen() const
+	{
+		return watch_ != nullptr;
+	}
+
+	bool empty() const
+	{
+		return count_ == 0;
+	}
+
+	bool full() const
+	{
+		return count_ == slots;
+	}
+
+	// `bytes` went out in one send with MSG_ZEROCOPY
+	void sent(size_t bytes);
+
+	// `bytes` were copied by an ordinary send while earlier sends are outstanding; the space they
+	// took is released along with the latest of those
+	void copied(size_t bytes);
+
+	// the kernel has copied a send after all, as it does over loopback and to devices without
+	// scatter-gather, where MSG_ZEROCOPY only adds the cost of the notifications
+	bool kernelCopies() const
+	{
+		return kernelCopies_;
+	}
+
+	// wait until the kernel may have something to report. a report raises EPOLLERR, which asio passes
+	// to operations waiting for out of band data; VNC sends none. arming the wait re-evaluates the
+	// socket, so a report queued beforehand completes it at once. the wait is on the second handle, so
+	// reads and writes on the socket itself are untouched.
+	// a socket which has hung up or failed completes every wait at once, so with `paced` the wait is
+	// a short timer instead
+	template <typename Handler>
+	void asyncWait(bool paced, Handler&& handler)
+	{
+		if (paced) {
+			pace_->expires_from_now(pacedWait);
+			pace_->async_wait([handler = std::forward<Handler>(handler)](const std::error_code& ec) mutable {
+				handler(ec, 0);
+			});
+			return;
+		}
+
+		watch_->async_receive(asio::null_buffers(), asio::socket_base::message_out_of_band, std::forward<Handler>(handler));
+	}
+
+	// read what the kernel has reported, and return how many bytes, from the oldest send, it is done
+	// with. `reported` is set if there was anything to read
+	size_t reap(bool& reported, std::error_code& ec);
+
+private:
+	struct Send
+	{
+		uint32_t id;
+		size_t bytes;
+		bool done;
+	};
+
+	static constexpr std::chrono::milliseconds pacedWait{ 10 };
+
+	std::unique_ptr<asio::ip::tcp::socket> watch_;
+	std::unique_ptr<asio::steady_timer> pace_;
+
+	std::array<Send, slots> sends_;
+	size_t first_ = 0;
+	size_t count_ = 0;
+
+	// the number the kernel gives the socket's next send with MSG_ZEROCOPY, and whether it has reported
+	// it already; a send can be reported before its completion handler gets to record it
+	uint32_t nextId_ = 0;
+	bool nextDone_ = false;
+
+	bool kernelCopies_ = false;
+};
+
+#endif